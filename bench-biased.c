@@ -0,0 +1,317 @@
+#include "lib.c"
+
+/*
+    The locks biased to one side of libsync.h, with and without membarrier.
+
+    Runs, each with the asymmetric fences on membarrier and with the light
+    fence made a full one, as on a kernel without membarrier:
+        mutex    -- lock and unlock alone, the futex mutex of lib.h to compare;
+        biased   -- the owner alone;
+        rwlock   -- a read lock and unlock alone, the rwlock of libsync.h;
+        brlock   -- a reader alone;
+        biased-  -- the owner against OTHERS threads taking the lock too,
+        shared      each one checking that the two counters it guards are
+                    equal and adding one to both;
+        brlock-  -- READERS readers against a writer rewriting the payload
+        shared      every WRITE_EVERY_US microseconds, each reader checking
+                    the payload is whole, with a read lock taken again
+                    inside every other time.
+
+    The output is CSV: lock,membarrier,threads,fast_ops,ns_per_fast_op,slow_ops.
+    The fast side is the owner or the readers, the slow side the others or
+    the writer. ns_per_fast_op is the time of a thread over its operations;
+    alone, it is what a lock and an unlock cost.
+*/
+
+#define ALONE_OPS       (1 << 22)
+#define RUN_MS          50
+#define OTHERS          2
+#define READERS         4
+#define WRITE_EVERY_US  100
+#define PAYLOAD_WORDS   8
+
+static struct
+{
+    mutex_t         mutex;
+    rwlock_t        rwlock;
+    biased_lock_t   biased;
+    brlock_t        brlock;
+    u64             counters[2];
+    u64             payload[PAYLOAD_WORDS];
+} shared;
+
+typedef struct _side_t
+{
+    u64     ops;
+} __attribute__((aligned(CACHE_LINE_SIZE))) side_t;
+
+static volatile u32 stop;
+static barrier_t start;
+static side_t sides[READERS + OTHERS + 1];
+
+static void report(const char* lock, u64 threads, u64 fast_ops, u64 fast_threads, u64 ns, u64 slow_ops)
+{
+    print_fmt("%s,%s,%llu,%llu,%.3f,%llu\r\n", lock, membarrier_expedited ? "yes" : "no", threads, fast_ops,
+              fast_ops != 0 ? (double)ns * fast_threads / fast_ops : 0.0, slow_ops);
+}
+
+static void run_alone(void)
+{
+    u64 start_ns = monotonic_ns();
+
+    for (u64 i = 0; i < ALONE_OPS; ++i)
+    {
+        mutex_lock(&shared.mutex);
+        mutex_unlock(&shared.mutex);
+    }
+
+    report("mutex", 1, ALONE_OPS, 1, monotonic_ns() - start_ns, 0);
+
+    start_ns = monotonic_ns();
+
+    for (u64 i = 0; i < ALONE_OPS; ++i)
+    {
+        biased_lock(&shared.biased);
+        biased_unlock(&shared.biased);
+    }
+
+    report("biased", 1, ALONE_OPS, 1, monotonic_ns() - start_ns, 0);
+
+    start_ns = monotonic_ns();
+
+    for (u64 i = 0; i < ALONE_OPS; ++i)
+    {
+        rwlock_read_lock(&shared.rwlock);
+        rwlock_read_unlock(&shared.rwlock);
+    }
+
+    report("rwlock", 1, ALONE_OPS, 1, monotonic_ns() - start_ns, 0);
+
+    start_ns = monotonic_ns();
+
+    for (u64 i = 0; i < ALONE_OPS; ++i)
+    {
+        brlock_read_lock(&shared.brlock);
+        brlock_read_unlock(&shared.brlock);
+    }
+
+    report("brlock", 1, ALONE_OPS, 1, monotonic_ns() - start_ns, 0);
+}
+
+/* The owner and the others alike */
+static void biased_step(void)
+{
+    biased_lock(&shared.biased);
+
+    if (shared.counters[0] != shared.counters[1])
+    {
+        fatal("Two threads in the biased lock", shared.counters[0]);
+    }
+
+    ++shared.counters[0];
+    ++shared.counters[1];
+
+    biased_unlock(&shared.biased);
+}
+
+static u64 biased_other_thread(void* param)
+{
+    side_t* side = (side_t*)param;
+    u64 ops = 0;
+
+    barrier_wait(&start);
+
+    while (!stop)
+    {
+        biased_step();
+        ++ops;
+    }
+
+    side->ops = ops;
+
+    return 0;
+}
+
+static void payload_check(void)
+{
+    for (u64 i = 1; i < PAYLOAD_WORDS; ++i)
+    {
+        if (shared.payload[i] != shared.payload[0])
+        {
+            fatal("A reader in with the writer", i);
+        }
+    }
+}
+
+static u64 brlock_reader_thread(void* param)
+{
+    side_t* side = (side_t*)param;
+    u64 ops = 0;
+
+    barrier_wait(&start);
+
+    while (!stop)
+    {
+        brlock_read_lock(&shared.brlock);
+
+        payload_check();
+
+        if (ops & 1)
+        {
+            brlock_read_lock(&shared.brlock);
+            payload_check();
+            brlock_read_unlock(&shared.brlock);
+        }
+
+        brlock_read_unlock(&shared.brlock);
+        ++ops;
+    }
+
+    side->ops = ops;
+
+    return 0;
+}
+
+static u64 brlock_writer_thread(void* param)
+{
+    side_t* side = (side_t*)param;
+    u64 ops = 0;
+
+    barrier_wait(&start);
+
+    while (!stop)
+    {
+        sleep_ns(WRITE_EVERY_US * 1000ULL);
+
+        brlock_write_lock(&shared.brlock);
+
+        for (u64 i = 0; i < PAYLOAD_WORDS; ++i)
+        {
+            shared.payload[i] = ops + 1;
+        }
+
+        brlock_write_unlock(&shared.brlock);
+        ++ops;
+    }
+
+    side->ops = ops;
+
+    return 0;
+}
+
+/*
+    The fast side runs on the calling thread for the biased lock, the
+    owner, and on threads of its own for the brlock.
+*/
+static void run_shared(u32 biased)
+{
+    thread_t* threads[READERS + OTHERS + 1];
+    const u64 count = biased ? OTHERS : READERS + 1;
+
+    shared.counters[0] = shared.counters[1] = 0;
+    memset(sides, 0, sizeof(sides));
+    stop = 0;
+    barrier_init(&start, count + 1);
+
+    for (u64 i = 0; i < count; ++i)
+    {
+        threads[i] = create_thread(biased ? biased_other_thread :
+                                   i < READERS ? brlock_reader_thread : brlock_writer_thread,
+                                   &sides[i], NULL);
+
+        if (threads[i] == NULL)
+        {
+            fatal("create_thread", i);
+        }
+    }
+
+    barrier_wait(&start);
+
+    const u64 begin = monotonic_ns();
+    u64 owner_ops = 0;
+
+    if (biased)
+    {
+        while (monotonic_ns() - begin < RUN_MS * 1000000ULL)
+        {
+            biased_step();
+            ++owner_ops;
+        }
+    }
+    else
+    {
+        sleep_ns(RUN_MS * 1000000ULL);
+    }
+
+    stop = 1;
+
+    for (u64 i = 0; i < count; ++i)
+    {
+        thread_join(threads[i]);
+    }
+
+    const u64 elapsed = monotonic_ns() - begin;
+
+    if (biased)
+    {
+        u64 other_ops = 0;
+
+        for (u64 i = 0; i < OTHERS; ++i)
+        {
+            other_ops += sides[i].ops;
+        }
+
+        if (shared.counters[0] != owner_ops + other_ops)
+        {
+            fatal("Lost increments", owner_ops + other_ops - shared.counters[0]);
+        }
+
+        report("biased-shared", OTHERS + 1, owner_ops, 1, elapsed, other_ops);
+    }
+    else
+    {
+        u64 reads = 0;
+
+        for (u64 i = 0; i < READERS; ++i)
+        {
+            reads += sides[i].ops;
+        }
+
+        report("brlock-shared", READERS + 1, reads, READERS, elapsed, sides[READERS].ops);
+    }
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    mutex_init(&shared.mutex);
+    rwlock_init(&shared.rwlock);
+    biased_lock_init(&shared.biased);
+    brlock_init(&shared.brlock);
+
+    print("lock,membarrier,threads,fast_ops,ns_per_fast_op,slow_ops");
+    println();
+
+    /* Nothing is in the locks between the runs, the fences may change */
+    const u32 membarrier = membarrier_expedited;
+
+    for (u32 with = membarrier; ; with = 0)
+    {
+        membarrier_expedited = with;
+
+        run_alone();
+        run_shared(1);
+        run_shared(0);
+
+        if (with == 0)
+        {
+            break;
+        }
+    }
+
+    membarrier_expedited = membarrier;
+
+    sys_exit(0);
+}
@@ -0,0 +1,137 @@
+/* NUM_FIBERS alive at once would take more mappings than allowed with the guards, see libfiber.h */
+#define FIBER_GUARD_SIZE 0
+#include "lib.c"
+
+/*
+    Fibers.
+
+    Two runs:
+        switch -- one carrier, two fibers yielding to each other, the cost
+                  of a switch including the TLS block swap;
+        mass   -- a fiber spawns NUM_FIBERS fibers, which yield until all of
+                  them are alive at once, spread over NUM_CARRIERS carriers
+                  by stealing; then each yields NUM_MASS_YIELDS more times and
+                  checks its TLS survived the switches and the migrations.
+*/
+
+#define NUM_SWITCHES        2000000
+#define NUM_FIBERS          100000
+#define NUM_CARRIERS        4
+#define NUM_MASS_YIELDS     8
+
+static __thread u64 fiber_local = 1;
+
+static volatile u64 mass_live;
+static volatile u64 mass_peak;
+static volatile u32 mass_go;
+
+void ping_pong(void* param)
+{
+    for (u64 i = 0; i < NUM_SWITCHES/2; ++i)
+    {
+        fiber_yield();
+    }
+}
+
+void mass_fiber(void* param)
+{
+    if (fiber_local != 1)
+    {
+        fatal("Fiber TLS not initialized", fiber_local);
+    }
+
+    fiber_local = (u64)param;
+
+    while (!mass_go)
+    {
+        fiber_yield();
+    }
+
+    for (u64 i = 0; i < NUM_MASS_YIELDS; ++i)
+    {
+        fiber_yield();
+    }
+
+    if (fiber_local != (u64)param)
+    {
+        fatal("Fiber TLS clobbered", fiber_local);
+    }
+
+    atomic_fetch_sub(&mass_live, 1, ATOMIC_RELAXED);
+}
+
+void mass_spawner(void* param)
+{
+    for (u64 i = 0; i < NUM_FIBERS; ++i)
+    {
+        if (fiber_spawn(mass_fiber, (void*)(i + 2)) == NULL)
+        {
+            fatal("fiber_spawn", i);
+        }
+
+        atomic_fetch_add(&mass_live, 1, ATOMIC_RELAXED);
+    }
+
+    mass_peak = mass_live;
+    mass_go = 1;
+}
+
+void bench_switch(void)
+{
+    if (fiber_scheduler_start(1) != 0)
+    {
+        fatal("fiber_scheduler_start", 1);
+    }
+
+    u64 start = monotonic_ns();
+
+    fiber_spawn(ping_pong, NULL);
+    fiber_spawn(ping_pong, NULL);
+
+    fiber_scheduler_stop();
+
+    u64 elapsed = monotonic_ns() - start;
+
+    print("switch: ");
+    print_d64(elapsed * 1000 / NUM_SWITCHES);
+    print(" ps/switch");
+    println();
+}
+
+void bench_mass(void)
+{
+    if (fiber_scheduler_start(NUM_CARRIERS) != 0)
+    {
+        fatal("fiber_scheduler_start", NUM_CARRIERS);
+    }
+
+    u64 start = monotonic_ns();
+
+    fiber_spawn(mass_spawner, NULL);
+
+    fiber_scheduler_stop();
+
+    u64 elapsed = monotonic_ns() - start;
+
+    print("mass:   ");
+    print_d64(NUM_FIBERS);
+    print(" fibers, ");
+    print_d64(mass_peak);
+    print(" alive at once, ");
+    print_d64(NUM_FIBERS * 1000000000ULL / elapsed);
+    print(" fibers/s, ");
+    print_d64(elapsed / NUM_FIBERS);
+    print(" ns/fiber");
+    println();
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    bench_switch();
+    bench_mass();
+
+    sys_exit(0);
+}
@@ -0,0 +1,208 @@
+#include "lib.c"
+
+/*
+    Formatting NUM_VALUES numbers of all magnitudes:
+        h64     -- the print_h64 form, with the conversion print_h64 used to
+                   have (a switch per nibble) against fmt_h64;
+        dec     -- one division per digit against fmt_u64;
+        fmt     -- fmt("%llu %llx %s") into a buffer, per call.
+
+    Only the conversions are timed, nothing is written. The results are
+    checked against each other first.
+*/
+
+#define NUM_VALUES          4000000
+
+static u64 values[1024];
+
+/*
+    The conversion print_h64 used before libfmt
+*/
+
+static void legacy_u8_to_hex(const u8* byte, char* hex)
+{
+    u8 low_nibble = *byte & 0x0f;
+
+    switch (low_nibble)
+    {
+    case 0 ... 9:
+        hex[1] = '0' + low_nibble;
+        break;
+
+    case 10 ... 15:
+        hex[1] = 'a' + low_nibble - 10;
+        break;
+
+    default:
+        fatal("Bad low nibble", __LINE__);
+    }
+
+    u8 high_nibble = *byte >> 4;
+
+    switch (high_nibble)
+    {
+    case 0 ... 9:
+        hex[0] = '0' + high_nibble;
+        break;
+
+    case 10 ... 15:
+        hex[0] = 'a' + high_nibble - 10;
+        break;
+
+    default:
+        fatal("Bad high nibble", __LINE__);
+    }
+}
+
+static void legacy_u16_to_hex(const u8* bytes, char* hex)
+{
+    legacy_u8_to_hex(bytes, hex + 2);
+    legacy_u8_to_hex(bytes + 1, hex);
+}
+
+static void legacy_h64(char* hex_str, u64 number)
+{
+    for (u64 i = 0; i < FMT_H64_CHARS; ++i)
+    {
+        hex_str[i] = '0';
+    }
+
+    hex_str[1] = 'x';
+    hex_str[6] = '_';
+    hex_str[11] = '_';
+    hex_str[16] = '_';
+
+    legacy_u16_to_hex((const u8*)&number, hex_str + 17);
+    legacy_u16_to_hex(((const u8*)&number) + 2, hex_str + 12);
+    legacy_u16_to_hex(((const u8*)&number) + 4, hex_str + 7);
+    legacy_u16_to_hex(((const u8*)&number) + 6, hex_str + 2);
+}
+
+static u64 legacy_d64(char* out, u64 number)
+{
+    char dec_str[20];
+    u64 pos = sizeof(dec_str);
+
+    do
+    {
+        dec_str[--pos] = '0' + number % 10;
+        number /= 10;
+    } while (number != 0);
+
+    memcpy(out, dec_str + pos, sizeof(dec_str) - pos);
+
+    return sizeof(dec_str) - pos;
+}
+
+/*
+    xorshift64, shifted right by a varying amount to get every number of digits
+*/
+static void values_init(void)
+{
+    u64 x = 0x9e3779b97f4a7c15ULL;
+
+    for (u64 i = 0; i < sizeof(values)/sizeof(values[0]); ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        values[i] = x >> (i % 64);
+    }
+}
+
+static void check(void)
+{
+    for (u64 i = 0; i < sizeof(values)/sizeof(values[0]); ++i)
+    {
+        char a[32];
+        char b[32];
+
+        legacy_h64(a, values[i]);
+        fmt_h64(b, values[i]);
+
+        if (memcmp(a, b, FMT_H64_CHARS) != 0)
+        {
+            fatal("fmt_h64 mismatch", values[i]);
+        }
+
+        const u64 len = legacy_d64(a, values[i]);
+
+        if (fmt_u64(b, values[i]) != len || memcmp(a, b, len) != 0)
+        {
+            fatal("fmt_u64 mismatch", values[i]);
+        }
+    }
+
+    char buf[96];
+    const char* expected = "42 ff text -7 |   12|0x0000_0000_0000_00ab|3.142|0012|-5000000000|1.23e+300";
+
+    fmt(buf, sizeof(buf), "%u %x %s %d |%5llu|%h|%.3f|%04llx|%lld|%.2f", 42, 255, "text", -7, 12ULL, 0xabULL, 3.14159, 0x12ULL,
+        -5000000000LL, 1.234e300);
+
+    if (strlen(buf) != strlen(expected) || memcmp(buf, expected, strlen(expected)) != 0)
+    {
+        print(buf);
+        println();
+        fatal("fmt mismatch", strlen(buf));
+    }
+}
+
+static void report(const char* name, u64 elapsed)
+{
+    print_fmt("%-12s %6llu ps/value, %5llu Mvalues/s\r\n", name, elapsed * 1000 / NUM_VALUES, NUM_VALUES * 1000ULL / elapsed);
+}
+
+#define VALUE(i) values[(i) % (sizeof(values)/sizeof(values[0]))]
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    values_init();
+    check();
+
+    char buf[64];
+    volatile u64 sink = 0;
+    u64 start;
+
+    start = monotonic_ns();
+    for (u64 i = 0; i < NUM_VALUES; ++i)
+    {
+        legacy_h64(buf, VALUE(i));
+        sink += buf[i % FMT_H64_CHARS];
+    }
+    report("h64 legacy", monotonic_ns() - start);
+
+    start = monotonic_ns();
+    for (u64 i = 0; i < NUM_VALUES; ++i)
+    {
+        fmt_h64(buf, VALUE(i));
+        sink += buf[i % FMT_H64_CHARS];
+    }
+    report("h64 fmt", monotonic_ns() - start);
+
+    start = monotonic_ns();
+    for (u64 i = 0; i < NUM_VALUES; ++i)
+    {
+        sink += buf[legacy_d64(buf, VALUE(i)) - 1];
+    }
+    report("dec legacy", monotonic_ns() - start);
+
+    start = monotonic_ns();
+    for (u64 i = 0; i < NUM_VALUES; ++i)
+    {
+        sink += buf[fmt_u64(buf, VALUE(i)) - 1];
+    }
+    report("dec fmt", monotonic_ns() - start);
+
+    start = monotonic_ns();
+    for (u64 i = 0; i < NUM_VALUES; ++i)
+    {
+        sink += fmt(buf, sizeof(buf), "%llu %llx %s", VALUE(i), VALUE(i + 1), "text");
+    }
+    report("fmt %llu %llx %s", monotonic_ns() - start);
+
+    sys_exit(0);
+}
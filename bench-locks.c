@@ -0,0 +1,362 @@
+#define THREAD_COUNT_FUTEX_CALLS
+#include "lib.c"
+
+/*
+    The locks under contention.
+
+    1 to as many threads as there are CPUs, up to MAX_THREADS, take a lock
+    in a loop for RUN_MS milliseconds each: cs_work pause instructions with
+    the lock held, think_work after unlocking it, for every pair of the
+    values in cs_works and think_works. The locks:
+        mutex                       -- the futex mutex of lib.h;
+        ticket, mcs, clh            -- the queue locks of libsync.h, spinning only;
+        ticket-park, mcs-park, clh-park -- the same, parking after spinning;
+        rwlock                      -- every RWLOCK_WRITE_EVERY-th acquisition
+                                       writes, the others read.
+
+    The output is CSV, one row per lock and thread count:
+        lock,threads,cs_work,think_work   -- the run;
+        acquisitions,per_sec              -- all the threads together;
+        min,max,jain                      -- per-thread acquisitions, and Jain's
+                                             fairness index: 1 when all the threads
+                                             got the lock as often, 1/threads when
+                                             one of them got it every time;
+        p50_ns,p90_ns,p99_ns,max_ns       -- handoff latency: from an unlock to the
+                                             lock by a thread that had been waiting
+                                             for it, sampled up to SAMPLES times per
+                                             thread, exclusive acquisitions only;
+        syscalls_per_acq                  -- futex calls of the threads over the
+                                             acquisitions, see thread_futex_calls().
+
+    The threads do not outnumber the CPUs: past that, the spinning locks
+    would hand over at the pace of the scheduler.
+*/
+
+#define MAX_THREADS         64
+#define RUN_MS              100
+#define SAMPLES             4096
+#define RWLOCK_WRITE_EVERY  8
+
+enum
+{
+    LOCK_MUTEX,
+    LOCK_TICKET,
+    LOCK_TICKET_PARK,
+    LOCK_MCS,
+    LOCK_MCS_PARK,
+    LOCK_CLH,
+    LOCK_CLH_PARK,
+    LOCK_RWLOCK,
+    LOCK_COUNT
+};
+
+static const char* lock_names[LOCK_COUNT] = {
+    "mutex", "ticket", "ticket-park", "mcs", "mcs-park", "clh", "clh-park", "rwlock"
+};
+
+/* Pause instructions with the lock held, and between the acquisitions */
+static const u64 cs_works[] = { 0, 20, 200 };
+static const u64 think_works[] = { 0, 100, 1000 };
+
+#define CS_WORKS            (sizeof(cs_works)/sizeof(cs_works[0]))
+#define THINK_WORKS         (sizeof(think_works)/sizeof(think_works[0]))
+
+static struct
+{
+    u32             kind;
+    mutex_t         mutex;
+    ticket_lock_t   ticket;
+    mcs_lock_t      mcs;
+    clh_lock_t*     clh;
+    rwlock_t        rwlock;
+    u64             cs_work;
+    u64             think_work;
+} lock __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* A CLH lock is not initialized again once used, each run of the two CLH locks gets its own */
+static clh_lock_t clh_locks[2 * MAX_THREADS * CS_WORKS * THINK_WORKS];
+static u64 clh_locks_used;
+
+/* Written with the lock held exclusively */
+static struct
+{
+    u64 counter;
+    u64 owner;              /* Thread of the last exclusive acquisition */
+    u64 released;           /* cycle_counter at its unlock */
+} shared __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static volatile u32 stop __attribute__((aligned(CACHE_LINE_SIZE)));
+static barrier_t start;
+
+typedef struct _worker_t
+{
+    u64 id;
+    u64 acquisitions;
+    u64 writes;
+    u64 futex_calls;
+    u64 samples;
+    u64 sample[SAMPLES];
+} __attribute__((aligned(CACHE_LINE_SIZE))) worker_t;
+
+static worker_t workers[MAX_THREADS];
+static u64 all_samples[MAX_THREADS * SAMPLES];
+
+static void lock_init(u32 kind, u64 cs_work, u64 think_work)
+{
+    lock.kind = kind;
+    lock.cs_work = cs_work;
+    lock.think_work = think_work;
+
+    mutex_init(&lock.mutex);
+    ticket_lock_init(&lock.ticket, kind == LOCK_TICKET_PARK);
+    mcs_lock_init(&lock.mcs, kind == LOCK_MCS_PARK);
+    rwlock_init(&lock.rwlock);
+
+    if (kind == LOCK_CLH || kind == LOCK_CLH_PARK)
+    {
+        lock.clh = &clh_locks[clh_locks_used++];
+        clh_lock_init(lock.clh, kind == LOCK_CLH_PARK);
+    }
+}
+
+static void lock_acquire(u32 exclusive)
+{
+    switch (lock.kind)
+    {
+    case LOCK_MUTEX:        mutex_lock(&lock.mutex); break;
+    case LOCK_TICKET:
+    case LOCK_TICKET_PARK:  ticket_lock(&lock.ticket); break;
+    case LOCK_MCS:
+    case LOCK_MCS_PARK:     mcs_lock(&lock.mcs); break;
+    case LOCK_CLH:
+    case LOCK_CLH_PARK:     clh_lock(lock.clh); break;
+    case LOCK_RWLOCK:
+        if (exclusive)
+        {
+            rwlock_write_lock(&lock.rwlock);
+        }
+        else
+        {
+            rwlock_read_lock(&lock.rwlock);
+        }
+        break;
+    }
+}
+
+static void lock_release(u32 exclusive)
+{
+    switch (lock.kind)
+    {
+    case LOCK_MUTEX:        mutex_unlock(&lock.mutex); break;
+    case LOCK_TICKET:
+    case LOCK_TICKET_PARK:  ticket_unlock(&lock.ticket); break;
+    case LOCK_MCS:
+    case LOCK_MCS_PARK:     mcs_unlock(&lock.mcs); break;
+    case LOCK_CLH:
+    case LOCK_CLH_PARK:     clh_unlock(lock.clh); break;
+    case LOCK_RWLOCK:
+        if (exclusive)
+        {
+            rwlock_write_unlock(&lock.rwlock);
+        }
+        else
+        {
+            rwlock_read_unlock(&lock.rwlock);
+        }
+        break;
+    }
+}
+
+static void work(u64 count)
+{
+    for (u64 i = 0; i < count; ++i)
+    {
+        cpu_relax();
+    }
+}
+
+static u64 worker_thread(void* param)
+{
+    worker_t* worker = (worker_t*)param;
+    const u64 futex_calls = thread_futex_calls();
+
+    barrier_wait(&start);
+
+    while (!stop)
+    {
+        const u32 exclusive = lock.kind != LOCK_RWLOCK || worker->acquisitions % RWLOCK_WRITE_EVERY == 0;
+        const u64 requested = cycle_counter();
+
+        lock_acquire(exclusive);
+
+        if (exclusive)
+        {
+            /* Waiting when the previous holder let go: a handoff */
+            if (shared.owner != worker->id && (i64)(shared.released - requested) > 0 && worker->samples < SAMPLES)
+            {
+                worker->sample[worker->samples++] = cycle_counter() - shared.released;
+            }
+
+            ++shared.counter;
+            ++worker->writes;
+        }
+
+        work(lock.cs_work);
+
+        if (exclusive)
+        {
+            shared.owner = worker->id;
+            shared.released = cycle_counter();
+        }
+
+        lock_release(exclusive);
+
+        ++worker->acquisitions;
+
+        work(lock.think_work);
+    }
+
+    worker->futex_calls = thread_futex_calls() - futex_calls;
+
+    return 0;
+}
+
+static void sort(u64* values, u64 count)
+{
+    /* Shell sort with Ciura's gaps */
+    static const u64 gaps[] = { 701, 301, 132, 57, 23, 10, 4, 1 };
+
+    for (u64 g = 0; g < sizeof(gaps)/sizeof(gaps[0]); ++g)
+    {
+        const u64 gap = gaps[g];
+
+        for (u64 i = gap; i < count; ++i)
+        {
+            const u64 value = values[i];
+            u64 j = i;
+
+            for (; j >= gap && values[j - gap] > value; j -= gap)
+            {
+                values[j] = values[j - gap];
+            }
+
+            values[j] = value;
+        }
+    }
+}
+
+static u64 percentile(const u64* sorted, u64 count, u64 percent)
+{
+    return count != 0 ? sorted[(count - 1) * percent / 100] : 0;
+}
+
+static u64 ticks_to_ns(u64 ticks, u64 hz)
+{
+    return ticks / hz * 1000000000ULL + ticks % hz * 1000000000ULL / hz;
+}
+
+static void run(u32 kind, u64 threads, u64 cs_work, u64 think_work, u64 hz)
+{
+    thread_t* thread[MAX_THREADS];
+
+    lock_init(kind, cs_work, think_work);
+    shared.counter = 0;
+    shared.owner = (u64)-1;
+    shared.released = 0;
+    stop = 0;
+    barrier_init(&start, threads + 1);
+
+    for (u64 i = 0; i < threads; ++i)
+    {
+        memset(&workers[i], 0, sizeof(worker_t));
+        workers[i].id = i;
+
+        thread[i] = create_thread(worker_thread, &workers[i], NULL);
+
+        if (thread[i] == NULL)
+        {
+            fatal("create_thread", i);
+        }
+    }
+
+    barrier_wait(&start);
+
+    const u64 begin = monotonic_ns();
+
+    sleep_ns(RUN_MS * 1000000ULL);
+
+    stop = 1;
+
+    for (u64 i = 0; i < threads; ++i)
+    {
+        thread_join(thread[i]);
+    }
+
+    const u64 elapsed = monotonic_ns() - begin;
+
+    u64 total = 0, writes = 0, futex_calls = 0, samples = 0;
+    u64 min = (u64)-1, max = 0, squares = 0;
+
+    for (u64 i = 0; i < threads; ++i)
+    {
+        const worker_t* worker = &workers[i];
+
+        total += worker->acquisitions;
+        writes += worker->writes;
+        futex_calls += worker->futex_calls;
+        squares += worker->acquisitions * worker->acquisitions;
+
+        min = worker->acquisitions < min ? worker->acquisitions : min;
+        max = worker->acquisitions > max ? worker->acquisitions : max;
+
+        memcpy(all_samples + samples, worker->sample, worker->samples * sizeof(u64));
+        samples += worker->samples;
+    }
+
+    if (shared.counter != writes)
+    {
+        fatal("Lost updates", writes - shared.counter);
+    }
+
+    sort(all_samples, samples);
+
+    const double jain = squares != 0 ? (double)total * total / ((double)threads * squares) : 0;
+
+    print_fmt("%s,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.3f,%llu,%llu,%llu,%llu,%.3f\r\n",
+              lock_names[kind], threads, cs_work, think_work,
+              total, total * 1000000000ULL / elapsed, min, max, jain,
+              ticks_to_ns(percentile(all_samples, samples, 50), hz),
+              ticks_to_ns(percentile(all_samples, samples, 90), hz),
+              ticks_to_ns(percentile(all_samples, samples, 99), hz),
+              ticks_to_ns(samples != 0 ? all_samples[samples - 1] : 0, hz),
+              total != 0 ? (double)futex_calls / total : 0.0);
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    const u64 hz = cycle_counter_hz();
+    const u64 cpus = cpu_count();
+    const u64 max_threads = cpus < MAX_THREADS ? cpus : MAX_THREADS;
+
+    print("lock,threads,cs_work,think_work,acquisitions,per_sec,min,max,jain,p50_ns,p90_ns,p99_ns,max_ns,syscalls_per_acq");
+    println();
+
+    for (u64 cs = 0; cs < CS_WORKS; ++cs)
+    {
+        for (u64 think = 0; think < THINK_WORKS; ++think)
+        {
+            for (u32 kind = 0; kind < LOCK_COUNT; ++kind)
+            {
+                for (u64 threads = 1; threads <= max_threads; ++threads)
+                {
+                    run(kind, threads, cs_works[cs], think_works[think], hz);
+                }
+            }
+        }
+    }
+
+    sys_exit(0);
+}
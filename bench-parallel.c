@@ -0,0 +1,205 @@
+#include "lib.c"
+
+/*
+    The parallel loops of libparallel.h on an array of N numbers.
+
+    Runs, each with both schedules on 1 to MAX_THREADS threads, the caller
+    and the workers of the pool:
+        sum  -- parallel_reduce adding the array up;
+        scan -- the inclusive prefix sums of the array in place, in three
+                steps: a parallel_for summing each block of SCAN_BLOCK
+                numbers, the sums of the blocks scanned by the caller, and
+                a parallel_for scanning each block from the sum before it.
+    The numbers are uneven, so that a wrong split shows; every result is
+    checked against the one computed sequentially.
+
+    The output is CSV: run,schedule,threads,n,grain,ms,ns_per_item,speedup.
+    speedup is against the same run with the same schedule on one thread.
+*/
+
+#define N               (1ULL << 22)
+#define SCAN_BLOCK      4096
+#define BLOCKS          (N / SCAN_BLOCK)
+#define SUM_GRAIN       16384
+#define MAX_THREADS     4
+#define REPEAT          8
+
+static const char* schedule_names[] = { "static", "dynamic" };
+
+static u64 data[N];
+static u64 scanned[N];
+static u64 expected[N];
+static u64 block_sums[BLOCKS];
+
+static void data_fill(u64* values)
+{
+    for (u64 i = 0; i < N; ++i)
+    {
+        values[i] = (i * 0x9e3779b97f4a7c15ULL) >> 54;
+    }
+}
+
+static u64 sum_part(u64 begin, u64 end, u64 partial, void* ctx)
+{
+    const u64* values = (const u64*)ctx;
+
+    for (u64 i = begin; i < end; ++i)
+    {
+        partial += values[i];
+    }
+
+    return partial;
+}
+
+static u64 sum_combine(u64 left, u64 right, void* ctx)
+{
+    (void)ctx;
+
+    return left + right;
+}
+
+static void scan_sum_blocks(u64 begin, u64 end, void* ctx)
+{
+    (void)ctx;
+
+    for (u64 b = begin; b < end; ++b)
+    {
+        block_sums[b] = sum_part(b * SCAN_BLOCK, (b + 1) * SCAN_BLOCK, 0, scanned);
+    }
+}
+
+static void scan_blocks(u64 begin, u64 end, void* ctx)
+{
+    (void)ctx;
+
+    for (u64 b = begin; b < end; ++b)
+    {
+        /* The blocks before this one, summed up */
+        u64 sum = b != 0 ? block_sums[b - 1] : 0;
+
+        for (u64 i = b * SCAN_BLOCK; i < (b + 1) * SCAN_BLOCK; ++i)
+        {
+            sum += scanned[i];
+            scanned[i] = sum;
+        }
+    }
+}
+
+static void scan(u32 schedule)
+{
+    parallel_for(0, BLOCKS, 1, schedule, scan_sum_blocks, NULL);
+
+    for (u64 b = 1; b < BLOCKS; ++b)
+    {
+        block_sums[b] += block_sums[b - 1];
+    }
+
+    parallel_for(0, BLOCKS, 1, schedule, scan_blocks, NULL);
+}
+
+static u64 run_sum(u32 schedule, u64 expected_sum)
+{
+    const u64 start = monotonic_ns();
+
+    for (u64 r = 0; r < REPEAT; ++r)
+    {
+        const u64 sum = parallel_reduce(0, N, SUM_GRAIN, schedule, 0, sum_part, sum_combine, data);
+
+        if (sum != expected_sum)
+        {
+            fatal("Wrong sum", sum);
+        }
+    }
+
+    return (monotonic_ns() - start) / REPEAT;
+}
+
+static u64 run_scan(u32 schedule)
+{
+    u64 elapsed = 0;
+
+    for (u64 r = 0; r < REPEAT; ++r)
+    {
+        memcpy(scanned, data, sizeof(data));
+
+        const u64 start = monotonic_ns();
+
+        scan(schedule);
+
+        elapsed += monotonic_ns() - start;
+
+        for (u64 i = 0; i < N; ++i)
+        {
+            if (scanned[i] != expected[i])
+            {
+                fatal("Wrong prefix sum", i);
+            }
+        }
+    }
+
+    return elapsed / REPEAT;
+}
+
+static void report(const char* run, u32 schedule, u64 threads, u64 grain, u64 ns, u64 base_ns)
+{
+    print_fmt("%s,%s,%llu,%llu,%llu,%llu.%03llu,%.3f,%.3f\r\n", run, schedule_names[schedule], threads, N, grain,
+              ns / 1000000, ns / 1000 % 1000, (double)ns / N, (double)base_ns / ns);
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    data_fill(data);
+
+    /* The sequential results */
+    u64 expected_sum = 0;
+
+    for (u64 i = 0; i < N; ++i)
+    {
+        expected_sum += data[i];
+        expected[i] = expected_sum;
+    }
+
+    print("run,schedule,threads,n,grain,ms,ns_per_item,speedup");
+    println();
+
+    u64 sum_base[2] = { 0, 0 }, scan_base[2] = { 0, 0 };
+
+    for (u64 threads = 1; threads <= MAX_THREADS; threads *= 2)
+    {
+        /* One thread: the pool is not started, the loops run on the caller */
+        if (threads > 1)
+        {
+            i64 s = pool_start(threads - 1);
+
+            if (s != 0)
+            {
+                fatal("pool_start", s);
+            }
+        }
+
+        for (u32 schedule = PARALLEL_STATIC; schedule <= PARALLEL_DYNAMIC; ++schedule)
+        {
+            const u64 sum_ns = run_sum(schedule, expected_sum);
+            const u64 scan_ns = run_scan(schedule);
+
+            if (threads == 1)
+            {
+                sum_base[schedule] = sum_ns;
+                scan_base[schedule] = scan_ns;
+            }
+
+            report("sum", schedule, threads, SUM_GRAIN, sum_ns, sum_base[schedule]);
+            report("scan", schedule, threads, SCAN_BLOCK, scan_ns, scan_base[schedule]);
+        }
+
+        if (threads > 1)
+        {
+            pool_stop();
+        }
+    }
+
+    sys_exit(0);
+}
@@ -0,0 +1,168 @@
+#include "lib.c"
+
+/*
+    The work-stealing pool on the doubly recursive Fibonacci.
+
+    Each call above a cutoff spawns fib(n - 1) as a task, computes fib(n - 2)
+    itself, then waits for the task. Runs:
+        seq    -- the plain recursion, the cost of a call without tasks;
+        spawn  -- fib(SPAWN_N) with a task for every call: the cost of a spawn,
+                  a take or a steal, and a wait, over the cost of the call;
+        scale  -- fib(SCALE_N) with the calls below SCALE_CUTOFF done plainly,
+                  on 1 to MAX_WORKERS workers.
+
+    The output is CSV: run,workers,n,cutoff,tasks,ms,ns_per_task,overhead_ns,speedup.
+    overhead_ns is the time per task over that of the seq run for the same n,
+    speedup is against the same run on one worker.
+*/
+
+#define SPAWN_N         25
+#define SCALE_N         32
+#define SCALE_CUTOFF    16
+#define MAX_WORKERS     8
+
+typedef struct _fib_t
+{
+    pool_task_t task;
+    u64         n;
+    u64         cutoff;
+    u64         result;
+} fib_t;
+
+__attribute__((noinline))
+static u64 fib_seq(u64 n)
+{
+    return n < 2 ? n : fib_seq(n - 1) + fib_seq(n - 2);
+}
+
+static void fib_task(void* param)
+{
+    fib_t* fib = (fib_t*)param;
+
+    if (fib->n < 2 || fib->n < fib->cutoff)
+    {
+        fib->result = fib_seq(fib->n);
+
+        return;
+    }
+
+    fib_t child = { .n = fib->n - 1, .cutoff = fib->cutoff };
+    fib_t other = { .n = fib->n - 2, .cutoff = fib->cutoff };
+
+    pool_task_init(&child.task, fib_task, &child);
+    pool_spawn(&child.task);
+
+    fib_task(&other);
+
+    pool_wait(&child.task);
+
+    fib->result = child.result + other.result;
+}
+
+/*
+    Calls of fib_task that spawn a task
+*/
+static u64 fib_spawns(u64 n, u64 cutoff)
+{
+    u64 prev = 0, spawns = 0;
+
+    for (u64 i = 2; i <= n; ++i)
+    {
+        const u64 next = i >= cutoff ? 1 + spawns + prev : 0;
+
+        prev = spawns;
+        spawns = next;
+    }
+
+    return spawns;
+}
+
+static u64 fib_seq_ns(u64 n)
+{
+    const u64 start = monotonic_ns();
+    const u64 result = fib_seq(n);
+    const u64 elapsed = monotonic_ns() - start;
+
+    if (result != fib_seq(n))
+    {
+        fatal("fib_seq", result);
+    }
+
+    return elapsed;
+}
+
+static u64 fib_pool_ns(u64 n, u64 cutoff)
+{
+    fib_t root = { .n = n, .cutoff = cutoff };
+
+    pool_task_init(&root.task, fib_task, &root);
+
+    const u64 start = monotonic_ns();
+
+    pool_spawn(&root.task);
+    pool_wait(&root.task);
+
+    const u64 elapsed = monotonic_ns() - start;
+
+    if (root.result != fib_seq(n))
+    {
+        fatal("Wrong result", root.result);
+    }
+
+    return elapsed;
+}
+
+static void report(const char* run, u64 workers, u64 n, u64 cutoff, u64 tasks, u64 ns, u64 seq_ns, u64 base_ns)
+{
+    const u64 ns_per_task = tasks != 0 ? ns / tasks : 0;
+    const i64 overhead = tasks != 0 ? ((i64)ns - (i64)seq_ns) / (i64)tasks : 0;
+
+    print_fmt("%s,%llu,%llu,%llu,%llu,%llu.%03llu,%llu,%lld,%.3f\r\n", run, workers, n, cutoff, tasks,
+              ns / 1000000, ns / 1000 % 1000, ns_per_task, overhead, (double)base_ns / ns);
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    print("run,workers,n,cutoff,tasks,ms,ns_per_task,overhead_ns,speedup");
+    println();
+
+    /* Warm up */
+    fib_seq_ns(SCALE_N);
+
+    const u64 seq_spawn_ns = fib_seq_ns(SPAWN_N);
+    const u64 seq_scale_ns = fib_seq_ns(SCALE_N);
+
+    report("seq", 0, SPAWN_N, 0, 0, seq_spawn_ns, seq_spawn_ns, seq_spawn_ns);
+    report("seq", 0, SCALE_N, 0, 0, seq_scale_ns, seq_scale_ns, seq_scale_ns);
+
+    u64 spawn_base = 0, scale_base = 0;
+
+    for (u64 workers = 1; workers <= MAX_WORKERS; workers *= 2)
+    {
+        i64 s = pool_start(workers);
+
+        if (s != 0)
+        {
+            fatal("pool_start", s);
+        }
+
+        const u64 spawn_ns = fib_pool_ns(SPAWN_N, 0);
+        const u64 scale_ns = fib_pool_ns(SCALE_N, SCALE_CUTOFF);
+
+        pool_stop();
+
+        if (workers == 1)
+        {
+            spawn_base = spawn_ns;
+            scale_base = scale_ns;
+        }
+
+        report("spawn", workers, SPAWN_N, 0, fib_spawns(SPAWN_N, 0), spawn_ns, seq_spawn_ns, spawn_base);
+        report("scale", workers, SCALE_N, SCALE_CUTOFF, fib_spawns(SCALE_N, SCALE_CUTOFF), scale_ns, seq_scale_ns, scale_base);
+    }
+
+    sys_exit(0);
+}
@@ -0,0 +1,199 @@
+#define THREAD_COUNT_FUTEX_CALLS
+#include "lib.c"
+
+/*
+    The bounded MPMC queue of libqueue.h.
+
+    1 to MAX_PAIRS producers and as many consumers pass MESSAGES values
+    through a queue of CAPACITY cells, each producer pushing its share and
+    each consumer popping its share. The modes:
+        spin -- mpmc_try_push and mpmc_try_pop, a pause instruction after
+                each failed try;
+        wait -- mpmc_push_wait and mpmc_pop_wait, sleeping on a futex while
+                the queue is full or empty.
+
+    The output is CSV: mode,pairs,capacity,messages,ms,per_sec,ns_per_msg,syscalls_per_msg.
+    syscalls_per_msg are the futex calls of all the threads over the messages,
+    see thread_futex_calls().
+
+    With more threads than CPUs, the spinning threads only get out of each
+    other's way at the pace of the scheduler.
+*/
+
+#define MAX_PAIRS       4
+#define MESSAGES        (1 << 17)
+#define CAPACITY        1024
+
+enum
+{
+    MODE_SPIN,
+    MODE_WAIT,
+    MODE_COUNT
+};
+
+static const char* mode_names[MODE_COUNT] = { "spin", "wait" };
+
+typedef struct _side_t
+{
+    u64     index;
+    u64     count;          /* Values to push or pop */
+    u64     sum;            /* Of the values popped */
+    u64     futex_calls;
+} __attribute__((aligned(CACHE_LINE_SIZE))) side_t;
+
+static mpmc_queue_t queue;
+static barrier_t start;
+static u32 mode;
+static side_t producers[MAX_PAIRS];
+static side_t consumers[MAX_PAIRS];
+
+static u64 producer_thread(void* param)
+{
+    side_t* side = (side_t*)param;
+    const u64 futex_calls = thread_futex_calls();
+
+    barrier_wait(&start);
+
+    for (u64 i = 0; i < side->count; ++i)
+    {
+        /* Never 0, and different for each producer */
+        const u64 value = (side->index << 32) | (i + 1);
+
+        if (mode == MODE_SPIN)
+        {
+            while (!mpmc_try_push(&queue, value))
+            {
+                cpu_relax();
+            }
+        }
+        else
+        {
+            mpmc_push_wait(&queue, value);
+        }
+    }
+
+    side->futex_calls = thread_futex_calls() - futex_calls;
+
+    return 0;
+}
+
+static u64 consumer_thread(void* param)
+{
+    side_t* side = (side_t*)param;
+    const u64 futex_calls = thread_futex_calls();
+    u64 sum = 0;
+
+    barrier_wait(&start);
+
+    for (u64 i = 0; i < side->count; ++i)
+    {
+        u64 value;
+
+        if (mode == MODE_SPIN)
+        {
+            while (!mpmc_try_pop(&queue, &value))
+            {
+                cpu_relax();
+            }
+        }
+        else
+        {
+            value = mpmc_pop_wait(&queue);
+        }
+
+        sum += value;
+    }
+
+    side->sum = sum;
+    side->futex_calls = thread_futex_calls() - futex_calls;
+
+    return 0;
+}
+
+static void run(u32 run_mode, u64 pairs)
+{
+    thread_t* thread[2*MAX_PAIRS];
+    const u64 share = MESSAGES / pairs;
+
+    i64 s = mpmc_queue_init(&queue, CAPACITY);
+
+    if (s != 0)
+    {
+        fatal("mpmc_queue_init", s);
+    }
+
+    mode = run_mode;
+    barrier_init(&start, 2*pairs + 1);
+
+    for (u64 i = 0; i < pairs; ++i)
+    {
+        memset(&producers[i], 0, sizeof(side_t));
+        memset(&consumers[i], 0, sizeof(side_t));
+
+        producers[i].index = consumers[i].index = i;
+        producers[i].count = consumers[i].count = share;
+
+        thread[2*i] = create_thread(producer_thread, &producers[i], NULL);
+        thread[2*i + 1] = create_thread(consumer_thread, &consumers[i], NULL);
+
+        if (thread[2*i] == NULL || thread[2*i + 1] == NULL)
+        {
+            fatal("create_thread", i);
+        }
+    }
+
+    barrier_wait(&start);
+
+    const u64 begin = monotonic_ns();
+
+    for (u64 i = 0; i < 2*pairs; ++i)
+    {
+        thread_join(thread[i]);
+    }
+
+    const u64 elapsed = monotonic_ns() - begin;
+
+    /* Each producer pushed (index << 32) + 1 + ... + (index << 32) + share */
+    u64 expected = 0, sum = 0, futex_calls = 0;
+
+    for (u64 i = 0; i < pairs; ++i)
+    {
+        expected += (i << 32) * share + share * (share + 1) / 2;
+        sum += consumers[i].sum;
+        futex_calls += producers[i].futex_calls + consumers[i].futex_calls;
+    }
+
+    if (sum != expected)
+    {
+        fatal("Lost messages", expected - sum);
+    }
+
+    mpmc_queue_free(&queue);
+
+    const u64 messages = share * pairs;
+
+    print_fmt("%s,%llu,%u,%llu,%llu.%03llu,%llu,%llu,%.3f\r\n",
+              mode_names[run_mode], pairs, CAPACITY, messages,
+              elapsed / 1000000, elapsed / 1000 % 1000,
+              messages * 1000000000ULL / elapsed, elapsed / messages,
+              (double)futex_calls / messages);
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    print("mode,pairs,capacity,messages,ms,per_sec,ns_per_msg,syscalls_per_msg");
+    println();
+
+    for (u32 run_mode = 0; run_mode < MODE_COUNT; ++run_mode)
+    {
+        for (u64 pairs = 1; pairs <= MAX_PAIRS; pairs *= 2)
+        {
+            run(run_mode, pairs);
+        }
+    }
+
+    sys_exit(0);
+}
@@ -0,0 +1,341 @@
+#include "lib.c"
+
+/*
+    The read side of the reclamation schemes of libreclaim.h.
+
+    1 to MAX_READERS threads walk a list of LIST_LEN nodes for RUN_MS
+    milliseconds each, summing the values. The schemes:
+        none   -- plain loads, safe only with nothing retired;
+        hazard -- a hazard slot set for every node, hand over hand;
+        epoch  -- a critical section around every walk.
+    With a writer, another thread keeps replacing the nodes one by one with
+    copies, retiring the old ones; they come back to it once freed. The
+    writer marks the link out of a node before it replaces the node, so
+    that a hazard reader finding the mark starts the walk again.
+
+    The output is CSV: scheme,readers,writer,walks,per_sec,ns_per_node,overhead_ns,replaced,freed.
+    ns_per_node is the time over all the nodes read by all the readers,
+    overhead_ns the same over that of the none run with as many readers.
+    Every node retired is checked to be freed after the threads have exited.
+*/
+
+#define MAX_READERS     4
+#define RUN_MS          100
+#define LIST_LEN        16
+#define NODES           4096
+
+enum
+{
+    SCHEME_NONE,
+    SCHEME_HAZARD,
+    SCHEME_EPOCH,
+    SCHEME_COUNT
+};
+
+static const char* scheme_names[SCHEME_COUNT] = { "none", "hazard", "epoch" };
+
+typedef struct _node_t node_t;
+
+struct _node_t
+{
+    reclaim_node_t      reclaim;        /* First, the address the hazard slots hold */
+    node_t* volatile    next;           /* Bit 0 set: the node is being replaced */
+    u64                 value;
+};
+
+typedef struct _reader_t
+{
+    u64     walks;
+    u64     sum;
+} __attribute__((aligned(CACHE_LINE_SIZE))) reader_t;
+
+static node_t nodes[NODES];
+static node_t* free_nodes;
+static node_t* volatile head;
+static u64 replaced;
+static u64 freed;
+
+static u32 scheme;
+static volatile u32 stop;
+static barrier_t start;
+static reader_t readers[MAX_READERS];
+
+#define NODE_MARK       1ULL
+#define node_marked(p)  (((u64)(p) & NODE_MARK) != 0)
+#define node_unmark(p)  ((node_t*)((u64)(p) & ~NODE_MARK))
+
+static void node_free(reclaim_node_t* node)
+{
+    node_t* n = (node_t*)node;
+
+    n->next = free_nodes;
+    free_nodes = n;
+
+    ++freed;
+}
+
+static node_t* node_alloc(void)
+{
+    if (free_nodes == NULL)
+    {
+        reclaim_collect();
+    }
+
+    node_t* node = free_nodes;
+
+    if (node != NULL)
+    {
+        free_nodes = node->next;
+    }
+
+    return node;
+}
+
+static u64 walk_plain(void)
+{
+    u64 sum = 0;
+
+    for (node_t* node = node_unmark(head); node != NULL; node = node_unmark(node->next))
+    {
+        sum += node->value;
+    }
+
+    return sum;
+}
+
+static u64 walk_hazard(void)
+{
+    u64 sum;
+
+restart:
+    sum = 0;
+
+    u32 slot = 0;
+    node_t* node = hazard_protect(slot, (void* volatile*)&head);
+
+    while (node != NULL)
+    {
+        sum += node->value;
+
+        slot ^= 1;
+
+        node_t* next = hazard_protect(slot, (void* volatile*)&node->next);
+
+        /* 'node' is on its way out, 'next' may be already */
+        if (node_marked(next))
+        {
+            goto restart;
+        }
+
+        node = next;
+    }
+
+    hazard_clear(0);
+    hazard_clear(1);
+
+    return sum;
+}
+
+static u64 walk_epoch(void)
+{
+    epoch_enter();
+
+    const u64 sum = walk_plain();
+
+    epoch_exit();
+
+    return sum;
+}
+
+static u64 reader_thread(void* param)
+{
+    reader_t* reader = (reader_t*)param;
+    u64 walks = 0, sum = 0;
+
+    barrier_wait(&start);
+
+    while (!stop)
+    {
+        switch (scheme)
+        {
+        case SCHEME_NONE:
+            sum += walk_plain();
+            break;
+        case SCHEME_HAZARD:
+            sum += walk_hazard();
+            break;
+        default:
+            sum += walk_epoch();
+            break;
+        }
+
+        ++walks;
+    }
+
+    reader->walks = walks;
+    reader->sum = sum;
+
+    return 0;
+}
+
+static u64 writer_thread(void* param)
+{
+    (void)param;
+
+    barrier_wait(&start);
+
+    for (u64 step = 0; !stop; ++step)
+    {
+        node_t* copy = node_alloc();
+
+        if (copy == NULL)
+        {
+            cpu_relax();
+
+            continue;
+        }
+
+        /* The writer is the only one to change the links */
+        node_t* volatile* link = &head;
+
+        for (u64 i = 0; i < step % LIST_LEN; ++i)
+        {
+            link = &(*link)->next;
+        }
+
+        node_t* node = *link;
+        node_t* next = node->next;
+
+        copy->value = node->value;
+        copy->next = next;
+
+        atomic_store(&node->next, (node_t*)((u64)next | NODE_MARK), ATOMIC_SEQ_CST);
+        atomic_store(link, copy, ATOMIC_RELEASE);
+
+        if (scheme == SCHEME_HAZARD)
+        {
+            hazard_retire(&node->reclaim, node_free);
+        }
+        else
+        {
+            epoch_retire(&node->reclaim, node_free);
+        }
+
+        ++replaced;
+    }
+
+    return 0;
+}
+
+static void list_build(void)
+{
+    free_nodes = NULL;
+
+    for (u64 i = NODES; i-- > LIST_LEN; )
+    {
+        nodes[i].next = free_nodes;
+        free_nodes = &nodes[i];
+    }
+
+    for (u64 i = 0; i < LIST_LEN; ++i)
+    {
+        nodes[i].value = i + 1;
+        nodes[i].next = i + 1 < LIST_LEN ? &nodes[i + 1] : NULL;
+    }
+
+    head = &nodes[0];
+    replaced = freed = 0;
+}
+
+static double run(u32 run_scheme, u64 num_readers, u32 writer, double base_ns_per_node)
+{
+    thread_t* thread[MAX_READERS + 1];
+    const u64 threads = num_readers + writer;
+
+    list_build();
+
+    scheme = run_scheme;
+    stop = 0;
+    barrier_init(&start, threads + 1);
+
+    for (u64 i = 0; i < threads; ++i)
+    {
+        if (i < num_readers)
+        {
+            memset(&readers[i], 0, sizeof(reader_t));
+            thread[i] = create_thread(reader_thread, &readers[i], NULL);
+        }
+        else
+        {
+            thread[i] = create_thread(writer_thread, NULL, NULL);
+        }
+
+        if (thread[i] == NULL)
+        {
+            fatal("create_thread", i);
+        }
+    }
+
+    barrier_wait(&start);
+
+    const u64 begin = monotonic_ns();
+
+    sleep_ns(RUN_MS * 1000000ULL);
+
+    stop = 1;
+
+    for (u64 i = 0; i < threads; ++i)
+    {
+        thread_join(thread[i]);
+    }
+
+    const u64 elapsed = monotonic_ns() - begin;
+
+    /* The writer left what it had not freed, nothing holds it any more */
+    reclaim_collect();
+
+    if (freed != replaced)
+    {
+        fatal("Not freed", replaced - freed);
+    }
+
+    u64 walks = 0;
+
+    for (u64 i = 0; i < num_readers; ++i)
+    {
+        walks += readers[i].walks;
+    }
+
+    const u64 nodes_read = walks * LIST_LEN;
+    const double ns_per_node = nodes_read != 0 ? (double)elapsed / nodes_read : 0;
+
+    print_fmt("%s,%llu,%u,%llu,%llu,%.3f,%.3f,%llu,%llu\r\n",
+              scheme_names[run_scheme], num_readers, writer, walks,
+              walks * 1000000000ULL / elapsed, ns_per_node,
+              base_ns_per_node != 0 ? ns_per_node - base_ns_per_node : 0.0,
+              replaced, freed);
+
+    return ns_per_node;
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    print("scheme,readers,writer,walks,per_sec,ns_per_node,overhead_ns,replaced,freed");
+    println();
+
+    for (u64 num_readers = 1; num_readers <= MAX_READERS; num_readers *= 2)
+    {
+        const double base = run(SCHEME_NONE, num_readers, 0, 0);
+
+        for (u32 writer = 0; writer <= 1; ++writer)
+        {
+            run(SCHEME_HAZARD, num_readers, writer, base);
+            run(SCHEME_EPOCH, num_readers, writer, base);
+        }
+    }
+
+    sys_exit(0);
+}
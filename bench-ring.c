@@ -0,0 +1,264 @@
+#include "lib.c"
+
+/*
+    The double-mapped byte ring of libring.h.
+
+    A producer thread writes RECORDS records of 16 to 8 + 8*MAX_WORDS bytes
+    into a ring of RING_SIZE bytes, in place, and a consumer thread reads
+    them back in place. A record is a header of its length and its number,
+    then words that are a function of both: the consumer checks every one,
+    so a record torn at the end of the ring or read before it was published
+    shows. The records crossing the end of the ring are counted.
+
+    The producer publishes after every 'batch' records it commits, the
+    consumer releases after every 'batch' records it consumes; either does
+    it as well before it waits, when the ring is full or empty. A side that
+    waits spins with a pause instruction.
+
+    The output is CSV: batch,records,bytes,crossing,ms,per_sec,mb_per_sec,publish_per_record,release_per_record.
+    publish_per_record and release_per_record are the stores of 'head' and
+    'tail' over the records: batching makes them fewer, and the other side
+    reads the line less often.
+
+    With fewer CPUs than the two threads, a side that waits spins until the
+    scheduler lets the other run.
+*/
+
+#define RING_SIZE       (1 << 16)
+#define RECORDS         (1 << 17)
+#define MAX_WORDS       15
+#define MAX_BATCH       64
+
+typedef struct _record_t
+{
+    u32     bytes;          /* With the header */
+    u32     number;
+    u64     words[];
+} record_t;
+
+typedef struct _side_t
+{
+    u64     batch;
+    u64     stores;         /* Of 'head' or 'tail' */
+    u64     crossing;       /* Records across the end of the ring */
+} __attribute__((aligned(CACHE_LINE_SIZE))) side_t;
+
+static spsc_ring_t ring;
+static barrier_t start;
+static side_t producer, consumer;
+
+static u64 record_words(u64 number)
+{
+    return 1 + (number * 0x9e3779b97f4a7c15ULL >> 32) % MAX_WORDS;
+}
+
+static u64 record_word(u64 number, u64 index)
+{
+    return number * 0x100000001b3ULL + index;
+}
+
+static u64 producer_thread(void* param)
+{
+    side_t* side = (side_t*)param;
+    u64 stores = 0, crossing = 0, unpublished = 0;
+
+    barrier_wait(&start);
+
+    for (u64 number = 0; number < RECORDS; ++number)
+    {
+        const u64 words = record_words(number);
+        const u64 bytes = sizeof(record_t) + words * sizeof(u64);
+        record_t* record;
+
+        while ((record = (record_t*)spsc_ring_reserve(&ring, bytes)) == NULL)
+        {
+            /* What was committed frees no space until the consumer sees it */
+            if (unpublished != 0)
+            {
+                spsc_ring_publish(&ring);
+                unpublished = 0;
+                ++stores;
+            }
+
+            cpu_relax();
+        }
+
+        record->bytes = (u32)bytes;
+        record->number = (u32)number;
+
+        for (u64 i = 0; i < words; ++i)
+        {
+            record->words[i] = record_word(number, i);
+        }
+
+        if ((u8*)record + bytes > ring.data + ring.size)
+        {
+            ++crossing;
+        }
+
+        spsc_ring_commit(&ring, bytes);
+
+        if (++unpublished == side->batch)
+        {
+            spsc_ring_publish(&ring);
+            unpublished = 0;
+            ++stores;
+        }
+    }
+
+    if (unpublished != 0)
+    {
+        spsc_ring_publish(&ring);
+        ++stores;
+    }
+
+    side->stores = stores;
+    side->crossing = crossing;
+
+    return 0;
+}
+
+static u64 consumer_thread(void* param)
+{
+    side_t* side = (side_t*)param;
+    u64 stores = 0, crossing = 0, unreleased = 0;
+    u64 number = 0;
+
+    barrier_wait(&start);
+
+    while (number < RECORDS)
+    {
+        u64 available;
+        u8* data = (u8*)spsc_ring_peek(&ring, &available);
+
+        if (data == NULL)
+        {
+            /* The producer may be waiting for this space */
+            if (unreleased != 0)
+            {
+                spsc_ring_release(&ring);
+                unreleased = 0;
+                ++stores;
+            }
+
+            cpu_relax();
+
+            continue;
+        }
+
+        while (available != 0)
+        {
+            const record_t* record = (const record_t*)data;
+            const u64 words = record_words(number);
+
+            if (record->number != (u32)number || record->bytes != sizeof(record_t) + words * sizeof(u64)
+                || record->bytes > available)
+            {
+                fatal("Wrong record header", number);
+            }
+
+            for (u64 i = 0; i < words; ++i)
+            {
+                if (record->words[i] != record_word(number, i))
+                {
+                    fatal("Wrong record word", number);
+                }
+            }
+
+            /* Past a record, the data runs on into the second view */
+            if (((u64)(data - ring.data) & ring.mask) + record->bytes > ring.size)
+            {
+                ++crossing;
+            }
+
+            data += record->bytes;
+            available -= record->bytes;
+            ++number;
+
+            spsc_ring_consume(&ring, record->bytes);
+
+            if (++unreleased == side->batch)
+            {
+                spsc_ring_release(&ring);
+                unreleased = 0;
+                ++stores;
+            }
+        }
+    }
+
+    if (unreleased != 0)
+    {
+        spsc_ring_release(&ring);
+        ++stores;
+    }
+
+    side->stores = stores;
+    side->crossing = crossing;
+
+    return 0;
+}
+
+static void run(u64 batch)
+{
+    i64 s = spsc_ring_init(&ring, RING_SIZE);
+
+    if (s != 0)
+    {
+        fatal("spsc_ring_init", s);
+    }
+
+    memset(&producer, 0, sizeof(side_t));
+    memset(&consumer, 0, sizeof(side_t));
+    producer.batch = consumer.batch = batch;
+
+    barrier_init(&start, 3);
+
+    thread_t* threads[2] = {
+        create_thread(producer_thread, &producer, NULL),
+        create_thread(consumer_thread, &consumer, NULL),
+    };
+
+    if (threads[0] == NULL || threads[1] == NULL)
+    {
+        fatal("create_thread", batch);
+    }
+
+    barrier_wait(&start);
+
+    const u64 begin = monotonic_ns();
+
+    thread_join(threads[0]);
+    thread_join(threads[1]);
+
+    const u64 elapsed = monotonic_ns() - begin;
+    const u64 bytes = ring.write;
+
+    if (ring.read != bytes || producer.crossing != consumer.crossing)
+    {
+        fatal("Records lost", bytes - ring.read);
+    }
+
+    spsc_ring_free(&ring);
+
+    print_fmt("%llu,%u,%llu,%llu,%llu.%03llu,%llu,%.3f,%.4f,%.4f\r\n",
+              batch, RECORDS, bytes, consumer.crossing,
+              elapsed / 1000000, elapsed / 1000 % 1000,
+              RECORDS * 1000000000ULL / elapsed, (double)bytes * 1000.0 / elapsed,
+              (double)producer.stores / RECORDS, (double)consumer.stores / RECORDS);
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    print("batch,records,bytes,crossing,ms,per_sec,mb_per_sec,publish_per_record,release_per_record");
+    println();
+
+    for (u64 batch = 1; batch <= MAX_BATCH; batch *= 4)
+    {
+        run(batch);
+    }
+
+    sys_exit(0);
+}
@@ -0,0 +1,253 @@
+#include "lib.c"
+
+/*
+    Reading shared data that is seldom written.
+
+    1 to MAX_READERS threads copy a payload of SMALL_BYTES or LARGE_BYTES
+    for RUN_MS milliseconds each, while a writer rewrites it every
+    WRITE_EVERY_US microseconds. The payload is words all holding the number
+    of the write: a reader finding two different words got a torn copy. The
+    locks:
+        mutex     -- the futex mutex of lib.h;
+        rwlock    -- the reader-writer lock of libsync.h, shared for reading;
+        seqlock   -- the sequence lock: the readers write nothing;
+        mvseqlock -- the same over SEQLOCK_VERSIONS copies of the payload.
+
+    The output is CSV: lock,readers,bytes,reads,per_sec,per_reader,retries_per_read,writes,scaling.
+    scaling is per_sec over that of one reader with the same lock and payload:
+    with a CPU per reader, the sequence locks keep it close to the number of
+    readers.
+*/
+
+#define MAX_READERS     8
+#define RUN_MS          50
+#define WRITE_EVERY_US  100
+#define SMALL_BYTES     64
+#define LARGE_BYTES     4096
+
+enum
+{
+    LOCK_MUTEX,
+    LOCK_RWLOCK,
+    LOCK_SEQLOCK,
+    LOCK_MVSEQLOCK,
+    LOCK_COUNT
+};
+
+static const char* lock_names[LOCK_COUNT] = { "mutex", "rwlock", "seqlock", "mvseqlock" };
+
+typedef struct _reader_t
+{
+    u64     reads;
+    u64     retries;
+} __attribute__((aligned(CACHE_LINE_SIZE))) reader_t;
+
+static struct
+{
+    u32             kind;
+    u64             bytes;
+    mutex_t         mutex;
+    rwlock_t        rwlock;
+    seqlock_t       seqlock;
+    mvseqlock_t     mvseqlock;
+    u64             data[LARGE_BYTES / sizeof(u64)] __attribute__((aligned(CACHE_LINE_SIZE)));
+    u64             copies[SEQLOCK_VERSIONS][LARGE_BYTES / sizeof(u64)] __attribute__((aligned(CACHE_LINE_SIZE)));
+} shared;
+
+static volatile u32 stop;
+static barrier_t start;
+static reader_t readers[MAX_READERS];
+static u64 writes;
+
+static void check(const u64* copy, u64 words)
+{
+    for (u64 i = 1; i < words; ++i)
+    {
+        if (copy[i] != copy[0])
+        {
+            fatal("Torn read", i);
+        }
+    }
+}
+
+static void fill(u64* payload, u64 words, u64 value)
+{
+    for (u64 i = 0; i < words; ++i)
+    {
+        payload[i] = value;
+    }
+}
+
+static u64 reader_thread(void* param)
+{
+    reader_t* reader = (reader_t*)param;
+    const u64 words = shared.bytes / sizeof(u64);
+    u64 copy[LARGE_BYTES / sizeof(u64)];
+    u64 reads = 0, retries = 0;
+
+    barrier_wait(&start);
+
+    while (!stop)
+    {
+        switch (shared.kind)
+        {
+        case LOCK_MUTEX:
+            mutex_lock(&shared.mutex);
+            memcpy(copy, shared.data, shared.bytes);
+            mutex_unlock(&shared.mutex);
+            break;
+        case LOCK_RWLOCK:
+            rwlock_read_lock(&shared.rwlock);
+            memcpy(copy, shared.data, shared.bytes);
+            rwlock_read_unlock(&shared.rwlock);
+            break;
+        case LOCK_SEQLOCK:
+            retries += seqlock_read(&shared.seqlock, copy, shared.data, shared.bytes);
+            break;
+        default:
+            retries += mvseqlock_read(&shared.mvseqlock, copy);
+            break;
+        }
+
+        check(copy, words);
+        ++reads;
+    }
+
+    reader->reads = reads;
+    reader->retries = retries;
+
+    return 0;
+}
+
+static u64 writer_thread(void* param)
+{
+    (void)param;
+
+    const u64 words = shared.bytes / sizeof(u64);
+
+    barrier_wait(&start);
+
+    while (!stop)
+    {
+        sleep_ns(WRITE_EVERY_US * 1000ULL);
+
+        const u64 value = ++writes;
+
+        switch (shared.kind)
+        {
+        case LOCK_MUTEX:
+            mutex_lock(&shared.mutex);
+            fill(shared.data, words, value);
+            mutex_unlock(&shared.mutex);
+            break;
+        case LOCK_RWLOCK:
+            rwlock_write_lock(&shared.rwlock);
+            fill(shared.data, words, value);
+            rwlock_write_unlock(&shared.rwlock);
+            break;
+        case LOCK_SEQLOCK:
+            seqlock_write_begin(&shared.seqlock);
+            fill(shared.data, words, value);
+            seqlock_write_end(&shared.seqlock);
+            break;
+        default:
+            fill(mvseqlock_write_begin(&shared.mvseqlock), words, value);
+            mvseqlock_write_end(&shared.mvseqlock);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static u64 run(u32 kind, u64 num_readers, u64 bytes, u64 base_per_sec)
+{
+    thread_t* thread[MAX_READERS + 1];
+
+    shared.kind = kind;
+    shared.bytes = bytes;
+    mutex_init(&shared.mutex);
+    rwlock_init(&shared.rwlock);
+    seqlock_init(&shared.seqlock);
+    memset(shared.data, 0, sizeof(shared.data));
+    memset(shared.copies, 0, sizeof(shared.copies));
+    mvseqlock_init(&shared.mvseqlock, shared.copies, bytes);
+
+    writes = 0;
+    stop = 0;
+    barrier_init(&start, num_readers + 2);
+
+    for (u64 i = 0; i <= num_readers; ++i)
+    {
+        if (i < num_readers)
+        {
+            memset(&readers[i], 0, sizeof(reader_t));
+            thread[i] = create_thread(reader_thread, &readers[i], NULL);
+        }
+        else
+        {
+            thread[i] = create_thread(writer_thread, NULL, NULL);
+        }
+
+        if (thread[i] == NULL)
+        {
+            fatal("create_thread", i);
+        }
+    }
+
+    barrier_wait(&start);
+
+    const u64 begin = monotonic_ns();
+
+    sleep_ns(RUN_MS * 1000000ULL);
+
+    stop = 1;
+
+    for (u64 i = 0; i <= num_readers; ++i)
+    {
+        thread_join(thread[i]);
+    }
+
+    const u64 elapsed = monotonic_ns() - begin;
+
+    u64 reads = 0, retries = 0;
+
+    for (u64 i = 0; i < num_readers; ++i)
+    {
+        reads += readers[i].reads;
+        retries += readers[i].retries;
+    }
+
+    const u64 per_sec = reads * 1000000000ULL / elapsed;
+
+    print_fmt("%s,%llu,%llu,%llu,%llu,%llu,%.4f,%llu,%.3f\r\n",
+              lock_names[kind], num_readers, bytes, reads, per_sec, per_sec / num_readers,
+              reads != 0 ? (double)retries / reads : 0.0, writes,
+              base_per_sec != 0 ? (double)per_sec / base_per_sec : 1.0);
+
+    return per_sec;
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    print("lock,readers,bytes,reads,per_sec,per_reader,retries_per_read,writes,scaling");
+    println();
+
+    for (u64 bytes = SMALL_BYTES; bytes <= LARGE_BYTES; bytes *= LARGE_BYTES / SMALL_BYTES)
+    {
+        for (u32 kind = 0; kind < LOCK_COUNT; ++kind)
+        {
+            const u64 base = run(kind, 1, bytes, 0);
+
+            for (u64 num_readers = 2; num_readers <= MAX_READERS; num_readers *= 2)
+            {
+                run(kind, num_readers, bytes, base);
+            }
+        }
+    }
+
+    sys_exit(0);
+}
@@ -0,0 +1,64 @@
+#include "lib.c"
+
+/*
+    Spawn/join churn: start a thread, wait for it to exit, repeat.
+
+    Three runs:
+        fresh   -- the idle stacks are unmapped after every join, so every
+                   spawn maps a new stack and faults its pages in, which is
+                   what create_thread did before the stacks were pooled;
+        trimmed -- the idle stacks are kept mapped but their pages are given
+                   back after every join, so only the page faults are paid;
+        pooled  -- the stacks are reused as is.
+*/
+
+#define NUM_SPAWNS          20000
+
+u64 churn_thread(void* param)
+{
+    return 0;
+}
+
+void churn(const char* name, void (*after_join)(void))
+{
+    u64 start = monotonic_ns();
+
+    for (u64 i = 0; i < NUM_SPAWNS; ++i)
+    {
+        thread_t* thread = create_thread(churn_thread, NULL, NULL);
+
+        if (thread == NULL)
+        {
+            fatal("create_thread", i);
+        }
+
+        thread_join(thread);
+
+        if (after_join)
+        {
+            after_join();
+        }
+    }
+
+    u64 elapsed = monotonic_ns() - start;
+
+    print(name);
+    print(": ");
+    print_d64(NUM_SPAWNS * 1000000000ULL / elapsed);
+    print(" threads/s, ");
+    print_d64(elapsed / NUM_SPAWNS);
+    print(" ns/thread");
+    println();
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    churn("fresh  ", thread_stack_pool_release);
+    churn("trimmed", thread_stack_pool_trim);
+    churn("pooled ", NULL);
+
+    sys_exit(0);
+}
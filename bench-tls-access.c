@@ -0,0 +1,604 @@
+#include "lib.c"
+
+/*
+    Ways of reaching thread-local data, timed with the cycle counter.
+
+    Each method is timed for loads and stores of a TLS variable:
+        local-exec  -- what the compiler emits for the programs: %fs:offset
+                       on x64, tpidr_el0 plus an offset on ARM64;
+        fs-asm      -- x64: the same access written by hand, as test-tls.c does;
+        gs-asm      -- x64: GS.base pointed at the same block, %gs:offset;
+        ldt         -- x64: FS loaded with an LDT selector whose descriptor has
+                       the base of a block below 4GiB;
+        tpidr-asm   -- ARM64: tpidr_el0 read by hand on every access;
+        tls_get_addr, tlsdesc -- the dynamic models, for the executable.
+
+    Then the cost of pointing the thread at another TLS block, per method, and
+    the scaling of TLS read-modify-writes with 1 to MAX_THREADS threads running
+    at once, against the same increments on slots sharing a cache line.
+
+    The output is CSV: method,op,threads,cycles_per_op,ns_per_op.
+    The "cycles" are ticks of cycle_counter: TSC ticks on x64, generic timer
+    ticks on ARM64. In the scaling rows, ns_per_op is the wall time of the run
+    over the operations of one thread.
+*/
+
+#define NUM_ITERATIONS      20000000
+#define NUM_SWITCHES        1000000
+#define NUM_SYSCALL_SWITCHES 200000
+#define MAX_THREADS         8
+
+__attribute__((tls_model("local-exec")))
+static __thread volatile u64 counter;
+
+static tls_index_t counter_index;
+static tls_desc_t  counter_desc;
+
+static u64 counter_hz;
+
+static void print_milli(u64 value)
+{
+    print_d64(value / 1000);
+    print(".");
+    print_d64(value / 100 % 10);
+    print_d64(value / 10 % 10);
+    print_d64(value % 10);
+}
+
+static void report(const char* method, const char* op, u64 threads, u64 ticks, u64 wall_ns, u64 iterations)
+{
+    const u64 cycles_milli = ticks * 1000 / iterations;
+    const u64 ns_milli = wall_ns != 0 ? wall_ns * 1000 / iterations : cycles_milli * 1000000000ULL / counter_hz;
+
+    print(method);
+    print(",");
+    print(op);
+    print(",");
+    print_d64(threads);
+    print(",");
+    print_milli(cycles_milli);
+    print(",");
+    print_milli(ns_milli);
+    println();
+}
+
+/*
+    Loads and stores
+*/
+
+static void check_sum(u64 sum)
+{
+    if (sum != NUM_ITERATIONS)
+    {
+        fatal("Wrong sum", sum);
+    }
+}
+
+static void bench_local_exec(void)
+{
+    u64 sum = 0;
+
+    counter = 1;
+
+    u64 start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        sum += counter;
+    }
+
+    report("local-exec", "load", 1, cycle_counter() - start, 0, NUM_ITERATIONS);
+    check_sum(sum);
+
+    start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        counter = i;
+    }
+
+    report("local-exec", "store", 1, cycle_counter() - start, 0, NUM_ITERATIONS);
+}
+
+static void bench_tls_get_addr(void)
+{
+    u64 sum = 0;
+
+    *(volatile u64*)__tls_get_addr(&counter_index) = 1;
+
+    u64 start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        sum += *(volatile u64*)__tls_get_addr(&counter_index);
+    }
+
+    report("tls_get_addr", "load", 1, cycle_counter() - start, 0, NUM_ITERATIONS);
+    check_sum(sum);
+
+    start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        *(volatile u64*)__tls_get_addr(&counter_index) = i;
+    }
+
+    report("tls_get_addr", "store", 1, cycle_counter() - start, 0, NUM_ITERATIONS);
+}
+
+static void bench_tls_desc(void)
+{
+    u64 sum = 0;
+
+    *(volatile u64*)tls_desc_get_addr(&counter_desc) = 1;
+
+    u64 start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        sum += *(volatile u64*)tls_desc_get_addr(&counter_desc);
+    }
+
+    report("tlsdesc", "load", 1, cycle_counter() - start, 0, NUM_ITERATIONS);
+    check_sum(sum);
+
+    start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        *(volatile u64*)tls_desc_get_addr(&counter_desc) = i;
+    }
+
+    report("tlsdesc", "store", 1, cycle_counter() - start, 0, NUM_ITERATIONS);
+}
+
+/*
+    A TLS block to switch to, never accessed
+*/
+static void* other_block(void)
+{
+    const u64 align = tls_layout.align > CACHE_LINE_SIZE ? tls_layout.align : CACHE_LINE_SIZE;
+    u64 block = sys_mmap(0, tls_layout.block_size + align, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+
+    if ((i64)block < 0 && (i64)block >= -4095)
+    {
+        fatal("Cannot map a TLS block", block);
+    }
+
+    return tls_block_build((u8*)((block + align - 1) & ~(align - 1)), 0);
+}
+
+#ifdef __amd64
+
+/*
+    The descriptors only take a 32-bit base: the LDT blocks are in .bss,
+    which the non-PIE executable has below 4GiB.
+*/
+static u64 ldt_blocks[2][8] __attribute__((aligned(CACHE_LINE_SIZE)));
+
+#define LDT_ENTRY_FIRST     1
+
+static u64 ldt_selector(u64 index)
+{
+    /* RPL 3, LDT, index */
+    return 3ULL | (1ULL << 2) | (index << 3);
+}
+
+static void ldt_init(void)
+{
+    for (u64 i = 0; i < 2; ++i)
+    {
+        ldt_entry_t e = {
+            .entry_number = LDT_ENTRY_FIRST + i,
+            .base_addr = (u32)(u64)ldt_blocks[i],
+            .limit = 0,
+            .flags = (1 << 6) | /* Usable */
+                     (1 << 7)   /* Long mode */
+        };
+
+        i64 err_code = sys_x64_write_ldt(&e, sizeof(ldt_entry_t));
+
+        if (err_code != 0)
+        {
+            fatal("Error when setting an entry in LDT", err_code);
+        }
+    }
+}
+
+static void x64_set_fs_selector(u64 selector)
+{
+    asm volatile ("movw %w0, %%fs" : : "r"(selector) : "memory");
+}
+
+/*
+    Loading the null selector leaves the base on some CPUs and clears it on
+    others, the base is written after it.
+*/
+static void x64_restore_fs(void* tp)
+{
+    x64_set_fs_selector(0);
+    x64_set_fs_base((u64)tp);
+}
+
+#define SEG_LOAD(seg, sum, offset) \
+    asm volatile ("addq %%" seg ":(%1), %0" : "+r"(sum) : "r"(offset))
+
+#define SEG_STORE(seg, value, offset) \
+    asm volatile ("movq %0, %%" seg ":(%1)" : : "r"(value), "r"(offset) : "memory")
+
+static void bench_fs_asm(void)
+{
+    const i64 offset = (u8*)&counter - (u8*)tls_get_thread_pointer();
+    u64 sum = 0;
+
+    counter = 1;
+
+    u64 start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        SEG_LOAD("fs", sum, offset);
+    }
+
+    report("fs-asm", "load", 1, cycle_counter() - start, 0, NUM_ITERATIONS);
+    check_sum(sum);
+
+    start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        SEG_STORE("fs", i, offset);
+    }
+
+    report("fs-asm", "store", 1, cycle_counter() - start, 0, NUM_ITERATIONS);
+}
+
+static void bench_gs_asm(void)
+{
+    void* tp = tls_get_thread_pointer();
+    const i64 offset = (u8*)&counter - (u8*)tp;
+    const u64 gs_base = x64_get_gs_base();
+    u64 sum = 0;
+
+    counter = 1;
+
+    x64_set_gs_base((u64)tp);
+
+    u64 start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        SEG_LOAD("gs", sum, offset);
+    }
+
+    u64 load_ticks = cycle_counter() - start;
+
+    start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        SEG_STORE("gs", i, offset);
+    }
+
+    u64 store_ticks = cycle_counter() - start;
+
+    x64_set_gs_base(gs_base);
+
+    report("gs-asm", "load", 1, load_ticks, 0, NUM_ITERATIONS);
+    check_sum(sum);
+    report("gs-asm", "store", 1, store_ticks, 0, NUM_ITERATIONS);
+}
+
+static void bench_ldt(void)
+{
+    void* tp = tls_get_thread_pointer();
+    u64 sum = 0;
+
+    ldt_blocks[0][0] = 1;
+
+    /* No TLS access until FS is restored: print and fatal use it */
+    x64_set_fs_selector(ldt_selector(LDT_ENTRY_FIRST));
+
+    u64 start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        SEG_LOAD("fs", sum, 0);
+    }
+
+    u64 load_ticks = cycle_counter() - start;
+
+    start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        SEG_STORE("fs", i, 0);
+    }
+
+    u64 store_ticks = cycle_counter() - start;
+
+    x64_restore_fs(tp);
+
+    report("ldt", "load", 1, load_ticks, 0, NUM_ITERATIONS);
+    check_sum(sum);
+    report("ldt", "store", 1, store_ticks, 0, NUM_ITERATIONS);
+
+    if (ldt_blocks[0][0] != NUM_ITERATIONS - 1)
+    {
+        fatal("LDT block not written", ldt_blocks[0][0]);
+    }
+}
+
+/*
+    Switching the TLS base back and forth between two blocks
+*/
+
+static void bench_switch(void)
+{
+    void* tp = tls_get_thread_pointer();
+    void* other = other_block();
+
+    if (x64_fsgsbase)
+    {
+        u64 start = cycle_counter();
+
+        for (u64 i = 0; i < NUM_SWITCHES; ++i)
+        {
+            asm volatile ("wrfsbase %0" : : "r"(other) : "memory");
+            asm volatile ("wrfsbase %0" : : "r"(tp) : "memory");
+        }
+
+        report("fs-base-wrfsbase", "switch", 1, cycle_counter() - start, 0, 2*NUM_SWITCHES);
+    }
+
+    u64 start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_SYSCALL_SWITCHES; ++i)
+    {
+        sys_x64_set_fs((u64)other);
+        sys_x64_set_fs((u64)tp);
+    }
+
+    report("fs-base-arch_prctl", "switch", 1, cycle_counter() - start, 0, 2*NUM_SYSCALL_SWITCHES);
+
+    start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_SWITCHES; ++i)
+    {
+        x64_set_fs_selector(ldt_selector(LDT_ENTRY_FIRST + 1));
+        x64_set_fs_selector(ldt_selector(LDT_ENTRY_FIRST));
+    }
+
+    u64 ticks = cycle_counter() - start;
+
+    x64_restore_fs(tp);
+
+    report("ldt", "switch", 1, ticks, 0, 2*NUM_SWITCHES);
+}
+
+#elif defined(__aarch64__)
+
+static void bench_tpidr_asm(void)
+{
+    const i64 offset = (u8*)&counter - (u8*)tls_get_thread_pointer();
+    u64 sum = 0;
+
+    counter = 1;
+
+    u64 start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        u64 value;
+
+        asm volatile (
+            "mrs    %0, tpidr_el0\n"
+            "ldr    %0, [%0, %1]\n"
+            : "=&r"(value)
+            : "r"(offset)
+        );
+
+        sum += value;
+    }
+
+    report("tpidr-asm", "load", 1, cycle_counter() - start, 0, NUM_ITERATIONS);
+    check_sum(sum);
+
+    start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        u64 tp;
+
+        asm volatile (
+            "mrs    %0, tpidr_el0\n"
+            "str    %1, [%0, %2]\n"
+            : "=&r"(tp)
+            : "r"(i), "r"(offset)
+            : "memory"
+        );
+    }
+
+    report("tpidr-asm", "store", 1, cycle_counter() - start, 0, NUM_ITERATIONS);
+}
+
+static void bench_switch(void)
+{
+    void* tp = tls_get_thread_pointer();
+    void* other = other_block();
+
+    u64 start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_SWITCHES; ++i)
+    {
+        asm volatile ("msr tpidr_el0, %0" : : "r"(other) : "memory");
+        asm volatile ("msr tpidr_el0, %0" : : "r"(tp) : "memory");
+    }
+
+    report("tpidr_el0", "switch", 1, cycle_counter() - start, 0, 2*NUM_SWITCHES);
+}
+
+#else
+#   error "Unsupported architecture"
+#endif
+
+/*
+    Scaling: the threads wait on a futex so that they all start together,
+    then each increments its counter NUM_ITERATIONS times.
+*/
+
+typedef enum
+{
+    SCALING_TLS,
+    SCALING_TLSDESC,
+    SCALING_SHARED_LINE,
+} scaling_method_t;
+
+static volatile i32 scaling_go __attribute__((aligned(4)));
+static volatile u64 scaling_shared[MAX_THREADS] __attribute__((aligned(CACHE_LINE_SIZE)));
+
+typedef struct _scaling_thread_t
+{
+    scaling_method_t    method;
+    u64                 slot;
+    u64                 ticks;
+} scaling_thread_t;
+
+static u64 scaling_thread(void* param)
+{
+    scaling_thread_t* st = (scaling_thread_t*)param;
+
+    while (scaling_go == 0)
+    {
+        sys_futex(&scaling_go, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, 0, NULL, NULL, 0);
+    }
+
+    u64 start = cycle_counter();
+
+    switch (st->method)
+    {
+    case SCALING_TLS:
+        for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+        {
+            counter += 1;
+        }
+        break;
+
+    case SCALING_TLSDESC:
+        for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+        {
+            *(volatile u64*)tls_desc_get_addr(&counter_desc) += 1;
+        }
+        break;
+
+    case SCALING_SHARED_LINE:
+        for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+        {
+            scaling_shared[st->slot] += 1;
+        }
+        break;
+    }
+
+    st->ticks = cycle_counter() - start;
+
+    return 0;
+}
+
+static void bench_scaling(const char* name, scaling_method_t method)
+{
+    for (u64 threads = 1; threads <= MAX_THREADS; threads *= 2)
+    {
+        scaling_thread_t st[MAX_THREADS];
+        thread_t* thread[MAX_THREADS];
+
+        scaling_go = 0;
+
+        for (u64 i = 0; i < threads; ++i)
+        {
+            st[i].method = method;
+            st[i].slot = i;
+            st[i].ticks = 0;
+
+            thread[i] = create_thread(scaling_thread, &st[i], NULL);
+
+            if (thread[i] == NULL)
+            {
+                fatal("create_thread", i);
+            }
+        }
+
+        u64 start = monotonic_ns();
+
+        scaling_go = 1;
+        sys_futex(&scaling_go, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, MAX_THREADS, NULL, NULL, 0);
+
+        u64 ticks = 0;
+
+        for (u64 i = 0; i < threads; ++i)
+        {
+            thread_join(thread[i]);
+            ticks += st[i].ticks;
+        }
+
+        u64 wall_ns = monotonic_ns() - start;
+
+        report(name, "increment", threads, ticks / threads, wall_ns, NUM_ITERATIONS);
+    }
+}
+
+u64 bench_thread(void* param)
+{
+    print("method,op,threads,cycles_per_op,ns_per_op");
+    println();
+
+    bench_local_exec();
+#ifdef __amd64
+    bench_fs_asm();
+    bench_gs_asm();
+    bench_ldt();
+#elif defined(__aarch64__)
+    bench_tpidr_asm();
+#endif
+    bench_tls_get_addr();
+    bench_tls_desc();
+
+    bench_switch();
+
+    return 0;
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+#ifdef __amd64
+    ldt_init();
+#endif
+
+    counter_hz = cycle_counter_hz();
+
+    /* Offset of the counter in the TLS image of the executable */
+    u8* image = (u8*)thread_self() + TLS_TP_TO_TCB - tls_layout.tp_offset + tls_layout.image_offset;
+
+    counter_index.module = 1;
+    counter_index.offset = (u8*)&counter - image;
+
+    tls_desc_init(&counter_desc, counter_index.module, counter_index.offset);
+
+    /* The dynamic models take their slow path once per thread, not in the timed loops */
+    thread_t* thread = create_thread(bench_thread, NULL, NULL);
+
+    if (thread == NULL)
+    {
+        fatal("create_thread", 0);
+    }
+
+    thread_join(thread);
+
+    bench_scaling("local-exec", SCALING_TLS);
+    bench_scaling("tlsdesc", SCALING_TLSDESC);
+    bench_scaling("shared-line", SCALING_SHARED_LINE);
+
+    sys_exit(0);
+}
@@ -0,0 +1,147 @@
+#include "lib.c"
+
+/*
+    Cost of reaching a TLS variable with the local-exec model the programs are
+    built with, against __tls_get_addr (general-dynamic) and TLSDESC, for the
+    executable and for a module registered at run time.
+*/
+
+#define NUM_ITERATIONS      50000000
+
+__attribute__((tls_model("local-exec")))
+static __thread volatile u64 counter;
+
+/* Image of the module registered at run time: a single counter after some data */
+static const u64 module_image[8] = { 1, 2, 3, 4, 5, 6, 7, 0 };
+
+#define MODULE_COUNTER_OFFSET   (7*sizeof(u64))
+
+tls_index_t exe_index;
+tls_index_t module_index;
+tls_desc_t  exe_desc;
+tls_desc_t  module_desc;
+
+/*
+    Every variable holds 1 while timed, so the sum of the loads is the number of iterations
+*/
+void report(const char* name, u64 elapsed, u64 sum)
+{
+    if (sum != NUM_ITERATIONS)
+    {
+        fatal("Wrong sum", sum);
+    }
+
+    print(name);
+    print(": ");
+    print_d64(elapsed * 1000 / NUM_ITERATIONS);
+    print(" ps/access");
+    println();
+}
+
+void bench_local_exec()
+{
+    u64 sum = 0;
+
+    counter = 1;
+
+    u64 start = monotonic_ns();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        sum += counter;
+    }
+
+    report("local-exec             ", monotonic_ns() - start, sum);
+}
+
+void bench_tls_get_addr(const char* name, tls_index_t* ti)
+{
+    u64 sum = 0;
+
+    *(volatile u64*)__tls_get_addr(ti) = 1;
+
+    u64 start = monotonic_ns();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        sum += *(volatile u64*)__tls_get_addr(ti);
+    }
+
+    report(name, monotonic_ns() - start, sum);
+}
+
+void bench_tls_desc(const char* name, tls_desc_t* desc)
+{
+    u64 sum = 0;
+
+    *(volatile u64*)tls_desc_get_addr(desc) = 1;
+
+    u64 start = monotonic_ns();
+
+    for (u64 i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        sum += *(volatile u64*)tls_desc_get_addr(desc);
+    }
+
+    report(name, monotonic_ns() - start, sum);
+}
+
+u64 bench_thread(void* param)
+{
+    /* The first access of every model goes through the slow path in a new thread */
+    if (__tls_get_addr(&exe_index) != &counter || tls_desc_get_addr(&exe_desc) != &counter)
+    {
+        fatal("Executable TLS mismatch", (u64)&counter);
+    }
+
+    if (*(u64*)__tls_get_addr(&module_index) != 0 || *(u64*)tls_desc_get_addr(&module_desc) != 0)
+    {
+        fatal("Module TLS not initialized", 0);
+    }
+
+    bench_local_exec();
+    bench_tls_get_addr("__tls_get_addr, exe    ", &exe_index);
+    bench_tls_get_addr("__tls_get_addr, module ", &module_index);
+    bench_tls_desc    ("TLSDESC, exe           ", &exe_desc);
+    bench_tls_desc    ("TLSDESC, module        ", &module_desc);
+
+    return 0;
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    i64 module = tls_module_register(module_image, sizeof(module_image), sizeof(module_image), sizeof(u64));
+
+    if (module < 0)
+    {
+        fatal("tls_module_register", module);
+    }
+
+    /* Offset of the counter in the TLS image of the executable */
+    u8* image = (u8*)thread_self() + TLS_TP_TO_TCB - tls_layout.tp_offset + tls_layout.image_offset;
+
+    exe_index.module    = 1;
+    exe_index.offset    = (u8*)&counter - image;
+    module_index.module = module;
+    module_index.offset = MODULE_COUNTER_OFFSET;
+
+    tls_desc_init(&exe_desc, exe_index.module, exe_index.offset);
+    tls_desc_init(&module_desc, module_index.module, module_index.offset);
+
+    for (u64 i = 0; i < 2; ++i)
+    {
+        thread_t* thread = create_thread(bench_thread, NULL, NULL);
+
+        if (thread == NULL)
+        {
+            fatal("create_thread", 0);
+        }
+
+        thread_join(thread);
+    }
+
+    sys_exit(0);
+}
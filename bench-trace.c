@@ -0,0 +1,78 @@
+#include "lib.c"
+
+/*
+    Cost of trace_emit, and the records dropped when NUM_THREADS threads emit
+    faster than the drain thread empties the rings. The trace goes to
+    trace.bin, trace-decode prints it.
+*/
+
+#define NUM_THREADS         4
+#define NUM_EVENTS          10000
+
+#define EVENT_ITERATION     1
+#define EVENT_THREAD_DONE   2
+
+static u64 emit_ticks[NUM_THREADS];
+
+u64 emit_thread(void* param)
+{
+    const u64 thread_num = (u64)param;
+    u64 start = cycle_counter();
+
+    for (u64 i = 0; i < NUM_EVENTS; ++i)
+    {
+        trace_event2(EVENT_ITERATION, thread_num, i);
+    }
+
+    emit_ticks[thread_num] = cycle_counter() - start;
+
+    trace_event1(EVENT_THREAD_DONE, thread_num);
+
+    return 0;
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    i64 s = trace_start("trace.bin");
+
+    if (s != 0)
+    {
+        fatal("trace_start", s);
+    }
+
+    trace_name(EVENT_ITERATION, "iteration");
+    trace_name(EVENT_THREAD_DONE, "thread done");
+
+    thread_t* threads[NUM_THREADS];
+
+    for (u64 i = 0; i < NUM_THREADS; ++i)
+    {
+        threads[i] = create_thread(emit_thread, (void*)i, NULL);
+
+        if (threads[i] == NULL)
+        {
+            fatal("create_thread", i);
+        }
+    }
+
+    u64 ticks = 0;
+
+    for (u64 i = 0; i < NUM_THREADS; ++i)
+    {
+        thread_join(threads[i]);
+        ticks += emit_ticks[i];
+    }
+
+    trace_stop();
+
+    const u64 events = NUM_THREADS*NUM_EVENTS;
+    const u64 dropped = trace_dropped();
+
+    print_fmt("emit:    %llu ns/event, %llu cycles/event\r\n", ticks * 1000000000ULL / cycle_counter_hz() / events, ticks / events);
+    print_fmt("events:  %llu, dropped %llu, in trace.bin %llu\r\n", events, dropped, events - dropped);
+
+    sys_exit(0);
+}
@@ -1,28 +1,62 @@
 #include "lib.h"
+#include "libatomic.h"
+#include "libfmt.h"
 
 #ifdef __amd64
 
 #include "libsyscall.x64.c"
 
+#   define SYS_read        0
 #   define SYS_write       1
+#   define SYS_writev      20
+#   define SYS_close       3
 #   define SYS_mmap        9
 #   define SYS_munmap      11
+#   define SYS_mprotect    10
+#   define SYS_madvise     28
+#   define SYS_ftruncate   77
+#   define SYS_memfd_create 319
 #   define SYS_clone       56
 #   define SYS_exit        60
 #   define SYS_wait4       61
 #   define SYS_futex       202
+#   define SYS_futex_waitv 449
+#   define SYS_membarrier  324
+#   define SYS_clock_gettime 228
+#   define SYS_gettid      186
+#   define SYS_openat      257
+#   define SYS_prlimit64   302
+#   define SYS_sched_getaffinity 204
+#   define SYS_clone3      435
+#   define SYS_prctl       157
 
 #elif defined(__aarch64__)
 
 #include "libsyscall.arm64.c"
 
+#   define SYS_openat      56
+#   define SYS_gettid      178
+#   define SYS_prlimit64   261
+#   define SYS_sched_getaffinity 123
+#   define SYS_close       57
+#   define SYS_read        63
 #   define SYS_write       64
+#   define SYS_writev      66
 #   define SYS_mmap        222
 #   define SYS_munmap      215
+#   define SYS_mprotect    226
+#   define SYS_madvise     233
+#   define SYS_ftruncate   46
+#   define SYS_memfd_create 279
 #   define SYS_clone       220
 #   define SYS_exit        93
 #   define SYS_wait4       260
 #   define SYS_futex       98
+#   define SYS_futex_waitv 449
+#   define SYS_membarrier  283
+#   define SYS_clock_gettime 113
+#   define SYS_clone3      435
+#   define SYS_prctl       167
 
 #else
 #   error "Unsupported architecture"
@@ -40,171 +74,1565 @@ u64 sys_munmap(void *addr, u64 length)
     return sys_call2(SYS_munmap, (u64)addr, (u64)length);
 }
 
+i64 sys_mprotect(void *addr, u64 length, u64 prot)
+{
+    return sys_call3(SYS_mprotect, (u64)addr, (u64)length, (u64)prot);
+}
+
+i64 sys_madvise(void *addr, u64 length, u64 advice)
+{
+    return sys_call3(SYS_madvise, (u64)addr, (u64)length, (u64)advice);
+}
+
+i64 sys_memfd_create(const char *name, u64 flags)
+{
+    return sys_call2(SYS_memfd_create, (u64)name, (u64)flags);
+}
+
+i64 sys_ftruncate(u64 fd, u64 length)
+{
+    return sys_call2(SYS_ftruncate, (u64)fd, (u64)length);
+}
+
 u64 sys_clone(u64 flags, void *stack)
 {
     return sys_call2(SYS_clone, (u64)flags, (u64)stack);
 }
 
-u64 sys_waitpid(u64 pid, u64 *wstatus, u64 options)
-{
-    u8 rusage[256];
+u64 sys_waitpid(u64 pid, u64 *wstatus, u64 options)
+{
+    u8 rusage[256];
+
+    return sys_call4(SYS_wait4, (u64)pid, (u64)wstatus, (u64)options, (u64)rusage);
+}
+
+#ifdef THREAD_COUNT_FUTEX_CALLS
+static thread_tcb_t* runtime_tcb(void);
+#endif
+
+i64 sys_futex(volatile i32 *uaddr, i64 futex_op, i32 val, const struct timespec *timeout, i32 *uaddr2, i32 val3)
+{
+#ifdef THREAD_COUNT_FUTEX_CALLS
+    thread_tcb_t* tcb = runtime_tcb();
+
+    if (tcb != NULL)
+    {
+        ++tcb->futex_calls;
+    }
+#endif
+
+    return sys_call6(SYS_futex, (u64)uaddr, (u64)futex_op, (u64)val, (u64)timeout, (u64)uaddr2, (u64)val3);
+}
+
+i64 sys_futex_waitv(struct futex_waitv* waiters, u32 count, u32 flags, const struct timespec *timeout, u64 clock_id)
+{
+    return sys_call5(SYS_futex_waitv, (u64)waiters, (u64)count, (u64)flags, (u64)timeout, (u64)clock_id);
+}
+
+i64 sys_membarrier(u64 cmd, u64 flags, i64 cpu_id)
+{
+    return sys_call3(SYS_membarrier, (u64)cmd, (u64)flags, (u64)cpu_id);
+}
+
+i64 sys_clock_gettime(u64 clock_id, struct timespec *tp)
+{
+    return sys_call2(SYS_clock_gettime, (u64)clock_id, (u64)tp);
+}
+
+u64 monotonic_ns(void)
+{
+    struct timespec ts;
+
+    sys_clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void sleep_ns(u64 ns)
+{
+    /* Nobody wakes it, it times out; a spurious wake-up waits for the rest */
+    volatile i32 sleep = 0;
+    const u64 deadline = monotonic_ns() + ns;
+    u64 now;
+
+    while ((now = monotonic_ns()) < deadline)
+    {
+        const struct timespec interval = {
+            .tv_sec = (deadline - now) / 1000000000ULL,
+            .tv_nsec = (deadline - now) % 1000000000ULL
+        };
+
+        sys_futex(&sleep, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, 0, &interval, NULL, 0);
+    }
+}
+
+u64 cycle_counter(void)
+{
+#ifdef __amd64
+    u32 lo, hi;
+
+    asm volatile ("lfence; rdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+
+    return ((u64)hi << 32) | lo;
+#elif defined(__aarch64__)
+    u64 ticks;
+
+    asm volatile ("isb; mrs %0, cntvct_el0" : "=r"(ticks) : : "memory");
+
+    return ticks;
+#else
+#   error "Unsupported architecture"
+#endif
+}
+
+u64 cycle_counter_hz(void)
+{
+#ifdef __amd64
+    static u64 hz;
+
+    if (hz == 0)
+    {
+        const u64 ns_start = monotonic_ns();
+        const u64 ticks_start = cycle_counter();
+        u64 ns;
+
+        do
+        {
+            ns = monotonic_ns() - ns_start;
+        } while (ns < 20000000);
+
+        hz = (cycle_counter() - ticks_start) * 1000000000ULL / ns;
+    }
+
+    return hz;
+#elif defined(__aarch64__)
+    u64 hz;
+
+    asm volatile ("mrs %0, cntfrq_el0" : "=r"(hz));
+
+    return hz;
+#else
+#   error "Unsupported architecture"
+#endif
+}
+
+i64 sys_openat(i64 dirfd, const char *path, u64 flags, u64 mode)
+{
+    return sys_call4(SYS_openat, (u64)dirfd, (u64)path, (u64)flags, (u64)mode);
+}
+
+i64 sys_read(u64 fd, void *buf, u64 count)
+{
+    return sys_call3(SYS_read, (u64)fd, (u64)buf, (u64)count);
+}
+
+i64 sys_close(u64 fd)
+{
+    return sys_call1(SYS_close, (u64)fd);
+}
+
+i64 sys_gettid(void)
+{
+    return sys_call0(SYS_gettid);
+}
+
+i64 sys_prlimit64(u64 pid, u64 resource, const struct rlimit *new_limit, struct rlimit *old_limit)
+{
+    return sys_call4(SYS_prlimit64, (u64)pid, (u64)resource, (u64)new_limit, (u64)old_limit);
+}
+
+i64 sys_prctl(u64 option, u64 arg2, u64 arg3, u64 arg4, u64 arg5)
+{
+    return sys_call5(SYS_prctl, (u64)option, (u64)arg2, (u64)arg3, (u64)arg4, (u64)arg5);
+}
+
+i64 sys_sched_getaffinity(u64 pid, u64 size, u64* mask)
+{
+    return sys_call3(SYS_sched_getaffinity, (u64)pid, (u64)size, (u64)mask);
+}
+
+u64 cpu_count(void)
+{
+    u64 mask[CPU_MASK_WORDS];
+    const i64 size = sys_sched_getaffinity(0, sizeof(mask), mask);
+    u64 count = 0;
+
+    for (i64 i = 0; i < size / (i64)sizeof(u64); ++i)
+    {
+        for (u64 bits = mask[i]; bits != 0; bits &= bits - 1)
+        {
+            ++count;
+        }
+    }
+
+    return count != 0 ? count : 1;
+}
+
+i64 sys_write(u64 fd, const void *buf, u64 count)
+{
+    return sys_call3(SYS_write, (u64)fd, (u64)buf, (u64)count);
+}
+
+i64 sys_writev(u64 fd, const struct iovec *iov, u64 iovcnt)
+{
+    return sys_call3(SYS_writev, (u64)fd, (u64)iov, (u64)iovcnt);
+}
+
+void sys_exit(i64 err_code)
+{
+    sys_call1(SYS_exit, (u64)err_code);
+}
+
+/*
+    The compiler would turn these loops into calls to themselves
+*/
+
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+void* memcpy(void* dst, const void* src, u64 count)
+{
+    u8* d = (u8*)dst;
+    const u8* s = (const u8*)src;
+
+    while (count--) *d++ = *s++;
+
+    return dst;
+}
+
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+void* memset(void* dst, int value, u64 count)
+{
+    u8* d = (u8*)dst;
+
+    while (count--) *d++ = (u8)value;
+
+    return dst;
+}
+
+int memcmp(const void* a, const void* b, u64 count)
+{
+    const u8* x = (const u8*)a;
+    const u8* y = (const u8*)b;
+
+    for (; count != 0; --count, ++x, ++y)
+    {
+        if (*x != *y)
+        {
+            return *x < *y ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+u64 strlen(const char* str)
+{
+    u64 len = 0;
+
+    while (*str++) ++len;
+
+    return len;
+}
+
+/* Set once the main thread has its TCB */
+static u32 runtime_tcb_ready;
+
+/*
+    The TCB of the calling thread, NULL before tls_init and on a thread
+    running on a TLS block its creator supplied, which has no
+    THREAD_TCB_MAGIC next to the thread pointer. The output buffering and
+    the tracing need it, and do without otherwise.
+*/
+static thread_tcb_t* runtime_tcb(void)
+{
+    if (!runtime_tcb_ready)
+    {
+        return NULL;
+    }
+
+    /* Read at the thread pointer, without going through a pointer of the block */
+    u64 magic;
+
+#ifdef __amd64
+    asm ("movq %%fs:%c1, %0" : "=r"(magic) : "i"(__builtin_offsetof(thread_tcb_t, magic)));
+#elif defined(__aarch64__)
+    const u8* tp;
+
+    asm ("mrs %0, tpidr_el0" : "=r"(tp));
+
+    magic = *(const u64*)(tp + __builtin_offsetof(thread_tcb_t, magic) - TLS_TP_TO_TCB);
+#else
+#   error "Unsupported architecture"
+#endif
+
+    return magic == THREAD_TCB_MAGIC ? thread_self() : NULL;
+}
+
+#ifdef THREAD_COUNT_FUTEX_CALLS
+u64 thread_futex_calls(void)
+{
+    thread_tcb_t* tcb = runtime_tcb();
+
+    return tcb != NULL ? tcb->futex_calls : 0;
+}
+#endif
+
+static void print_write(const char* data, u64 len)
+{
+    thread_tcb_t* tcb = runtime_tcb();
+
+    if (tcb == NULL)
+    {
+        sys_write(STDOUT_FD, data, len);
+
+        return;
+    }
+
+    if (tcb->out_used + len <= tcb->out_capacity)
+    {
+        memcpy(tcb->out + tcb->out_used, data, len);
+        tcb->out_used += len;
+
+        if (len != 0 && data[len - 1] == '\n')
+        {
+            print_flush();
+        }
+
+        return;
+    }
+
+    /* Doesn't fit: what is collected and the fragment go out together */
+    const struct iovec iov[2] = {
+        { .iov_base = tcb->out, .iov_len = tcb->out_used },
+        { .iov_base = data,     .iov_len = len },
+    };
+
+    sys_writev(STDOUT_FD, iov, 2);
+    tcb->out_used = 0;
+}
+
+void print_flush(void)
+{
+    thread_tcb_t* tcb = runtime_tcb();
+
+    if (tcb != NULL && tcb->out_used != 0)
+    {
+        sys_write(STDOUT_FD, tcb->out, tcb->out_used);
+        tcb->out_used = 0;
+    }
+}
+
+void print(const char* str)
+{
+    print_write(str, strlen(str));
+}
+
+void println(void)
+{
+    print_write("\r\n", 2);
+}
+
+void print_h64(u64 number)
+{
+    char hex_str[FMT_H64_CHARS];
+
+    fmt_h64(hex_str, number);
+    print_write(hex_str, sizeof(hex_str));
+}
+
+void print_d64(u64 number)
+{
+    char dec_str[FMT_U64_MAX_CHARS];
+
+    print_write(dec_str, fmt_u64(dec_str, number));
+}
+
+/*
+    Auxiliary vector
+*/
+
+static u64 auxv[256];   /* Pairs of type and value */
+
+static void auxv_init(void)
+{
+    /* Keep the last pair zero as the terminator */
+    const u64 limit = sizeof(auxv) - 2*sizeof(auxv[0]);
+
+    if (sys_prctl(PR_GET_AUXV, (u64)auxv, limit, 0, 0) > 0)
+    {
+        /* What did not fit, if anything, is past the terminator */
+        auxv[sizeof(auxv)/sizeof(auxv[0]) - 2] = AT_NULL;
+
+        return;
+    }
+
+    i64 fd = sys_openat(AT_FDCWD, "/proc/self/auxv", O_RDONLY, 0);
+
+    if (fd < 0)
+    {
+        fatal("Cannot open /proc/self/auxv", fd);
+    }
+
+    u64 bytes = 0;
+
+    while (bytes < limit)
+    {
+        i64 s = sys_read(fd, ((u8*)auxv) + bytes, limit - bytes);
+
+        if (s == -EINTR)
+        {
+            continue;
+        }
+
+        if (s < 0)
+        {
+            fatal("Cannot read /proc/self/auxv", s);
+        }
+
+        if (s == 0)
+        {
+            break;
+        }
+
+        bytes += s;
+    }
+
+    sys_close(fd);
+}
+
+u64 auxv_get(u64 type)
+{
+    for (u64 i = 0; auxv[i] != AT_NULL; i += 2)
+    {
+        if (auxv[i] == type)
+        {
+            return auxv[i + 1];
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Thread-local storage
+*/
+
+tls_layout_t tls_layout;
+
+volatile u64 tls_generation = 1;
+
+static tls_module_t tls_modules[TLS_MODULE_MAX + 1];
+static volatile u32 tls_module_lock;
+
+/* Every thread starts with this vector: the generation never matches */
+static const u64 tls_dtv_empty[1] = { ~0ULL };
+
+static u64 align_up(u64 value, u64 align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+void tls_init(void)
+{
+    const elf64_phdr_t* phdr = (const elf64_phdr_t*)auxv_get(AT_PHDR);
+    const u64 phnum = auxv_get(AT_PHNUM);
+    const u64 phent = auxv_get(AT_PHENT);
+    const elf64_phdr_t* tls_phdr = NULL;
+    u64 load_bias = 0;
+
+    for (u64 i = 0; i < phnum; ++i)
+    {
+        const elf64_phdr_t* p = (const elf64_phdr_t*)(((const u8*)phdr) + i*phent);
+
+        if (p->p_type == PT_PHDR)
+        {
+            /* Non-zero for a position-independent executable */
+            load_bias = (u64)phdr - p->p_vaddr;
+        }
+        else if (p->p_type == PT_TLS)
+        {
+            tls_phdr = p;
+        }
+    }
+
+    u64 align = 1;
+
+    if (tls_phdr != NULL)
+    {
+        tls_layout.image      = (const void*)(tls_phdr->p_vaddr + load_bias);
+        tls_layout.image_size = tls_phdr->p_filesz;
+        tls_layout.size       = tls_phdr->p_memsz;
+        align                 = tls_phdr->p_align ? tls_phdr->p_align : 1;
+    }
+
+    tls_layout.align = align;
+
+    /*
+        The static linker computes the offsets of the local-exec variables
+        from the thread pointer with the same formulas.
+    */
+#ifdef __amd64
+    /* The image ends where the linker puts it, the TCB starts on its alignment */
+    tls_layout.tp_offset    = align_up(align_up(tls_layout.size, align), __alignof__(thread_tcb_t));
+    tls_layout.image_offset = tls_layout.tp_offset - align_up(tls_layout.size, align);
+    tls_layout.block_size   = tls_layout.tp_offset + sizeof(thread_tcb_t);
+#elif defined(__aarch64__)
+    /* Only the last 16 bytes of the TCB are above the thread pointer */
+    tls_layout.tp_offset    = align_up(TLS_TP_TO_TCB, align);
+    tls_layout.image_offset = tls_layout.tp_offset + align_up(sizeof(thread_tcb_t) - TLS_TP_TO_TCB, align);
+    tls_layout.block_size   = tls_layout.image_offset + tls_layout.size;
+#else
+#   error "Unsupported architecture"
+#endif
+
+    _Static_assert(__alignof__(thread_tcb_t) <= CACHE_LINE_SIZE, "The blocks are aligned on the cache line at least");
+
+    const u64 block_align = align > CACHE_LINE_SIZE ? align : CACHE_LINE_SIZE;
+    tls_layout.block_size = align_up(tls_layout.block_size, block_align);
+
+    /* The mapping is page-aligned, over-allocate if the segment wants more */
+    const u64 slab_size = (THREAD_POOL_SIZE + 1)*tls_layout.block_size + block_align;
+    u64 slab = sys_mmap(0, slab_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+
+    if ((i64)slab < 0 && (i64)slab >= -4095)
+    {
+        fatal("Cannot map the TLS slab", slab);
+    }
+
+    tls_layout.slab = (u8*)align_up(slab, block_align);
+
+    void* tp = tls_block_init(0);
+    thread_tcb_t* tcb = thread_tcb(tp);
+
+    /*
+        The kernel puts the name of the executable close to the top of the main stack,
+        and the stack may grow down to the limit.
+    */
+    struct rlimit stack_rlimit = { 0, 0 };
+    u64 stack_size = 8*1024*1024;
+
+    if (sys_prlimit64(0, RLIMIT_STACK, NULL, &stack_rlimit) == 0 && stack_rlimit.rlim_cur != RLIM_INFINITY)
+    {
+        stack_size = stack_rlimit.rlim_cur;
+    }
+
+    tcb->tid         = sys_gettid();
+    tcb->stack_base  = (void*)align_up(auxv_get(AT_EXECFN), 4096);
+    tcb->stack_limit = (u8*)tcb->stack_base - stack_size;
+
+    tls_set_thread_pointer(tp);
+
+    runtime_tcb_ready = 1;
+}
+
+void* tls_block_init(u64 index)
+{
+    return tls_block_build(tls_layout.slab + index*tls_layout.block_size, index);
+}
+
+void* tls_block_build(u8* block, u64 index)
+{
+    u8* image = block + tls_layout.image_offset;
+    void* tp = block + tls_layout.tp_offset;
+    thread_tcb_t* tcb = thread_tcb(tp);
+
+    memcpy(image, tls_layout.image, tls_layout.image_size);
+    memset(image + tls_layout.image_size, 0, tls_layout.size - tls_layout.image_size);
+    memset(tcb, 0, __builtin_offsetof(thread_tcb_t, qlock_owned));
+
+#ifdef __amd64
+    tcb->self = tcb;
+#endif
+    tcb->magic = THREAD_TCB_MAGIC;
+    tcb->index = index;
+    tcb->dtv = (void*)tls_dtv_empty;
+    tcb->out_capacity = THREAD_OUT_SIZE;
+
+    return tp;
+}
+
+__attribute__((always_inline))
+inline thread_tcb_t* thread_self(void)
+{
+    thread_tcb_t* tcb;
+
+#ifdef __amd64
+    asm ("movq %%fs:0, %0" : "=r"(tcb));
+#elif defined(__aarch64__)
+    asm ("mrs %0, tpidr_el0" : "=r"(tcb));
+
+    tcb = (thread_tcb_t*)((u8*)tcb - TLS_TP_TO_TCB);
+#else
+#   error "Unsupported architecture"
+#endif
+
+    return tcb;
+}
+
+thread_tcb_t* thread_tcb(void* tp)
+{
+    return (thread_tcb_t*)((u8*)tp - TLS_TP_TO_TCB);
+}
+
+void tls_set_thread_pointer(void* tp)
+{
+#ifdef __amd64
+    x64_set_fs_base((u64)tp);
+#elif defined(__aarch64__)
+    asm volatile ("msr tpidr_el0, %0" : : "r"(tp) : "memory");
+#else
+#   error "Unsupported architecture"
+#endif
+}
+
+void* tls_get_thread_pointer(void)
+{
+#ifdef __amd64
+    return (void*)x64_get_fs_base();
+#elif defined(__aarch64__)
+    void* tp;
+
+    asm volatile ("mrs %0, tpidr_el0" : "=r"(tp));
+
+    return tp;
+#else
+#   error "Unsupported architecture"
+#endif
+}
+
+#ifdef __amd64
+
+/* Set by runtime_init from AT_HWCAP2 */
+static u32 x64_fsgsbase;
+
+u64 x64_get_fs_base(void)
+{
+    if (x64_fsgsbase)
+    {
+        u64 base;
+
+        asm volatile ("rdfsbase %0" : "=r"(base));
+
+        return base;
+    }
+
+    return sys_x64_get_fs();
+}
+
+void x64_set_fs_base(u64 base)
+{
+    if (x64_fsgsbase)
+    {
+        asm volatile ("wrfsbase %0" : : "r"(base) : "memory");
+
+        return;
+    }
+
+    i64 err_code = sys_x64_set_fs(base);
+
+    if (err_code != 0)
+    {
+        fatal("Error when updating FS.base", err_code);
+    }
+}
+
+u64 x64_get_gs_base(void)
+{
+    if (x64_fsgsbase)
+    {
+        u64 base;
+
+        asm volatile ("rdgsbase %0" : "=r"(base));
+
+        return base;
+    }
+
+    return sys_x64_get_gs();
+}
+
+void x64_set_gs_base(u64 base)
+{
+    if (x64_fsgsbase)
+    {
+        asm volatile ("wrgsbase %0" : : "r"(base) : "memory");
+
+        return;
+    }
+
+    i64 err_code = sys_x64_set_gs(base);
+
+    if (err_code != 0)
+    {
+        fatal("Error when updating GS.base", err_code);
+    }
+}
+
+#endif
+
+/*
+    Dynamic TLS
+*/
+
+#ifdef __amd64
+_Static_assert(__builtin_offsetof(thread_tcb_t, dtv) == 8, "The TLSDESC resolver expects the vector at %fs:8");
+#elif defined(__aarch64__)
+_Static_assert(sizeof(thread_tcb_t) - TLS_TP_TO_TCB == 16, "The psABI has 16 bytes of the TCB above tpidr_el0");
+#endif
+
+/*
+    Bump allocator over the arenas of the thread.
+    An arena starts with the pointer to the previous one and its size.
+*/
+static void* tls_arena_alloc(thread_tcb_t* tcb, u64 size, u64 align)
+{
+    u64 offset = align_up(tcb->tls_arena_used, align);
+
+    if (tcb->tls_arena == NULL || offset + size > ((u64*)tcb->tls_arena)[1])
+    {
+        u64 arena_size = align_up(2*sizeof(u64) + align + size, 4096);
+
+        if (arena_size < TLS_ARENA_SIZE)
+        {
+            arena_size = TLS_ARENA_SIZE;
+        }
+
+        u64 arena = sys_mmap(0, arena_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+
+        if ((i64)arena < 0 && (i64)arena >= -4095)
+        {
+            fatal("Cannot map a TLS arena", arena);
+        }
+
+        ((u64*)arena)[0] = (u64)tcb->tls_arena;
+        ((u64*)arena)[1] = arena_size;
+
+        tcb->tls_arena = (u8*)arena;
+        offset = align_up(2*sizeof(u64), align);
+    }
+
+    tcb->tls_arena_used = offset + size;
+
+    return tcb->tls_arena + offset;
+}
+
+static void tls_arena_release(thread_tcb_t* tcb)
+{
+    u8* arena = tcb->tls_arena;
+
+    while (arena != NULL)
+    {
+        u8* prev = (u8*)((u64*)arena)[0];
+
+        sys_munmap(arena, ((u64*)arena)[1]);
+        arena = prev;
+    }
+
+    tcb->tls_arena = NULL;
+    tcb->tls_arena_used = 0;
+    tcb->dtv = (void*)tls_dtv_empty;
+}
+
+i64 tls_module_register(const void* image, u64 image_size, u64 size, u64 align)
+{
+    if (image_size > size || align == 0 || (align & (align - 1)) != 0)
+    {
+        return -EINVAL;
+    }
+
+    i64 module = -EAGAIN;
+
+    while (atomic_exchange(&tls_module_lock, 1, ATOMIC_ACQUIRE)) {}
+
+    /* Module 1 is the executable */
+    for (u64 i = 2; i <= TLS_MODULE_MAX; ++i)
+    {
+        tls_module_t* m = &tls_modules[i];
+
+        if (m->in_use)
+        {
+            continue;
+        }
+
+        m->image      = image;
+        m->image_size = image_size;
+        m->size       = size;
+        m->align      = align;
+        m->generation = tls_generation + 1;
+        m->in_use     = 1;
+
+        /* The module is set up before a thread sees the new generation */
+        atomic_store(&tls_generation, tls_generation + 1, ATOMIC_RELEASE);
+
+        module = i;
+        break;
+    }
+
+    atomic_store(&tls_module_lock, 0, ATOMIC_RELEASE);
+
+    return module;
+}
+
+void tls_module_unregister(u64 module)
+{
+    if (module < 2 || module > TLS_MODULE_MAX)
+    {
+        return;
+    }
+
+    while (atomic_exchange(&tls_module_lock, 1, ATOMIC_ACQUIRE)) {}
+
+    tls_module_t* m = &tls_modules[module];
+
+    if (m->in_use)
+    {
+        m->in_use     = 0;
+        m->generation = tls_generation + 1;
+
+        /* The module is set up before a thread sees the new generation */
+        atomic_store(&tls_generation, tls_generation + 1, ATOMIC_RELEASE);
+    }
+
+    atomic_store(&tls_module_lock, 0, ATOMIC_RELEASE);
+}
+
+/*
+    Map the vector, bring it up to date with the modules, and map the block of the module.
+*/
+__attribute__((noinline, used))
+static void* tls_get_addr_slow(tls_index_t* ti)
+{
+    thread_tcb_t* tcb = thread_self();
+    u64* dtv = (u64*)tcb->dtv;
+
+    if (dtv == tls_dtv_empty)
+    {
+        dtv = (u64*)tls_arena_alloc(tcb, (TLS_MODULE_MAX + 1)*sizeof(u64), sizeof(u64));
+
+        memset(dtv, 0, (TLS_MODULE_MAX + 1)*sizeof(u64));
+        dtv[1] = (u64)tcb + TLS_TP_TO_TCB - tls_layout.tp_offset + tls_layout.image_offset;
+
+        tcb->dtv = dtv;
+    }
+
+    u64 generation = atomic_load(&tls_generation, ATOMIC_ACQUIRE);
+
+    if (dtv[0] != generation)
+    {
+        /* Drop the blocks of the modules (un)registered since the last check */
+        for (u64 i = 2; i <= TLS_MODULE_MAX; ++i)
+        {
+            if (tls_modules[i].generation > dtv[0])
+            {
+                dtv[i] = 0;
+            }
+        }
+
+        dtv[0] = generation;
+    }
+
+    if (ti->module == 0 || ti->module > TLS_MODULE_MAX || !(ti->module == 1 || tls_modules[ti->module].in_use))
+    {
+        fatal("No such TLS module", ti->module);
+    }
+
+    if (dtv[ti->module] == 0)
+    {
+        tls_module_t* m = &tls_modules[ti->module];
+        u8* block = (u8*)tls_arena_alloc(tcb, m->size, m->align);
+
+        memcpy(block, m->image, m->image_size);
+        memset(block + m->image_size, 0, m->size - m->image_size);
+
+        dtv[ti->module] = (u64)block;
+    }
+
+    return (u8*)dtv[ti->module] + ti->offset;
+}
+
+void* __tls_get_addr(tls_index_t* ti)
+{
+    const u64* dtv = (const u64*)thread_self()->dtv;
+
+    if (__builtin_expect(dtv[0] == tls_generation, 1))
+    {
+        u64 block = dtv[ti->module];
+
+        if (__builtin_expect(block != 0, 1))
+        {
+            return (u8*)block + ti->offset;
+        }
+    }
+
+    return tls_get_addr_slow(ti);
+}
+
+/*
+    TLSDESC resolvers.
+
+    tls_desc_static returns the argument, the offset from the thread pointer.
+    tls_desc_dynamic gets a tls_index_t as the argument and does what
+    __tls_get_addr does, saving every register the slow path may touch.
+*/
+
+void tls_desc_static(void);
+void tls_desc_dynamic(void);
+
+#ifdef __amd64
+
+asm(
+    ".text\n"
+    ".globl tls_desc_static\n"
+    ".type  tls_desc_static, @function\n"
+"tls_desc_static:\n"
+    "   movq    8(%rax), %rax\n"
+    "   ret\n"
+    ".size  tls_desc_static, .-tls_desc_static\n"
+
+    ".globl tls_desc_dynamic\n"
+    ".type  tls_desc_dynamic, @function\n"
+"tls_desc_dynamic:\n"
+    "   movq    8(%rax), %rax\n"                /* tls_index_t */
+    "   pushq   %rcx\n"
+    "   pushq   %rdx\n"
+    "   movq    %fs:8, %rdx\n"                  /* Vector */
+    "   movq    (%rdx), %rcx\n"
+    "   cmpq    tls_generation(%rip), %rcx\n"
+    "   jne     1f\n"
+    "   movq    (%rax), %rcx\n"                 /* Module */
+    "   movq    (%rdx,%rcx,8), %rdx\n"          /* Block */
+    "   testq   %rdx, %rdx\n"
+    "   jz      1f\n"
+    "   addq    8(%rax), %rdx\n"
+    "   subq    %fs:0, %rdx\n"
+    "   movq    %rdx, %rax\n"
+    "   popq    %rdx\n"
+    "   popq    %rcx\n"
+    "   ret\n"
+"1:\n"
+    "   pushq   %rdi\n"
+    "   pushq   %rsi\n"
+    "   pushq   %r8\n"
+    "   pushq   %r9\n"
+    "   pushq   %r10\n"
+    "   pushq   %r11\n"
+    "   pushq   %rbx\n"
+    "   movq    %rsp, %rbx\n"                  /* The caller may not have the stack aligned */
+    "   andq    $-16, %rsp\n"
+    "   subq    $256, %rsp\n"                  /* 16 XMM registers */
+    "   movdqu  %xmm0, 0(%rsp)\n"
+    "   movdqu  %xmm1, 16(%rsp)\n"
+    "   movdqu  %xmm2, 32(%rsp)\n"
+    "   movdqu  %xmm3, 48(%rsp)\n"
+    "   movdqu  %xmm4, 64(%rsp)\n"
+    "   movdqu  %xmm5, 80(%rsp)\n"
+    "   movdqu  %xmm6, 96(%rsp)\n"
+    "   movdqu  %xmm7, 112(%rsp)\n"
+    "   movdqu  %xmm8, 128(%rsp)\n"
+    "   movdqu  %xmm9, 144(%rsp)\n"
+    "   movdqu  %xmm10, 160(%rsp)\n"
+    "   movdqu  %xmm11, 176(%rsp)\n"
+    "   movdqu  %xmm12, 192(%rsp)\n"
+    "   movdqu  %xmm13, 208(%rsp)\n"
+    "   movdqu  %xmm14, 224(%rsp)\n"
+    "   movdqu  %xmm15, 240(%rsp)\n"
+    "   movq    %rax, %rdi\n"
+    "   call    tls_get_addr_slow\n"
+    "   subq    %fs:0, %rax\n"
+    "   movdqu  0(%rsp), %xmm0\n"
+    "   movdqu  16(%rsp), %xmm1\n"
+    "   movdqu  32(%rsp), %xmm2\n"
+    "   movdqu  48(%rsp), %xmm3\n"
+    "   movdqu  64(%rsp), %xmm4\n"
+    "   movdqu  80(%rsp), %xmm5\n"
+    "   movdqu  96(%rsp), %xmm6\n"
+    "   movdqu  112(%rsp), %xmm7\n"
+    "   movdqu  128(%rsp), %xmm8\n"
+    "   movdqu  144(%rsp), %xmm9\n"
+    "   movdqu  160(%rsp), %xmm10\n"
+    "   movdqu  176(%rsp), %xmm11\n"
+    "   movdqu  192(%rsp), %xmm12\n"
+    "   movdqu  208(%rsp), %xmm13\n"
+    "   movdqu  224(%rsp), %xmm14\n"
+    "   movdqu  240(%rsp), %xmm15\n"
+    "   movq    %rbx, %rsp\n"
+    "   popq    %rbx\n"
+    "   popq    %r11\n"
+    "   popq    %r10\n"
+    "   popq    %r9\n"
+    "   popq    %r8\n"
+    "   popq    %rsi\n"
+    "   popq    %rdi\n"
+    "   popq    %rdx\n"
+    "   popq    %rcx\n"
+    "   ret\n"
+    ".size  tls_desc_dynamic, .-tls_desc_dynamic\n"
+);
+
+#elif defined(__aarch64__)
+
+asm(
+    ".text\n"
+    ".globl tls_desc_static\n"
+    ".type  tls_desc_static, %function\n"
+"tls_desc_static:\n"
+    "   ldr     x0, [x0, #8]\n"
+    "   ret\n"
+    ".size  tls_desc_static, .-tls_desc_static\n"
+
+    ".globl tls_desc_dynamic\n"
+    ".type  tls_desc_dynamic, %function\n"
+"tls_desc_dynamic:\n"
+    "   ldr     x0, [x0, #8]\n"                 /* tls_index_t */
+    "   stp     x1, x2, [sp, #-32]!\n"
+    "   stp     x3, x4, [sp, #16]\n"
+    "   mrs     x1, tpidr_el0\n"
+    "   ldr     x2, [x1]\n"                     /* Vector */
+    "   ldr     x3, [x2]\n"
+    "   adrp    x4, tls_generation\n"
+    "   ldr     x4, [x4, :lo12:tls_generation]\n"
+    "   cmp     x3, x4\n"
+    "   b.ne    1f\n"
+    "   ldr     x3, [x0]\n"                     /* Module */
+    "   ldr     x3, [x2, x3, lsl #3]\n"         /* Block */
+    "   cbz     x3, 1f\n"
+    "   ldr     x4, [x0, #8]\n"
+    "   add     x3, x3, x4\n"
+    "   sub     x0, x3, x1\n"
+    "   ldp     x3, x4, [sp, #16]\n"
+    "   ldp     x1, x2, [sp], #32\n"
+    "   ret\n"
+"1:\n"
+    "   sub     sp, sp, #640\n"
+    "   stp     x5, x6, [sp, #0]\n"
+    "   stp     x7, x8, [sp, #16]\n"
+    "   stp     x9, x10, [sp, #32]\n"
+    "   stp     x11, x12, [sp, #48]\n"
+    "   stp     x13, x14, [sp, #64]\n"
+    "   stp     x15, x16, [sp, #80]\n"
+    "   stp     x17, x18, [sp, #96]\n"
+    "   stp     x29, x30, [sp, #112]\n"
+    "   stp     q0, q1, [sp, #128]\n"
+    "   stp     q2, q3, [sp, #160]\n"
+    "   stp     q4, q5, [sp, #192]\n"
+    "   stp     q6, q7, [sp, #224]\n"
+    "   stp     q8, q9, [sp, #256]\n"
+    "   stp     q10, q11, [sp, #288]\n"
+    "   stp     q12, q13, [sp, #320]\n"
+    "   stp     q14, q15, [sp, #352]\n"
+    "   stp     q16, q17, [sp, #384]\n"
+    "   stp     q18, q19, [sp, #416]\n"
+    "   stp     q20, q21, [sp, #448]\n"
+    "   stp     q22, q23, [sp, #480]\n"
+    "   stp     q24, q25, [sp, #512]\n"
+    "   stp     q26, q27, [sp, #544]\n"
+    "   stp     q28, q29, [sp, #576]\n"
+    "   stp     q30, q31, [sp, #608]\n"
+    "   bl      tls_get_addr_slow\n"
+    "   mrs     x1, tpidr_el0\n"
+    "   sub     x0, x0, x1\n"
+    "   ldp     x5, x6, [sp, #0]\n"
+    "   ldp     x7, x8, [sp, #16]\n"
+    "   ldp     x9, x10, [sp, #32]\n"
+    "   ldp     x11, x12, [sp, #48]\n"
+    "   ldp     x13, x14, [sp, #64]\n"
+    "   ldp     x15, x16, [sp, #80]\n"
+    "   ldp     x17, x18, [sp, #96]\n"
+    "   ldp     x29, x30, [sp, #112]\n"
+    "   ldp     q0, q1, [sp, #128]\n"
+    "   ldp     q2, q3, [sp, #160]\n"
+    "   ldp     q4, q5, [sp, #192]\n"
+    "   ldp     q6, q7, [sp, #224]\n"
+    "   ldp     q8, q9, [sp, #256]\n"
+    "   ldp     q10, q11, [sp, #288]\n"
+    "   ldp     q12, q13, [sp, #320]\n"
+    "   ldp     q14, q15, [sp, #352]\n"
+    "   ldp     q16, q17, [sp, #384]\n"
+    "   ldp     q18, q19, [sp, #416]\n"
+    "   ldp     q20, q21, [sp, #448]\n"
+    "   ldp     q22, q23, [sp, #480]\n"
+    "   ldp     q24, q25, [sp, #512]\n"
+    "   ldp     q26, q27, [sp, #544]\n"
+    "   ldp     q28, q29, [sp, #576]\n"
+    "   ldp     q30, q31, [sp, #608]\n"
+    "   add     sp, sp, #640\n"
+    "   ldp     x3, x4, [sp, #16]\n"
+    "   ldp     x1, x2, [sp], #32\n"
+    "   ret\n"
+    ".size  tls_desc_dynamic, .-tls_desc_dynamic\n"
+);
+
+#else
+#   error "Unsupported architecture"
+#endif
+
+void tls_desc_init(tls_desc_t* desc, u64 module, u64 offset)
+{
+    desc->index.module = module;
+    desc->index.offset = offset;
+
+    if (module == 1)
+    {
+        /* The executable: a constant offset from the thread pointer */
+        desc->resolver = (void*)tls_desc_static;
+        desc->arg      = tls_layout.image_offset - tls_layout.tp_offset + offset;
+    }
+    else
+    {
+        desc->resolver = (void*)tls_desc_dynamic;
+        desc->arg      = (u64)&desc->index;
+    }
+}
+
+__attribute__((always_inline))
+inline void* tls_desc_get_addr(tls_desc_t* desc)
+{
+    u64 tp;
+
+#ifdef __amd64
+    u64 offset;
+
+    /* Step over the red zone the compiler may keep below the stack pointer */
+    asm volatile (
+        "leaq   -128(%%rsp), %%rsp\n"
+        "call   *(%%rax)\n"
+        "leaq   128(%%rsp), %%rsp\n"
+        : "=a"(offset)
+        : "0"(desc)
+        : "cc", "memory"
+    );
+
+    asm ("movq %%fs:0, %0" : "=r"(tp));
+#elif defined(__aarch64__)
+    register u64 offset asm("x0") = (u64)desc;
+
+    asm volatile (
+        "ldr    x1, [x0]\n"
+        "blr    x1\n"
+        : "+r"(offset)
+        :
+        : "x1", "x30", "cc", "memory"
+    );
+
+    asm ("mrs %0, tpidr_el0" : "=r"(tp));
+#else
+#   error "Unsupported architecture"
+#endif
+
+    return (u8*)tp + offset;
+}
+
+/*
+    Thread-specific data keys
+*/
+
+static volatile u32 tls_key_count;
+static tls_key_destructor_t tls_key_destructors[TLS_KEY_MAX];
+
+i64 tls_key_create(tls_key_t* key, tls_key_destructor_t destructor)
+{
+    u32 new_key = atomic_fetch_add(&tls_key_count, 1, ATOMIC_RELAXED);
+
+    if (new_key >= TLS_KEY_MAX)
+    {
+        atomic_fetch_sub(&tls_key_count, 1, ATOMIC_RELAXED);
+
+        return -EAGAIN;
+    }
+
+    tls_key_destructors[new_key] = destructor;
+    *key = new_key;
+
+    return 0;
+}
+
+/*
+    Slot of the key in the TCB, or in a chunk. If the chunk has not been mapped,
+    maps it when asked to, otherwise returns NULL.
+*/
+static void** tls_key_slot(thread_tcb_t* tcb, tls_key_t key, int map)
+{
+    if (key < TLS_KEY_FIXED)
+    {
+        return &tcb->keys[key];
+    }
+
+    u64 chunk = (key - TLS_KEY_FIXED) / TLS_KEY_CHUNK;
+
+    if (tcb->key_chunks[chunk] == NULL)
+    {
+        if (!map)
+        {
+            return NULL;
+        }
+
+        u64 slots = sys_mmap(0, TLS_KEY_CHUNK*sizeof(void*), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
 
-    return sys_call4(SYS_wait4, (u64)pid, (u64)wstatus, (u64)options, (u64)rusage);
+        if ((i64)slots < 0 && (i64)slots >= -4095)
+        {
+            return NULL;
+        }
+
+        tcb->key_chunks[chunk] = (void**)slots;
+    }
+
+    return &tcb->key_chunks[chunk][(key - TLS_KEY_FIXED) % TLS_KEY_CHUNK];
 }
 
-i64 sys_futex(volatile i32 *uaddr, i64 futex_op, i32 val, const struct timespec *timeout, i32 *uaddr2, i32 val3)
+__attribute__((always_inline))
+inline void* tls_get(tls_key_t key)
 {
-    return sys_call6(SYS_futex, (u64)uaddr, (u64)futex_op, (u64)val, (u64)timeout, (u64)uaddr2, (u64)val3);
+    void* value;
+
+    if (__builtin_expect(key < TLS_KEY_FIXED, 1))
+    {
+#ifdef __amd64
+        asm volatile (
+            "movq %%fs:%c1(,%2,8), %0\n"
+            : "=r"(value)
+            : "i"(__builtin_offsetof(thread_tcb_t, keys)), "r"((u64)key)
+        );
+#else
+        value = thread_self()->keys[key];
+#endif
+    }
+    else
+    {
+        void** slot = tls_key_slot(thread_self(), key, 0);
+
+        value = slot != NULL ? *slot : NULL;
+    }
+
+    return value;
 }
 
-i64 sys_write(u64 fd, const void *buf, u64 count)
+__attribute__((always_inline))
+inline i64 tls_set(tls_key_t key, const void* value)
 {
-    return sys_call3(SYS_write, (u64)fd, (u64)buf, (u64)count);
+    if (__builtin_expect(key < TLS_KEY_FIXED, 1))
+    {
+#ifdef __amd64
+        asm volatile (
+            "movq %0, %%fs:%c1(,%2,8)\n"
+            :
+            : "r"(value), "i"(__builtin_offsetof(thread_tcb_t, keys)), "r"((u64)key)
+            : "memory"
+        );
+#else
+        thread_self()->keys[key] = (void*)value;
+#endif
+    }
+    else
+    {
+        void** slot = tls_key_slot(thread_self(), key, 1);
+
+        if (slot == NULL)
+        {
+            return -ENOMEM;
+        }
+
+        *slot = (void*)value;
+    }
+
+    return 0;
 }
 
-void sys_exit(i64 err_code)
+/*
+    Call the destructors of the keys with values, and unmap the chunks.
+*/
+static void tls_key_run_destructors(thread_tcb_t* tcb)
 {
-    sys_call1(SYS_exit, (u64)err_code);
+    for (u64 round = 0; round < TLS_KEY_DESTRUCTOR_ROUNDS; ++round)
+    {
+        u64 called = 0;
+        u64 count = tls_key_count < TLS_KEY_MAX ? tls_key_count : TLS_KEY_MAX;
+
+        for (tls_key_t key = 0; key < count; ++key)
+        {
+            tls_key_destructor_t destructor = tls_key_destructors[key];
+            void** slot = tls_key_slot(tcb, key, 0);
+
+            if (destructor == NULL || slot == NULL || *slot == NULL)
+            {
+                continue;
+            }
+
+            void* value = *slot;
+
+            *slot = NULL;
+            destructor(value);
+
+            ++called;
+        }
+
+        if (called == 0)
+        {
+            break;
+        }
+    }
+
+    for (u64 chunk = 0; chunk < TLS_KEY_CHUNKS; ++chunk)
+    {
+        if (tcb->key_chunks[chunk] != NULL)
+        {
+            sys_munmap(tcb->key_chunks[chunk], TLS_KEY_CHUNK*sizeof(void*));
+            tcb->key_chunks[chunk] = NULL;
+        }
+    }
 }
 
-u64 strlen(const char* str)
+void runtime_init(void)
 {
-    u64 len = 0;
+    auxv_init();
 
-    while (*str++) ++len;
+#ifdef __amd64
+    x64_fsgsbase = (auxv_get(AT_HWCAP2) & HWCAP2_FSGSBASE) != 0;
+#endif
 
-    return len;
+    atomic_init();
+    tls_init();
 }
 
-void print(const char* str)
+/*
+    Thread slots and their cached stacks
+*/
+
+static thread_t thread_pool[THREAD_POOL_SIZE];
+
+/*
+    A slot can be claimed when it is free, or when its thread was detached
+    and the kernel has cleared the tid on the exit of the thread.
+*/
+static int thread_slot_try_claim(thread_t* thread)
 {
-    sys_write(STDOUT_FD, str, strlen(str));
+    u32 state = thread->state;
+
+    if (state == THREAD_SLOT_FREE || (state == THREAD_SLOT_DETACHED && thread->tid == 0))
+    {
+        return atomic_cas(&thread->state, state, THREAD_SLOT_BUSY, ATOMIC_ACQUIRE);
+    }
+
+    return 0;
 }
 
-void println(void)
+static void thread_slot_free(thread_t* thread)
 {
-    static const char *nl = "\r\n";
-
-    sys_write(STDOUT_FD, nl, 2);
+    atomic_store(&thread->state, THREAD_SLOT_FREE, ATOMIC_RELEASE);
 }
 
-void u8_to_hex(const u8* byte, char* hex)
+
+/*
+    Claim a free slot and make sure it has a stack.
+    Returns NULL if there is no free slot, or the stack could not be mapped.
+*/
+static thread_t* thread_pool_claim(void)
 {
+    for (u64 i = 0; i < THREAD_POOL_SIZE; ++i)
     {
-        u8 low_nibble = *byte & 0x0f;
+        thread_t* thread = &thread_pool[i];
 
-        switch (low_nibble)
+        if (!thread_slot_try_claim(thread))
         {
-        case 0 ... 9: 
-            hex[1] = '0' + low_nibble;
-            break;
+            continue;
+        }
 
-        case 10 ... 15:
-            hex[1] = 'a' + low_nibble - 10;
-            break;
+        if (thread->stack == NULL)
+        {
+            /* 0 -- no preferred address, no file to map, no offset */
+            u64 stack = sys_mmap(0, THREAD_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_GROWSDOWN, 0, 0);
 
-        default:
-            fatal("Bad low nibble", __LINE__);
+            if ((i64)stack < 0 && (i64)stack >= -4095)
+            {
+                thread_slot_free(thread);
+
+                return NULL;
+            }
+
+            thread->stack = (void*)stack;
         }
+
+        thread->trimmed = 0;
+
+        return thread;
     }
 
+    return NULL;
+}
+
+void thread_stack_pool_trim(void)
+{
+    for (u64 i = 0; i < THREAD_POOL_SIZE; ++i)
     {
-        u8 high_nibble = *byte >> 4;
+        thread_t* thread = &thread_pool[i];
 
-        switch (high_nibble)
+        if (thread->stack == NULL || thread->trimmed)
         {
-        case 0 ... 9: 
-            hex[0] = '0' + high_nibble;
-            break;
+            continue;
+        }
 
-        case 10 ... 15:
-            hex[0] = 'a' + high_nibble - 10;
-            break;
+        /* Claim the slot for the time of trimming so nobody starts a thread on the stack */
+        if (!thread_slot_try_claim(thread))
+        {
+            continue;
+        }
 
-        default:
-            fatal("Bad high nibble", __LINE__);
+        if (thread->stack != NULL && !thread->trimmed)
+        {
+            sys_madvise(thread->stack, THREAD_STACK_SIZE, MADV_DONTNEED);
+            thread->trimmed = 1;
         }
+
+        thread_slot_free(thread);
     }
 }
 
-void u16_to_hex(const u8* bytes, char* hex)
+void thread_stack_pool_release(void)
 {
-    u8_to_hex(bytes, hex + 2);
-    u8_to_hex(bytes + 1, hex);
+    for (u64 i = 0; i < THREAD_POOL_SIZE; ++i)
+    {
+        thread_t* thread = &thread_pool[i];
+
+        if (thread->stack == NULL || !thread_slot_try_claim(thread))
+        {
+            continue;
+        }
+
+        if (thread->stack != NULL)
+        {
+            sys_munmap(thread->stack, THREAD_STACK_SIZE);
+            thread->stack = NULL;
+        }
+
+        thread_slot_free(thread);
+    }
 }
 
-void print_h64(u64 number)
+/*
+    The first code the new thread runs in C, on its own stack.
+*/
+__attribute__((noreturn, used))
+static void thread_entry(thread_t* thread, thread_start_t thread_start, void* thread_param)
 {
-    char hex_str[21];
+    /* The kernel has already stored the tid into the slot (CLONE_PARENT_SETTID) */
+    if (thread->tcb != NULL)
+    {
+        thread->tcb->tid = thread->tid;
+    }
+
+    u64 result = thread_start(thread_param);
+
+    if (thread->tcb != NULL)
+    {
+        thread_exit(result);
+    }
 
-    for (u64 i = 0; i < sizeof(hex_str)/sizeof(hex_str[0]); ++i)
+    thread->result = result;
+
+    for (;;)
     {
-        hex_str[i] = '0';
+        sys_exit(0);
     }
+}
+
+void thread_exit(u64 result)
+{
+    thread_tcb_t* tcb = thread_self();
 
-    hex_str[1] = 'x';
-    hex_str[6] = '_';
-    hex_str[11] = '_';
-    hex_str[16] = '_';
+    tls_key_run_destructors(tcb);
+    tls_arena_release(tcb);
+    print_flush();
 
-    u16_to_hex((const u8*)&number, hex_str + 17);
-    u16_to_hex(((const u8*)&number) + 2, hex_str + 12);
-    u16_to_hex(((const u8*)&number) + 4, hex_str + 7);
-    u16_to_hex(((const u8*)&number) + 6, hex_str + 2);
+    if (tcb->thread != NULL)
+    {
+        tcb->thread->result = result;
+    }
 
-    sys_write(STDOUT_FD, hex_str, sizeof(hex_str));
+    for (;;)
+    {
+        sys_exit(0);
+    }
 }
 
-__attribute__((noinline))
-u64 create_thread(thread_start_t thread_start, void* thread_param, void* tls)
+thread_t* create_thread(thread_start_t thread_start, void* thread_param, void* tls)
 {
     i64 err_code = 0;
 
-    const u64 stack_size = THREAD_STACK_SIZE;
+    /*
+        CLONE_PARENT_SETTID makes the tid visible to the parent as soon as
+        clone3 returns, CLONE_CHILD_SETTID before the child runs any code.
+        CLONE_CHILD_CLEARTID zeroes it and does FUTEX_WAKE on it when the thread exits.
+        CLONE_SETTLS sets FS.base or tpidr_el0 of the child, sparing it a syscall.
+    */
     const u64 flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND |
-                      CLONE_PARENT | CLONE_THREAD | CLONE_IO;
-    
-    /* 0 -- no preferred address, no file to map, no offset */
-    void* stack = (void*)sys_mmap(0, stack_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_GROWSDOWN, 0, 0);
-    void *stack_top               = (void*)((u64)(((char*)stack) + stack_size) & 0xfffffffffffffff0ULL);
-    void *stack_thread_func_start = ((char*)stack_top) - 8;
-    void *stack_param_loc         = ((char*)stack_top) - 16;
-    void *stack_tls_loc           = ((char*)stack_top) - 24;
-
-    *(u64*)stack_thread_func_start  = (u64)thread_start;
-    *(u64*)stack_param_loc          = (u64)thread_param;
-    *(u64*)stack_tls_loc            = (u64)tls;
+                      CLONE_PARENT | CLONE_THREAD | CLONE_IO | CLONE_SETTLS |
+                      CLONE_PARENT_SETTID | CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID;
 
-    /* 
-        Need very precise control here as the compiler may insert instructions between
-        syscall and ret.
+    thread_t* thread = thread_pool_claim();
+
+    if (thread == NULL)
+    {
+        return NULL;
+    }
+
+    thread->tid = -1;
+    thread->result = 0;
+    thread->tcb = NULL;
 
-        The new thread will return 0 from the clone syscall, and by doing ret, 
-        the new thread will jump to its code after popping the parameter from its stack.
+    if (tls == NULL)
+    {
+        tls = tls_block_init(1 + (thread - thread_pool));
+
+        thread_tcb_t* tcb = thread_tcb(tls);
+
+        tcb->thread      = thread;
+        tcb->stack_base  = (u8*)thread->stack + THREAD_STACK_SIZE;
+        tcb->stack_limit = thread->stack;
+
+        thread->tcb = tcb;
+    }
+
+    /* The kernel sets the stack pointer of the child to stack + stack_size */
+    struct clone_args args = {
+        .flags = flags,
+        .child_tid = (u64)&thread->tid,
+        .parent_tid = (u64)&thread->tid,
+        .stack = (u64)thread->stack,
+        .stack_size = THREAD_STACK_SIZE,
+        .tls = (u64)tls
+    };
+
+    /* 
+        The child returns 0 from clone3 on the new stack with all the other
+        registers copied from the parent. It must not touch anything in the frame
+        of the parent, so it takes the entry point and the parameters from the
+        callee-saved registers and calls into thread_entry.
 
         The new thread receives two parameters: the pointer to the parameter, and the 
-        address of its TLS area.
+        address of its TLS area in FS.base or tpidr_el0.
     */
 
 #ifdef __amd64
-    /* Need an additional syscall #158 (archpr_ctrl) for setting the FS.base MSR for TLS */
-
-    asm(
-        "syscall\n"
-        "orl        %%eax, %%eax\n"
-        "jnz        __1f\n"
-        "movq       $158, %%rax\n"
-        "movq       $0x1002, %%rdi\n"
-        "popq       %%rsi\n"
-        "syscall    \n"
-        "popq       %%rdi\n"
-        "ret\n"
-"__1f:\n"
-        : "=a"(err_code)
-        : "0"(SYS_clone), "D"(flags), "S"(stack_tls_loc)
-        : "memory", "cc", "r11", "rcx" /* Clobbered by the syscall */
-    );
+    {
+        register u64 _r12 asm("r12") = (u64)thread;
+        register u64 _r13 asm("r13") = (u64)thread_start;
+        register u64 _r14 asm("r14") = (u64)thread_param;
+        register u64 _r15 asm("r15") = (u64)thread_entry;
 
+        asm volatile(
+            "syscall\n"
+            "testq      %%rax, %%rax\n"
+            "jnz        1f\n"
+            "xorl       %%ebp, %%ebp\n"
+            "movq       %%r12, %%rdi\n"
+            "movq       %%r13, %%rsi\n"
+            "movq       %%r14, %%rdx\n"
+            "callq      *%%r15\n"
+            "ud2\n"
+    "1:\n"
+            : "=a"(err_code)
+            : "0"(SYS_clone3), "D"(&args), "S"(sizeof(args)),
+              "r"(_r12), "r"(_r13), "r"(_r14), "r"(_r15)
+            : "memory", "cc", "r11", "rcx" /* Clobbered by the syscall */
+        );
+    }
 #elif defined(__aarch64__)
     {
         /*
@@ -219,30 +1647,192 @@ u64 create_thread(thread_start_t thread_start, void* thread_param, void* tls)
             TPIDR_EL3     | RW         | UNK        | 64         | Thread Pointer/ID Register, EL3
         */
 
-        register u64 _id asm("x8") = SYS_clone;
-        register u64 _x0 asm("x0") = (u64)flags;
-        register u64 _x1 asm("x1") = (u64)stack_tls_loc - 8; /* ARM64 stack must be 16 byte aligned */
+        register u64 _id  asm("x8")  = SYS_clone3;
+        register u64 _x0  asm("x0")  = (u64)&args;
+        register u64 _x1  asm("x1")  = sizeof(args);
+        register u64 _x19 asm("x19") = (u64)thread;
+        register u64 _x20 asm("x20") = (u64)thread_start;
+        register u64 _x21 asm("x21") = (u64)thread_param;
+        register u64 _x22 asm("x22") = (u64)thread_entry;
 
-        asm(
+        asm volatile(
             "svc    0\n"
-            "cbnz	x0, __1f\n"
-            "ldp    x3, x1, [sp], #16\n"
-            "msr    tpidr_el0, x1\n"
-            "ldp    x0, x2, [sp], #16\n"
-            "ret    x2\n"
-    "__1f:\n"
-            : "=r"(_id)
-            : "r"(_id), "r"(_x0), "r"(_x1)
+            "cbnz   x0, 1f\n"
+            "mov    x29, xzr\n"
+            "mov    x30, xzr\n"
+            "mov    x0, x19\n"
+            "mov    x1, x20\n"
+            "mov    x2, x21\n"
+            "blr    x22\n"
+            "brk    #0\n"
+    "1:\n"
+            : "+r"(_x0)
+            : "r"(_id), "r"(_x1), "r"(_x19), "r"(_x20), "r"(_x21), "r"(_x22)
             : "memory", "cc" /* Clobbered by the syscall */
         );
 
-        err_code = _id;
+        err_code = _x0;
     }
 #else
 #   error "Unsupported architecture"
 #endif
 
-    return err_code;
+    if (err_code < 0)
+    {
+        /* No thread, give the slot back */
+        thread->tid = 0;
+        thread_slot_free(thread);
+
+        return NULL;
+    }
+
+    thread->state = THREAD_SLOT_JOINABLE;
+
+    return thread;
+}
+
+u64 thread_join(thread_t* thread)
+{
+    for (;;)
+    {
+        i32 tid = thread->tid;
+
+        if (tid == 0)
+        {
+            break;
+        }
+
+        /* The kernel wakes the shared futex on the tid when clearing it */
+        i64 s = sys_futex(&thread->tid, FUTEX_WAIT, tid, NULL, NULL, 0);
+
+        if (s != 0 && s != -EAGAIN && s != -EINTR)
+        {
+            fatal("thread_join", s);
+        }
+    }
+
+    u64 result = thread->result;
+
+    thread_slot_free(thread);
+
+    return result;
+}
+
+void thread_detach(thread_t* thread)
+{
+    /* Once detached, the slot is free as soon as the kernel clears the tid */
+    atomic_cas(&thread->state, THREAD_SLOT_JOINABLE, THREAD_SLOT_DETACHED, ATOMIC_RELEASE);
+}
+
+/*
+    Thread groups
+*/
+
+/* Set on the first -ENOSYS */
+static u32 futex_waitv_missing;
+
+void thread_group_init(thread_group_t* group, u32 flags)
+{
+    group->count = 0;
+    group->running = 0;
+    group->flags = flags;
+}
+
+i64 thread_group_spawn(thread_group_t* group, thread_start_t thread_start, void* thread_param)
+{
+    if (group->count == THREAD_GROUP_MAX)
+    {
+        return -ENOSPC;
+    }
+
+    thread_t* thread = create_thread(thread_start, thread_param, NULL);
+
+    if (thread == NULL)
+    {
+        return -EAGAIN;
+    }
+
+    group->threads[group->count] = thread;
+    group->results[group->count] = 0;
+    group->running++;
+
+    return group->count++;
+}
+
+static void thread_group_join_one(thread_group_t* group, u32 index)
+{
+    group->results[index] = thread_join(group->threads[index]);
+    group->threads[index] = NULL;
+    group->running--;
+}
+
+void thread_group_join_all(thread_group_t* group)
+{
+    for (u32 i = 0; i < group->count; ++i)
+    {
+        if (group->threads[i] != NULL)
+        {
+            thread_group_join_one(group, i);
+        }
+    }
+}
+
+i64 thread_group_join_any(thread_group_t* group)
+{
+    struct futex_waitv waiters[THREAD_GROUP_MAX];
+    u32 indices[THREAD_GROUP_MAX];
+
+    while (group->running != 0)
+    {
+        u32 count = 0;
+
+        for (u32 i = 0; i < group->count; ++i)
+        {
+            thread_t* thread = group->threads[i];
+
+            if (thread == NULL)
+            {
+                continue;
+            }
+
+            const i32 tid = thread->tid;
+
+            if (tid == 0)
+            {
+                thread_group_join_one(group, i);
+
+                return i;
+            }
+
+            /* Shared futexes: the kernel wakes the tid as such */
+            waiters[count].val = (u32)tid;
+            waiters[count].uaddr = (u64)&thread->tid;
+            waiters[count].flags = FUTEX2_SIZE_U32;
+            waiters[count].reserved = 0;
+            indices[count] = i;
+            ++count;
+        }
+
+        if (futex_waitv_missing || (group->flags & THREAD_GROUP_NO_WAITV) != 0)
+        {
+            thread_group_join_one(group, indices[0]);
+
+            return indices[0];
+        }
+
+        i64 s = sys_futex_waitv(waiters, count, 0, NULL, CLOCK_MONOTONIC);
+
+        if (s == -ENOSYS)
+        {
+            futex_waitv_missing = 1;
+        }
+        else if (s < 0 && s != -EAGAIN && s != -EINTR)
+        {
+            fatal("thread_group_join_any", s);
+        }
+    }
+
+    return -ECHILD;
 }
 
 void fatal(char*msg, u64 err_code)
@@ -253,6 +1843,7 @@ void fatal(char*msg, u64 err_code)
     print(", error code: ");
     print_h64(err_code);
     println();
+    print_flush();
 
 #ifdef __amd64
     asm volatile ("int $3");
@@ -267,47 +1858,94 @@ void fatal(char*msg, u64 err_code)
     Futexes
 */
 
-/* 
-    Acquire the futex pointed to by 'futexp': wait for its value to
-    become 1, and then set the value to 0. 
+void cpu_relax(void)
+{
+#ifdef __amd64
+    asm volatile ("pause" : : : "memory");
+#elif defined(__aarch64__)
+    asm volatile ("yield" : : : "memory");
+#else
+#   error "Unsupported architecture"
+#endif
+}
+
+void mutex_init(mutex_t* mutex)
+{
+    mutex->state = MUTEX_UNLOCKED;
+    mutex->spins = 0;
+}
+
+u32 mutex_trylock(mutex_t* mutex)
+{
+    return atomic_cas(&mutex->state, MUTEX_UNLOCKED, MUTEX_LOCKED, ATOMIC_ACQUIRE);
+}
+
+/*
+    Park. Whoever gets the mutex from here on leaves it contended, so the
+    unlock wakes the next waiter, at the cost of a wake for nobody when
+    the last waiter takes it.
 */
-void futex_acquire(volatile i32 *futexp)
+static void mutex_lock_contended(mutex_t* mutex)
 {
-    for (;;)
+    while (atomic_exchange(&mutex->state, MUTEX_CONTENDED, ATOMIC_ACQUIRE) != MUTEX_UNLOCKED)
     {
-        /* Is the futex available, i.e *futexp == 1 ? */
-        if (__sync_bool_compare_and_swap(futexp, 1, 0))
+        i64 s = sys_futex(&mutex->state, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, MUTEX_CONTENDED, NULL, NULL, 0);
+
+        if (s != 0 && s != -EAGAIN && s != -EINTR)
         {
-            /* Yes, it just was, and now it is acquired, i.e. set to 0  */
-            break;
+            fatal("mutex_lock", s);
         }
+    }
+}
+
+void mutex_lock(mutex_t* mutex)
+{
+    if (atomic_cas(&mutex->state, MUTEX_UNLOCKED, MUTEX_LOCKED, ATOMIC_ACQUIRE))
+    {
+        return;
+    }
 
-        /* Futex is not available; wait */
+    /* Spin up to twice what it took lately, the average moves by 1/8 of the difference */
+    const i32 max_spins = 2*mutex->spins + 10 < MUTEX_SPIN_MAX ? 2*mutex->spins + 10 : MUTEX_SPIN_MAX;
 
-        i64 s = sys_futex(futexp, FUTEX_WAIT, 0, NULL, NULL, 0);
+    for (i32 spins = 0; spins < max_spins; ++spins)
+    {
+        cpu_relax();
 
-        if (s != -EAGAIN && s != 0)
+        if (mutex->state == MUTEX_UNLOCKED &&
+            atomic_cas(&mutex->state, MUTEX_UNLOCKED, MUTEX_LOCKED, ATOMIC_ACQUIRE))
         {
-            fatal("futex_acquire", s);
+            mutex->spins += (spins - mutex->spins) / 8;
+
+            return;
         }
     }
+
+    mutex->spins += (max_spins - mutex->spins) / 8;
+
+    mutex_lock_contended(mutex);
 }
 
-/* 
-    Release the futex pointed to by 'futexp': if the futex currently
-    has the value 0, set its value to 1 and the wake any futex waiters,
-    so that if the peer is blocked in fpost(), it can proceed. 
-*/
-void futex_release(volatile i32 *futexp)
+void mutex_unlock(mutex_t* mutex)
 {
-    if (__sync_bool_compare_and_swap(futexp, 0, 1)) 
+    if (atomic_exchange(&mutex->state, MUTEX_UNLOCKED, ATOMIC_RELEASE) == MUTEX_CONTENDED)
     {
-        /* Wake at most 1 waiter */
-        i64 s = sys_futex(futexp, FUTEX_WAKE, 1, NULL, NULL, 0);
+        i64 s = sys_futex(&mutex->state, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
 
-        if (s  < 0 && s >= -4095)
+        if (s < 0)
         {
-            fatal("futex_release", 0);
+            fatal("mutex_unlock", s);
         }
     }
 }
+
+#include "libatomic.c"
+#include "libfiber.c"
+#include "libfmt.c"
+#include "libtrace.c"
+#include "libsync.c"
+#include "libpool.c"
+#include "libparallel.c"
+#include "libqueue.c"
+#include "libring.c"
+#include "libreclaim.c"
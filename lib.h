@@ -3,21 +3,46 @@
 
 #define NULL              ((void*)0)
 
+/*
+    The kernel enters _start with the stack pointer aligned on 16 bytes,
+    whereas the x64 compiler expects functions to be entered with the return
+    address pushed onto such a stack, and may use aligned SSE stores to it.
+*/
+#ifdef __amd64
+#   define ENTRY_POINT __attribute__((force_align_arg_pointer))
+#else
+#   define ENTRY_POINT
+#endif
+
 #define THREAD_STACK_SIZE 2*1024*1024
 
+/* Number of thread slots, each caching one stack */
+#define THREAD_POOL_SIZE  1024
+
+#define PROT_NONE	0x0		/* page can not be accessed */
 #define PROT_READ	0x1		/* page can be read */
 #define PROT_WRITE	0x2		/* page can be written */
 
+#define MAP_SHARED	    0x01		/* Share changes */
 #define MAP_PRIVATE	    0x02		/* Changes are private */
+#define MAP_FIXED	    0x10		/* Interpret addr exactly */
 #define MAP_ANONYMOUS	0x20		/* don't use a file */
 #define MAP_GROWSDOWN	0x0100		/* stack-like segment */
 
+#define MADV_DONTNEED	4		/* don't need these pages */
+
+#define MFD_CLOEXEC	    0x0001		/* close the memfd on exec */
+
 #define CLONE_VM	    0x00000100	/* set if VM shared between processes */
 #define CLONE_FS	    0x00000200	/* set if fs info shared between processes */
 #define CLONE_FILES	    0x00000400	/* set if open files shared between processes */
 #define CLONE_SIGHAND	0x00000800	/* set if signal handlers and blocked signals shared */
 #define CLONE_PARENT	0x00008000	/* set if we want to have the same parent as the cloner */
 #define CLONE_THREAD	0x00010000	/* Same thread group? */
+#define CLONE_SETTLS	0x00080000	/* create a new TLS for the child */
+#define CLONE_PARENT_SETTID	0x00100000	/* set the TID in the parent */
+#define CLONE_CHILD_CLEARTID	0x00200000	/* clear the TID in the child */
+#define CLONE_CHILD_SETTID	0x01000000	/* set the TID in the child */
 #define CLONE_IO		0x80000000	/* Clone io context */
 
 #define	WNOHANG		0x1	/* Don't block waiting.  */
@@ -31,9 +56,42 @@
 
 #define FUTEX_WAIT		0
 #define FUTEX_WAKE		1
+#define FUTEX_CMP_REQUEUE	4	/* Wake some, move the other waiters to another futex, if the value is still the same */
+
+#define FUTEX_PRIVATE_FLAG	128	/* The futex is not shared with other processes */
 
 #define STDOUT_FD       0x1         /* Standard output */
 
+#define CLOCK_MONOTONIC 1
+
+#define AT_FDCWD        -100        /* openat relative to the current directory */
+#define O_RDONLY        0x0
+#define O_WRONLY        0x1
+#define O_CREAT         0x40
+#define O_TRUNC         0x200
+
+/* Auxiliary vector entry types, see man 3 getauxval */
+
+#define AT_NULL         0           /* End of vector */
+#define AT_PHDR         3           /* Program headers of the executable */
+#define AT_PHENT        4           /* Size of a program header entry */
+#define AT_PHNUM        5           /* Number of program headers */
+#define AT_PAGESZ       6           /* System page size */
+#define AT_HWCAP        16          /* CPU capabilities */
+#define AT_HWCAP2       26          /* More CPU capabilities */
+#define AT_EXECFN       31          /* File name of the executable, near the top of the main stack */
+
+#define HWCAP2_FSGSBASE (1 << 1)    /* x64: the kernel allows rd/wr{fs,gs}base in the user mode */
+#define HWCAP_ATOMICS   (1 << 8)    /* ARM64: the LSE atomic instructions */
+
+#define RLIMIT_STACK    3           /* Maximum size of the main stack */
+#define RLIM_INFINITY   (~0ULL)
+
+/* ELF program header types */
+
+#define PT_PHDR         6           /* Entry for the program header table itself */
+#define PT_TLS          7           /* Thread-local storage segment */
+
 #define	EPERM		 1	/* Operation not permitted */
 #define	ENOENT		 2	/* No such file or directory */
 #define	ESRCH		 3	/* No such process */
@@ -68,10 +126,14 @@
 #define	EPIPE		32	/* Broken pipe */
 #define	EDOM		33	/* Math argument out of domain of func */
 #define	ERANGE		34	/* Math result not representable */
+#define	ENOSYS		38	/* Invalid system call number */
 
 typedef unsigned char u8;
 typedef signed char i8;
 
+typedef unsigned short u16;
+typedef signed short i16;
+
 typedef unsigned int u32;
 typedef signed int i32;
 
@@ -94,6 +156,26 @@ u64 sys_mmap(void *addr, u64 length, u64 prot, u64 flags, i64 fd, u64 offset);
 */
 u64 sys_munmap(void *addr, u64 length);
 
+/*
+    Change the protection of mapped pages
+*/
+i64 sys_mprotect(void *addr, u64 length, u64 prot);
+
+/*
+    Give advice about use of memory
+*/
+i64 sys_madvise(void *addr, u64 length, u64 advice);
+
+/*
+    Create an anonymous file living in memory
+*/
+i64 sys_memfd_create(const char *name, u64 flags);
+
+/*
+    Set the size of a file
+*/
+i64 sys_ftruncate(u64 fd, u64 length);
+
 /*
     Clone current thread
 */
@@ -116,11 +198,135 @@ struct timespec
 
 i64 sys_futex(volatile i32 *uaddr, i64 futex_op, i32 val, const struct timespec *timeout, i32 *uaddr2, i32 val3);
 
+/*
+    Wait on several futexes at once (Linux 5.16): returns the index of the
+    one woken, -EAGAIN if a value was not the expected one already.
+    The timeout is absolute, on the clock given.
+*/
+
+#define FUTEX2_SIZE_U32     0x02
+#define FUTEX2_PRIVATE      FUTEX_PRIVATE_FLAG
+#define FUTEX_WAITV_MAX     128
+
+struct futex_waitv
+{
+    u64 val;
+    u64 uaddr;
+    u32 flags;
+    u32 reserved;
+};
+
+i64 sys_futex_waitv(struct futex_waitv* waiters, u32 count, u32 flags, const struct timespec *timeout, u64 clock_id);
+
+/*
+    Make the other threads run a memory barrier, see man 2 membarrier
+*/
+
+#define MEMBARRIER_CMD_QUERY                        0
+#define MEMBARRIER_CMD_PRIVATE_EXPEDITED            (1 << 3)
+#define MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED   (1 << 4)
+
+i64 sys_membarrier(u64 cmd, u64 flags, i64 cpu_id);
+
+/*
+    Calls to sys_futex the calling thread has made, counted in its TCB for
+    the benchmarks of the locks. 0 without a TCB.
+
+    Only with THREAD_COUNT_FUTEX_CALLS defined before lib.c is included:
+    otherwise sys_futex is the bare system call.
+*/
+#ifdef THREAD_COUNT_FUTEX_CALLS
+u64 thread_futex_calls(void);
+#endif
+
+/*
+    Read a clock
+*/
+i64 sys_clock_gettime(u64 clock_id, struct timespec *tp);
+
+/*
+    CLOCK_MONOTONIC in nanoseconds
+*/
+u64 monotonic_ns(void);
+
+/*
+    Sleep for at least ns nanoseconds of CLOCK_MONOTONIC
+*/
+void sleep_ns(u64 ns);
+
+/*
+    The cycle counter: the TSC on x64, which ticks at a constant rate whatever
+    the core clock is, and the virtual count of the generic timer on ARM64.
+    Earlier instructions complete before it is read.
+*/
+u64 cycle_counter(void);
+
+/*
+    Ticks of cycle_counter per second, measured against CLOCK_MONOTONIC on x64.
+*/
+u64 cycle_counter_hz(void);
+
+/*
+    System calls to open, read and close files
+*/
+i64 sys_openat(i64 dirfd, const char *path, u64 flags, u64 mode);
+i64 sys_read(u64 fd, void *buf, u64 count);
+i64 sys_close(u64 fd);
+
+/*
+    Thread id of the calling thread
+*/
+i64 sys_gettid(void);
+
+/*
+    Get and set resource limits
+*/
+
+struct rlimit
+{
+    u64 rlim_cur;
+    u64 rlim_max;
+};
+
+i64 sys_prlimit64(u64 pid, u64 resource, const struct rlimit *new_limit, struct rlimit *old_limit);
+
+/*
+    Operations on the process
+*/
+#define PR_GET_AUXV     0x41555856  /* Copy the auxiliary vector, since Linux 6.4 */
+
+i64 sys_prctl(u64 option, u64 arg2, u64 arg3, u64 arg4, u64 arg5);
+
+/*
+    The CPUs a thread may run on, a bit each; the kernel returns the bytes
+    of the mask it wrote
+*/
+#define CPU_MASK_WORDS  16
+
+i64 sys_sched_getaffinity(u64 pid, u64 size, u64* mask);
+
+/*
+    How many CPUs the calling thread may run on, 1 if the kernel cannot tell
+*/
+u64 cpu_count(void);
+
 /*
     System call to write data to file fd
 */
 i64 sys_write(u64 fd, const void *buf, u64 count);
 
+/*
+    Gather write: the buffers go out in one system call
+*/
+
+struct iovec
+{
+    const void* iov_base;
+    u64         iov_len;
+};
+
+i64 sys_writev(u64 fd, const struct iovec *iov, u64 iovcnt);
+
 /*
     System calls to write the FS.base and GS.base
     Machine Specific Registers.
@@ -176,6 +382,32 @@ typedef struct _ldt_entry_t
 i64 sys_read_ldt(ldt_entry_t* table, u64 byte_count);
 i64 sys_write_ldt(ldt_entry_t* table, u64 byte_count);
 
+/*
+    ELF program header
+*/
+
+typedef struct _elf64_phdr_t
+{
+    u32 p_type;
+    u32 p_flags;
+    u64 p_offset;
+    u64 p_vaddr;
+    u64 p_paddr;
+    u64 p_filesz;
+    u64 p_memsz;
+    u64 p_align;
+} elf64_phdr_t;
+
+/*
+    Value of an entry in the auxiliary vector the kernel passed to the process,
+    or 0 if there is no such entry.
+
+    runtime_init reads the vector once, before any thread is started: with
+    prctl(PR_GET_AUXV), or from /proc/self/auxv on a kernel older than 6.4.
+    There is no vector before that.
+*/
+u64 auxv_get(u64 type);
+
 /*
     System call to exit the process.
     Otherwise the CPU may jump into the weeds.
@@ -183,15 +415,443 @@ i64 sys_write_ldt(ldt_entry_t* table, u64 byte_count);
 
 void sys_exit(i64 err_code);
 
+/*
+    Thread slot.
+
+    Owns a cached stack and the word where the kernel keeps the thread id
+    (CLONE_PARENT_SETTID, CLONE_CHILD_SETTID) and clears it when the thread exits
+    (CLONE_CHILD_CLEARTID). After the kernel has cleared the word, the thread never
+    touches its stack again, so the stack can be handed out to the next thread as is.
+
+    A joinable slot is taken back by thread_join, a detached one as soon
+    as the tid is cleared.
+*/
+
+#define THREAD_SLOT_FREE        0
+#define THREAD_SLOT_BUSY        1   /* Claimed, the thread is being started or the stack trimmed */
+#define THREAD_SLOT_JOINABLE    2
+#define THREAD_SLOT_DETACHED    3
+
+typedef struct _thread_t
+{
+    volatile i32    tid __attribute__((aligned(4)));
+    volatile u32    state;
+    u32             trimmed;    /* The pages of the stack were given back to the kernel */
+    void*           stack;      /* Base of the stack mapping, or NULL if none yet */
+    u64             result;     /* What the start routine returned */
+    struct _thread_tcb_t* tcb;  /* Control block of the thread, NULL if the creator supplied the TLS */
+} thread_t;
+
+/*
+    Give the pages of the idle cached stacks back to the kernel with MADV_DONTNEED.
+    The mappings are kept, so the stacks are still reused without a mmap.
+*/
+void thread_stack_pool_trim(void);
+
+/*
+    Unmap the idle cached stacks.
+*/
+void thread_stack_pool_release(void);
+
+/*
+    Arguments of clone3, the fields up to CLONE_ARGS_SIZE_VER0
+*/
+struct clone_args
+{
+    u64 flags;
+    u64 pidfd;
+    u64 child_tid;
+    u64 parent_tid;
+    u64 exit_signal;
+    u64 stack;
+    u64 stack_size;
+    u64 tls;
+};
+
+/*
+    Thread-local storage.
+
+    Every thread gets a block of the TLS slab: the TLS image of the executable
+    taken from its PT_TLS segment (.tdata copied, .tbss zeroed), and
+    the thread control block the thread pointer points to.
+
+    x64, variant II:
+
+        | TLS image | TCB |
+                    ^ FS.base, the self pointer of the TCB
+
+    ARM64, variant I:
+
+        | TCB | padding to p_align | TLS image |
+           ^ tpidr_el0, the 16 bytes of the psABI TCB at the end of the TCB
+
+    Block 0 belongs to the main thread, block i + 1 to the thread slot i.
+    Blocks are aligned on the cache line, or on p_align if that is larger.
+*/
+
+#define CACHE_LINE_SIZE 64
+
+/*
+    Thread control block.
+
+    Lives at the thread pointer, so the thread finds it without a syscall,
+    and other per-thread state can hang off it.
+*/
+
+#define THREAD_OUT_SIZE     512     /* Per-thread output buffer, see print() */
+#define THREAD_TCB_SCRATCH  8
+
+/*
+    Marks the TCBs the runtime built, in a word next to the thread pointer:
+    a thread running on a TLS block of its creator has something else there.
+*/
+#define THREAD_TCB_MAGIC    0x6b6f6f7469727563ULL
+
+/*
+    Thread-specific data keys: the first TLS_KEY_FIXED keys have their slots
+    right in the TCB, the rest go to chunks of TLS_KEY_CHUNK slots mapped
+    the first time the thread stores a value there.
+*/
+#define TLS_KEY_FIXED       32
+#define TLS_KEY_CHUNK       512
+#define TLS_KEY_CHUNKS      8
+#define TLS_KEY_MAX         (TLS_KEY_FIXED + TLS_KEY_CHUNK*TLS_KEY_CHUNKS)
+
+/* How many times to go over the destructors while they keep storing values */
+#define TLS_KEY_DESTRUCTOR_ROUNDS   4
+
+/*
+    Dynamic TLS: module 1 is the executable, the others are registered at run time.
+    A thread maps its dynamic thread vector and the blocks of the modules from
+    arenas of TLS_ARENA_SIZE bytes the first time it touches a module.
+*/
+#define TLS_MODULE_MAX      64
+#define TLS_ARENA_SIZE      (64*1024)
+
+/*
+    Nodes of the queue locks, see libsync.h: a thread holds or waits for
+    at most QLOCK_NODES of them at a time. A node has a cache line to itself,
+    so the TCB and the TLS blocks are aligned on the cache line as well.
+*/
+#define QLOCK_NODES         4
+
+typedef struct _qlock_node_t
+{
+    struct _qlock_node_t* volatile  next;       /* MCS: the successor */
+    struct _qlock_node_t*           pred;       /* CLH: the node waited on */
+    volatile i32                    locked;     /* 1 while held or waited for, 2 once the waiter parked */
+    u32                             slot;       /* In qlock_owned of the TCB that owns the node */
+    u8                              pad[CACHE_LINE_SIZE - 2*sizeof(void*) - 2*sizeof(u32)];
+} __attribute__((aligned(CACHE_LINE_SIZE))) qlock_node_t;
+
+typedef struct _thread_tcb_t
+{
+#ifdef __amd64
+    struct _thread_tcb_t*   self;           /* %fs:0, the psABI requires it to hold the thread pointer */
+    void*                   dtv;            /* %fs:8, dynamic thread vector */
+    u64                     magic;          /* %fs:16, THREAD_TCB_MAGIC */
+#endif
+    thread_t*               thread;         /* Slot of the thread, NULL for the main thread */
+    u64                     index;          /* Index of the TLS block: 0 for the main thread, slot + 1 otherwise */
+    i64                     tid;
+    void*                   stack_base;     /* Highest address of the stack */
+    void*                   stack_limit;    /* Lowest address of the stack */
+    u64                     scratch[THREAD_TCB_SCRATCH];
+    void*                   keys[TLS_KEY_FIXED];        /* Slots of the fixed keys */
+    void**                  key_chunks[TLS_KEY_CHUNKS]; /* Slots of the other keys */
+    u8*                     tls_arena;                  /* Current arena for the dynamic TLS */
+    u64                     tls_arena_used;
+    void*                   fiber;                      /* The fiber this TCB belongs to, see libfiber.h */
+    void*                   carrier;                    /* The fiber carrier the thread runs */
+    void*                   worker;                     /* The pool worker the thread is, see libpool.h */
+#ifdef THREAD_COUNT_FUTEX_CALLS
+    u64                     futex_calls;                /* See thread_futex_calls() */
+#endif
+    u32                     out_capacity;
+    u32                     out_used;
+    char                    out[THREAD_OUT_SIZE];       /* Output collected by print() */
+    u32                     qlock_busy;                 /* Slots of qlock_owned in use */
+    /* Kept when the block is rebuilt: the CLH nodes change hands between the TCBs */
+    qlock_node_t*           qlock_owned[QLOCK_NODES];
+    qlock_node_t            qlock_storage[QLOCK_NODES];
+#ifdef __aarch64__
+    /* Fills the line, so that nothing of the TCB is past 'magic' */
+    u8                      psabi_pad[CACHE_LINE_SIZE - 2*sizeof(u64)];
+    void*                   dtv;            /* tpidr_el0 + 0, dynamic thread vector */
+    u64                     magic;          /* tpidr_el0 + 8, THREAD_TCB_MAGIC */
+#endif
+} thread_tcb_t;
+
+#ifdef __amd64
+#   define TLS_TP_TO_TCB    0
+#elif defined(__aarch64__)
+#   define TLS_TP_TO_TCB    __builtin_offsetof(thread_tcb_t, dtv)
+#else
+#   error "Unsupported architecture"
+#endif
+
+typedef struct _tls_layout_t
+{
+    const void* image;          /* .tdata initializers */
+    u64         image_size;     /* p_filesz: bytes to copy, the rest up to p_memsz is .tbss */
+    u64         size;           /* p_memsz */
+    u64         align;          /* p_align */
+    u64         image_offset;   /* Offset of the TLS image in a block */
+    u64         tp_offset;      /* Offset of the thread pointer in a block */
+    u64         block_size;     /* Distance between the blocks */
+    u8*         slab;           /* THREAD_POOL_SIZE + 1 blocks */
+} tls_layout_t;
+
+extern tls_layout_t tls_layout;
+
+/*
+    Find the PT_TLS segment, map the slab, and set up the TLS of the main thread.
+*/
+void tls_init(void);
+
+/*
+    Build the TLS block with the index, and return the thread pointer for it.
+    The TCB has the self pointer and the index filled in, the rest zeroed
+    but the queue lock nodes: the block must come zeroed from mmap the
+    first time.
+*/
+void* tls_block_init(u64 index);
+
+/*
+    Same for a block outside the slab, tls_layout.block_size bytes aligned
+    on the cache line, or on tls_layout.align if that is larger.
+*/
+void* tls_block_build(u8* block, u64 index);
+
+/*
+    Thread control block of the calling thread, a single load on x64,
+    no load at all on ARM64.
+*/
+thread_tcb_t* thread_self(void);
+
+/*
+    Thread control block for the thread pointer.
+*/
+thread_tcb_t* thread_tcb(void* tp);
+
+/*
+    Set the thread pointer of the calling thread: FS.base on x64, tpidr_el0 on ARM64.
+*/
+void tls_set_thread_pointer(void* tp);
+
+/*
+    Thread pointer of the calling thread, read from the register.
+*/
+void* tls_get_thread_pointer(void);
+
+#ifdef __amd64
+
+/*
+    FS.base and GS.base of the calling thread.
+
+    When the kernel allows it (HWCAP2_FSGSBASE, Linux 5.9 and later), these are
+    the rdfsbase, wrfsbase, rdgsbase and wrgsbase instructions, no kernel entry.
+    Otherwise they fall back to arch_prctl.
+
+    FS.base is the thread pointer. GS.base is not used by the runtime, and is
+    left to the program as a second per-thread pointer, e.g. for the current
+    fiber or CPU-local data, reachable with %gs: prefixed accesses.
+*/
+u64  x64_get_fs_base(void);
+void x64_set_fs_base(u64 base);
+u64  x64_get_gs_base(void);
+void x64_set_gs_base(u64 base);
+
+#endif
+
+/*
+    Thread-specific data keys, akin to pthread_key_create/getspecific/setspecific.
+
+    A fixed key is a slot at a constant offset from the thread pointer, so
+    reading or writing it is a single instruction. The destructor of a key,
+    if any, is called with the value of the key when the thread exits
+    through thread_exit and the value is not NULL.
+*/
+typedef u32 tls_key_t;
+typedef void (*tls_key_destructor_t)(void*);
+
+/*
+    Returns 0, or -EAGAIN if TLS_KEY_MAX keys have been created.
+*/
+i64 tls_key_create(tls_key_t* key, tls_key_destructor_t destructor);
+
+/*
+    Value of the key in the calling thread, NULL if never set.
+*/
+void* tls_get(tls_key_t key);
+
+/*
+    Returns 0, or -ENOMEM if the slots for the key could not be mapped.
+*/
+i64 tls_set(tls_key_t key, const void* value);
+
+/*
+    Dynamic TLS.
+
+    The dynamic thread vector of a thread holds the generation it was last
+    brought up to date with in slot 0, and the address of the block of module i
+    in slot i, or 0 if the thread has not touched the module yet.
+    Registering or unregistering a module bumps the global generation, making
+    every thread check its vector against the modules once.
+*/
+
+typedef struct _tls_module_t
+{
+    const void* image;          /* Initializers */
+    u64         image_size;     /* Bytes to copy, the rest up to 'size' is zeroed */
+    u64         size;
+    u64         align;
+    u64         generation;     /* When the module was last registered or unregistered */
+    u32         in_use;
+} tls_module_t;
+
+/* What the general-dynamic code passes to __tls_get_addr */
+typedef struct _tls_index_t
+{
+    u64 module;
+    u64 offset;
+} tls_index_t;
+
+/*
+    TLS descriptor: the first two words are what the TLSDESC code sequence
+    expects, the resolver and its argument. The resolver returns the offset
+    of the variable from the thread pointer and preserves all the registers
+    but the return one (and the link register on ARM64).
+*/
+typedef struct _tls_desc_t
+{
+    void*       resolver;
+    u64         arg;
+    tls_index_t index;
+} tls_desc_t;
+
+extern volatile u64 tls_generation;
+
+/*
+    Register a TLS image, returns the module id or -EINVAL, -EAGAIN.
+*/
+i64 tls_module_register(const void* image, u64 image_size, u64 size, u64 align);
+
+/*
+    The blocks of the module are dropped from the vectors, not unmapped:
+    the arenas are given back when the threads exit.
+*/
+void tls_module_unregister(u64 module);
+
+/*
+    Address of the variable for the calling thread. The fast path checks
+    the generation and loads the block address from the vector.
+*/
+void* __tls_get_addr(tls_index_t* ti);
+
+/*
+    Fill in a descriptor for the variable at the offset in the module.
+    Module 1 gets a resolver returning the constant offset, the others
+    a resolver looking up the vector.
+*/
+void tls_desc_init(tls_desc_t* desc, u64 module, u64 offset);
+
+/*
+    Address of the variable through the TLSDESC call sequence.
+*/
+void* tls_desc_get_addr(tls_desc_t* desc);
+
+/*
+    Set up the runtime for the main thread. To be called first thing in _start.
+*/
+void runtime_init(void);
+
 /*
     Create new thread.
 
     The new thread receives two parameters: the pointer to the parameter, and the 
-    address of its TLS area.
+    address of its TLS area. When 'tls' is NULL, the new thread gets its own
+    TLS block built from the PT_TLS segment, otherwise the thread pointer is set to 'tls'.
+
+    The stack comes from the pool of thread slots, and goes back to the pool
+    when the thread is joined or, if detached, exits.
+    Returns NULL if the thread could not be created.
 */
 typedef u64 (*thread_start_t)(void*);
 
-u64 create_thread(thread_start_t thread_start, void* thread_param, void* tls);
+thread_t* create_thread(thread_start_t thread_start, void* thread_param, void* tls);
+
+/*
+    Wait for the thread to exit, and return what its start routine returned.
+    The kernel wakes the waiter when it clears the tid, so exiting takes
+    no syscall from the thread itself.
+*/
+u64 thread_join(thread_t* thread);
+
+/*
+    Let the slot of the thread go back to the pool on its own when the thread exits.
+*/
+void thread_detach(thread_t* thread);
+
+/*
+    Run the destructors of the keys and exit the calling thread, the same
+    as returning 'result' from the start routine. The thread must have its
+    TLS block from create_thread or be the main thread.
+*/
+__attribute__((noreturn))
+void thread_exit(u64 result);
+
+/*
+    Thread group.
+
+    The threads of a group are waited for together: all of them, or the
+    first to exit, with one futex_waitv over their tid words, which the
+    kernel wakes as it does for thread_join. Where futex_waitv is missing,
+    the threads are waited for one after another, and waiting for any of
+    them waits for the first one still running.
+
+    A group holds as many threads as a futex_waitv takes words. A thread
+    keeps its index in the group, the order of the spawns, until joined.
+*/
+
+#define THREAD_GROUP_MAX    FUTEX_WAITV_MAX
+
+/*
+    Flags of thread_group_init.
+    THREAD_GROUP_NO_WAITV -- wait as where futex_waitv is missing, to test
+                             that path or to compare with it.
+*/
+#define THREAD_GROUP_NO_WAITV   0x1
+
+typedef struct _thread_group_t
+{
+    u32         count;                      /* Threads spawned */
+    u32         running;                    /* Threads not joined yet */
+    u32         flags;
+    thread_t*   threads[THREAD_GROUP_MAX];  /* NULL once joined */
+    u64         results[THREAD_GROUP_MAX];  /* What the start routines returned */
+} thread_group_t;
+
+void thread_group_init(thread_group_t* group, u32 flags);
+
+/*
+    Create a thread in the group. Returns its index, -ENOSPC if the group
+    is full, or -EAGAIN if the thread could not be created.
+*/
+i64 thread_group_spawn(thread_group_t* group, thread_start_t thread_start, void* thread_param);
+
+/*
+    Wait for all the threads of the group to exit. Joining them in turn
+    sleeps at most once per thread, the same as a futex_waitv per exit
+    would, so no futex_waitv here.
+*/
+void thread_group_join_all(thread_group_t* group);
+
+/*
+    Wait for a thread of the group to exit and join it. Returns its index,
+    or -ECHILD if all have been joined already.
+*/
+i64 thread_group_join_any(thread_group_t* group);
 
 /*
     Fatal exit
@@ -200,30 +860,72 @@ u64 create_thread(thread_start_t thread_start, void* thread_param, void* tls);
 void fatal(char*msg, u64 err_code);
 
 /*
-    Futexes
-*/
+    Mutex on a futex.
 
-/* 
-    Acquire the futex pointed to by 'futexp': wait for its value to
-    become 1, and then set the value to 0. 
+    The state is 0 when unlocked, 1 when locked, and 2 when locked with
+    threads possibly waiting. Locking and unlocking without contention is
+    one atomic each and no system call. A thread that finds the mutex locked
+    spins for a while before it parks; how long adapts to how long the spins
+    took to succeed before. Unlocking wakes a waiter only if the state says
+    there may be one.
+
+    The futex operations are private to the process.
 */
-void futex_acquire(volatile i32 *futexp);
 
-/* 
-    Release the futex pointed to by 'futexp': if the futex currently
-    has the value 0, set its value to 1 and the wake any futex waiters,
-    so that if the peer is blocked in fpost(), it can proceed. 
+#define MUTEX_UNLOCKED      0
+#define MUTEX_LOCKED        1
+#define MUTEX_CONTENDED     2
+
+#define MUTEX_SPIN_MAX      100
+
+typedef struct _mutex_t
+{
+    volatile i32    state;
+    i32             spins;      /* Running average of the spins that got the lock */
+} mutex_t;
+
+#define MUTEX_INIT          { .state = MUTEX_UNLOCKED, .spins = 0 }
+
+void mutex_init(mutex_t* mutex);
+void mutex_lock(mutex_t* mutex);
+void mutex_unlock(mutex_t* mutex);
+
+/*
+    Returns 1 if the mutex has been locked, 0 if it is already.
 */
-void futex_release(volatile i32 *futexp);
+u32  mutex_trylock(mutex_t* mutex);
 
+/*
+    A hint to the CPU that the thread is spinning
+*/
+void cpu_relax(void);
 
 /* 
     String and I/O
 */
 
+void* memcpy(void* dst, const void* src, u64 count);
+void* memset(void* dst, int value, u64 count);
+int  memcmp(const void* a, const void* b, u64 count);
 u64  strlen(const char* str);
+
+/*
+    The output is collected in a buffer in the TCB of the calling thread, and
+    written when it ends a line, when it is full, and by print_flush.
+    A line that fits the buffer goes out in one write, so the lines of the
+    threads do not mix. A thread running on a TLS block without a TCB writes
+    every fragment as it comes.
+*/
 void print(const char* str);
 void println(void);
 void print_h64(u64 number);
+void print_d64(u64 number);
+
+/*
+    Write what the calling thread has collected. thread_exit, the fibers
+    finishing and fatal do it; the main thread before sys_exit if its last
+    output does not end a line.
+*/
+void print_flush(void);
 
 #endif
@@ -0,0 +1,40 @@
+#include "libatomic.h"
+
+#ifdef __aarch64__
+u32 arm64_lse;
+#endif
+
+u32 membarrier_expedited;
+
+void atomic_init(void)
+{
+#ifdef __aarch64__
+    arm64_lse = (auxv_get(AT_HWCAP) & HWCAP_ATOMICS) != 0;
+#endif
+
+    /* The expedited command fails until the process has registered */
+    const i64 commands = sys_membarrier(MEMBARRIER_CMD_QUERY, 0, 0);
+
+    if (commands > 0 && (commands & MEMBARRIER_CMD_PRIVATE_EXPEDITED) != 0 &&
+        sys_membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0)
+    {
+        atomic_store(&membarrier_expedited, 1, ATOMIC_RELEASE);
+    }
+}
+
+void atomic_fence_heavy(void)
+{
+    if (!membarrier_expedited)
+    {
+        atomic_fence(ATOMIC_SEQ_CST);
+
+        return;
+    }
+
+    i64 s = sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+
+    if (s != 0)
+    {
+        fatal("atomic_fence_heavy", s);
+    }
+}
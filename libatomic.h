@@ -0,0 +1,277 @@
+#ifndef __LIBATOMIC_H__
+#define __LIBATOMIC_H__
+
+#include "lib.h"
+
+/*
+    Atomic operations with explicit memory orders.
+
+    The __sync builtins are full barriers: on ARM64, a dmb after every
+    LL/SC loop, even where the algorithm needs no ordering at all. Here
+    each operation takes the order it needs:
+        ATOMIC_RELAXED  -- atomicity only;
+        ATOMIC_ACQUIRE  -- later accesses stay after it: ldar on ARM64;
+        ATOMIC_RELEASE  -- earlier accesses stay before it: stlr on ARM64;
+        ATOMIC_ACQ_REL  -- both, for read-modify-writes;
+        ATOMIC_SEQ_CST  -- both, and a single order of all the SEQ_CST
+                           operations, as a store-load fence needs.
+    On x64, every read-modify-write is a locked instruction anyway, and
+    only the SEQ_CST stores and fences cost more.
+
+    On ARM64, the read-modify-writes use the LSE instructions (swp, ldadd,
+    cas, with the a/l/al forms for the orders) when the CPU has them,
+    HWCAP_ATOMICS in the auxiliary vector: one instruction instead of a
+    loop that may fail under contention. Until atomic_init has run, and on
+    the CPUs without LSE, they are the LL/SC loops the compiler emits.
+
+    The operations work on 4- and 8-byte integers and on pointers, and
+    return the type pointed to.
+*/
+
+#define ATOMIC_RELAXED  __ATOMIC_RELAXED
+#define ATOMIC_ACQUIRE  __ATOMIC_ACQUIRE
+#define ATOMIC_RELEASE  __ATOMIC_RELEASE
+#define ATOMIC_ACQ_REL  __ATOMIC_ACQ_REL
+#define ATOMIC_SEQ_CST  __ATOMIC_SEQ_CST
+
+/*
+    Look for LSE on ARM64 and register for membarrier, runtime_init calls it.
+*/
+void atomic_init(void);
+
+/*
+    Asymmetric fences, for protocols where one side runs all the time and
+    the other seldom: a flag checked on every request against a writer that
+    comes once in a while, the owner of a lock against the other threads.
+
+    atomic_fence_light on the frequent side is only a compiler barrier.
+    atomic_fence_heavy on the rare side has every running thread of the
+    process execute a full barrier, with membarrier(2) and
+    MEMBARRIER_CMD_PRIVATE_EXPEDITED: whatever the light fences run into,
+    it is as if they were full ones. The heavy side pays an interrupt on
+    each CPU running a thread of the process, the frequent side nothing.
+
+    Without membarrier, and before atomic_init has run, the light fence is a
+    full one and the heavy fence is no more.
+*/
+extern u32 membarrier_expedited;
+
+static inline __attribute__((always_inline)) void atomic_fence_light(void)
+{
+    if (__builtin_expect(membarrier_expedited, 1))
+    {
+        asm volatile ("" ::: "memory");
+    }
+    else
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+void atomic_fence_heavy(void);
+
+#ifdef __aarch64__
+extern u32 arm64_lse;
+
+/*
+    GCC 10 and later call the helpers of libgcc for the atomic builtins on
+    ARM64 by default, to pick LSE at run time; the runtime does that itself,
+    and does not link libgcc.
+*/
+#if !defined(__clang__) && __GNUC__ >= 10
+#pragma GCC target ("no-outline-atomics")
+#endif
+#endif
+
+#define atomic_load(p, order)           __atomic_load_n((p), (order))
+#define atomic_store(p, value, order)   __atomic_store_n((p), (value), (order))
+#define atomic_fence(order)             __atomic_thread_fence(order)
+
+/* Fails to compile on the sizes without an atomic operation here */
+#define ATOMIC_CHECK_SIZE(p)            ((void)sizeof(char[sizeof(*(p)) == 4 || sizeof(*(p)) == 8 ? 1 : -1]))
+
+/*
+    The value before the exchange
+*/
+#define atomic_exchange(p, value, order) \
+    (ATOMIC_CHECK_SIZE(p), (__typeof__(*(p)))(sizeof(*(p)) == 4 ? \
+        (u64)atomic_exchange_32((p), (u64)(value), (order)) : atomic_exchange_64((p), (u64)(value), (order))))
+
+/*
+    The value before the addition
+*/
+#define atomic_fetch_add(p, value, order) \
+    (ATOMIC_CHECK_SIZE(p), (__typeof__(*(p)))(sizeof(*(p)) == 4 ? \
+        (u64)atomic_fetch_add_32((p), (u64)(value), (order)) : atomic_fetch_add_64((p), (u64)(value), (order))))
+
+#define atomic_fetch_sub(p, value, order)   atomic_fetch_add((p), -(__typeof__(*(p)))(value), (order))
+
+/*
+    Store 'desired' if the value is 'expected', returns 1 if it was. Does
+    not fail spuriously. The order applies to the store and to the load of
+    a successful exchange; a failed one is relaxed.
+*/
+#define atomic_cas(p, expected, desired, order) \
+    (ATOMIC_CHECK_SIZE(p), sizeof(*(p)) == 4 ? \
+        atomic_cas_32((p), (u64)(expected), (u64)(desired), (order)) : \
+        atomic_cas_64((p), (u64)(expected), (u64)(desired), (order)))
+
+/*
+    The sized forms behind the macros. The order is a constant where they
+    are used, so that only one of the forms is left once inlined.
+*/
+
+#ifdef __aarch64__
+
+/*
+    One LSE instruction for the order, 'w' or 'x' registers for the size.
+    The assembler is told about LSE whatever the -march of the compiler.
+*/
+#define ATOMIC_LSE(order, asm_relaxed, asm_acquire, asm_release, asm_acq_rel, ...)   \
+    switch (order)                                                                  \
+    {                                                                               \
+    case ATOMIC_RELAXED:                                                            \
+        asm volatile (".arch_extension lse\n\t" asm_relaxed __VA_ARGS__); break;    \
+    case ATOMIC_ACQUIRE:                                                            \
+    case __ATOMIC_CONSUME:                                                          \
+        asm volatile (".arch_extension lse\n\t" asm_acquire __VA_ARGS__); break;    \
+    case ATOMIC_RELEASE:                                                            \
+        asm volatile (".arch_extension lse\n\t" asm_release __VA_ARGS__); break;    \
+    default:                                                                        \
+        asm volatile (".arch_extension lse\n\t" asm_acq_rel __VA_ARGS__); break;    \
+    }
+
+#define ATOMIC_LSE_SWP(order, r, type)                                              \
+    ATOMIC_LSE(order,                                                               \
+        "swp   %" r "[value], %" r "[old], %[mem]",                                 \
+        "swpa  %" r "[value], %" r "[old], %[mem]",                                 \
+        "swpl  %" r "[value], %" r "[old], %[mem]",                                 \
+        "swpal %" r "[value], %" r "[old], %[mem]",                                 \
+        : [old] "=&r" (old), [mem] "+Q" (*(volatile type*)p)                        \
+        : [value] "r" ((type)value)                                                 \
+        : "memory")
+
+#define ATOMIC_LSE_LDADD(order, r, type)                                            \
+    ATOMIC_LSE(order,                                                               \
+        "ldadd   %" r "[value], %" r "[old], %[mem]",                               \
+        "ldadda  %" r "[value], %" r "[old], %[mem]",                               \
+        "ldaddl  %" r "[value], %" r "[old], %[mem]",                               \
+        "ldaddal %" r "[value], %" r "[old], %[mem]",                               \
+        : [old] "=&r" (old), [mem] "+Q" (*(volatile type*)p)                        \
+        : [value] "r" ((type)value)                                                 \
+        : "memory")
+
+/* cas leaves the value it found in the register of the expected one */
+#define ATOMIC_LSE_CAS(order, r, type)                                              \
+    ATOMIC_LSE(order,                                                               \
+        "cas   %" r "[old], %" r "[desired], %[mem]",                               \
+        "casa  %" r "[old], %" r "[desired], %[mem]",                               \
+        "casl  %" r "[old], %" r "[desired], %[mem]",                               \
+        "casal %" r "[old], %" r "[desired], %[mem]",                               \
+        : [old] "+r" (old), [mem] "+Q" (*(volatile type*)p)                         \
+        : [desired] "r" ((type)desired)                                             \
+        : "memory")
+
+#endif
+
+static inline __attribute__((always_inline)) u32 atomic_exchange_32(volatile void* p, u64 value, i32 order)
+{
+#ifdef __aarch64__
+    if (arm64_lse)
+    {
+        u32 old;
+
+        ATOMIC_LSE_SWP(order, "w", u32);
+
+        return old;
+    }
+#endif
+
+    return __atomic_exchange_n((volatile u32*)p, (u32)value, order);
+}
+
+static inline __attribute__((always_inline)) u64 atomic_exchange_64(volatile void* p, u64 value, i32 order)
+{
+#ifdef __aarch64__
+    if (arm64_lse)
+    {
+        u64 old;
+
+        ATOMIC_LSE_SWP(order, "x", u64);
+
+        return old;
+    }
+#endif
+
+    return __atomic_exchange_n((volatile u64*)p, value, order);
+}
+
+static inline __attribute__((always_inline)) u32 atomic_fetch_add_32(volatile void* p, u64 value, i32 order)
+{
+#ifdef __aarch64__
+    if (arm64_lse)
+    {
+        u32 old;
+
+        ATOMIC_LSE_LDADD(order, "w", u32);
+
+        return old;
+    }
+#endif
+
+    return __atomic_fetch_add((volatile u32*)p, (u32)value, order);
+}
+
+static inline __attribute__((always_inline)) u64 atomic_fetch_add_64(volatile void* p, u64 value, i32 order)
+{
+#ifdef __aarch64__
+    if (arm64_lse)
+    {
+        u64 old;
+
+        ATOMIC_LSE_LDADD(order, "x", u64);
+
+        return old;
+    }
+#endif
+
+    return __atomic_fetch_add((volatile u64*)p, value, order);
+}
+
+static inline __attribute__((always_inline)) u32 atomic_cas_32(volatile void* p, u64 expected, u64 desired, i32 order)
+{
+#ifdef __aarch64__
+    if (arm64_lse)
+    {
+        u32 old = (u32)expected;
+
+        ATOMIC_LSE_CAS(order, "w", u32);
+
+        return old == (u32)expected;
+    }
+#endif
+
+    u32 old = (u32)expected;
+
+    return __atomic_compare_exchange_n((volatile u32*)p, &old, (u32)desired, 0, order, ATOMIC_RELAXED);
+}
+
+static inline __attribute__((always_inline)) u32 atomic_cas_64(volatile void* p, u64 expected, u64 desired, i32 order)
+{
+#ifdef __aarch64__
+    if (arm64_lse)
+    {
+        u64 old = expected;
+
+        ATOMIC_LSE_CAS(order, "x", u64);
+
+        return old == expected;
+    }
+#endif
+
+    u64 old = expected;
+
+    return __atomic_compare_exchange_n((volatile u64*)p, &old, desired, 0, order, ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,630 @@
+#include "libfiber.h"
+
+#define FIBER_REQUEUE       1
+#define FIBER_RELEASE       2
+
+static struct
+{
+    fiber_carrier_t     carriers[FIBER_CARRIERS_MAX];
+    u64                 num_carriers;
+    volatile u64        next_carrier;   /* Round robin for the spawns from plain threads */
+    volatile u64        live;           /* Fibers spawned and not finished */
+    volatile u32        stopping;
+    volatile u32        sleepers;       /* Carriers parked or about to */
+    volatile i32        wake_seq __attribute__((aligned(4)));
+
+    volatile u32        free_lock;
+    fiber_t*            free_list;
+
+    u64                 slot_size;      /* Layout of the fiber memory */
+    u64                 tls_offset;
+    u64                 fiber_offset;
+    u64                 slot_align;
+} fiber_sched;
+
+/*
+    Save the callee-saved registers on the current stack and its stack pointer
+    to *save_sp, then continue on the stack at load_sp.
+*/
+void fiber_context_switch(u64* save_sp, u64 load_sp);
+
+/*
+    Where a new fiber starts: its fiber_t is in the register
+    the switch restores first.
+*/
+void fiber_trampoline(void);
+
+#ifdef __amd64
+
+asm(
+    ".text\n"
+    ".globl fiber_context_switch\n"
+    ".type  fiber_context_switch, @function\n"
+"fiber_context_switch:\n"
+    "   pushq   %rbp\n"
+    "   pushq   %rbx\n"
+    "   pushq   %r12\n"
+    "   pushq   %r13\n"
+    "   pushq   %r14\n"
+    "   pushq   %r15\n"
+    "   movq    %rsp, (%rdi)\n"
+    "   movq    %rsi, %rsp\n"
+    "   popq    %r15\n"
+    "   popq    %r14\n"
+    "   popq    %r13\n"
+    "   popq    %r12\n"
+    "   popq    %rbx\n"
+    "   popq    %rbp\n"
+    "   ret\n"
+    ".size  fiber_context_switch, .-fiber_context_switch\n"
+
+    ".globl fiber_trampoline\n"
+    ".type  fiber_trampoline, @function\n"
+"fiber_trampoline:\n"
+    "   movq    %r12, %rdi\n"
+    "   andq    $-16, %rsp\n"
+    "   callq   fiber_main\n"
+    "   ud2\n"
+    ".size  fiber_trampoline, .-fiber_trampoline\n"
+);
+
+#define FIBER_FRAME_SIZE        (8*sizeof(u64))
+#define FIBER_FRAME_FIBER       3   /* r12 */
+#define FIBER_FRAME_RETURN      6
+
+#elif defined(__aarch64__)
+
+asm(
+    ".text\n"
+    ".globl fiber_context_switch\n"
+    ".type  fiber_context_switch, %function\n"
+"fiber_context_switch:\n"
+    "   sub     sp, sp, #160\n"
+    "   stp     x19, x20, [sp, #0]\n"
+    "   stp     x21, x22, [sp, #16]\n"
+    "   stp     x23, x24, [sp, #32]\n"
+    "   stp     x25, x26, [sp, #48]\n"
+    "   stp     x27, x28, [sp, #64]\n"
+    "   stp     x29, x30, [sp, #80]\n"
+    "   stp     d8, d9, [sp, #96]\n"
+    "   stp     d10, d11, [sp, #112]\n"
+    "   stp     d12, d13, [sp, #128]\n"
+    "   stp     d14, d15, [sp, #144]\n"
+    "   mov     x2, sp\n"
+    "   str     x2, [x0]\n"
+    "   mov     sp, x1\n"
+    "   ldp     x19, x20, [sp, #0]\n"
+    "   ldp     x21, x22, [sp, #16]\n"
+    "   ldp     x23, x24, [sp, #32]\n"
+    "   ldp     x25, x26, [sp, #48]\n"
+    "   ldp     x27, x28, [sp, #64]\n"
+    "   ldp     x29, x30, [sp, #80]\n"
+    "   ldp     d8, d9, [sp, #96]\n"
+    "   ldp     d10, d11, [sp, #112]\n"
+    "   ldp     d12, d13, [sp, #128]\n"
+    "   ldp     d14, d15, [sp, #144]\n"
+    "   add     sp, sp, #160\n"
+    "   ret\n"
+    ".size  fiber_context_switch, .-fiber_context_switch\n"
+
+    ".globl fiber_trampoline\n"
+    ".type  fiber_trampoline, %function\n"
+"fiber_trampoline:\n"
+    "   mov     x0, x19\n"
+    "   bl      fiber_main\n"
+    "   brk     #0\n"
+    ".size  fiber_trampoline, .-fiber_trampoline\n"
+);
+
+#define FIBER_FRAME_SIZE        160
+#define FIBER_FRAME_FIBER       0   /* x19 */
+#define FIBER_FRAME_RETURN      11  /* x30 */
+
+#else
+#   error "Unsupported architecture"
+#endif
+
+static void fiber_lock(volatile u32* lock)
+{
+    while (atomic_exchange(lock, 1, ATOMIC_ACQUIRE))
+    {
+        while (*lock) {}
+    }
+}
+
+static void fiber_unlock(volatile u32* lock)
+{
+    atomic_store(lock, 0, ATOMIC_RELEASE);
+}
+
+/*
+    Run queues
+*/
+
+static void fiber_push(fiber_carrier_t* carrier, fiber_t* fiber)
+{
+    fiber->next = NULL;
+
+    fiber_lock(&carrier->lock);
+
+    if (carrier->tail != NULL)
+    {
+        carrier->tail->next = fiber;
+    }
+    else
+    {
+        carrier->head = fiber;
+    }
+
+    carrier->tail = fiber;
+
+    fiber_unlock(&carrier->lock);
+}
+
+static fiber_t* fiber_pop(fiber_carrier_t* carrier)
+{
+    if (carrier->head == NULL)
+    {
+        return NULL;
+    }
+
+    fiber_lock(&carrier->lock);
+
+    fiber_t* fiber = carrier->head;
+
+    if (fiber != NULL)
+    {
+        carrier->head = fiber->next;
+
+        if (carrier->head == NULL)
+        {
+            carrier->tail = NULL;
+        }
+    }
+
+    fiber_unlock(&carrier->lock);
+
+    return fiber;
+}
+
+/*
+    Next fiber to run: from the own run queue, or stolen from another carrier.
+*/
+static fiber_t* fiber_pick(fiber_carrier_t* carrier)
+{
+    fiber_t* fiber = fiber_pop(carrier);
+
+    for (u64 i = 1; fiber == NULL && i < fiber_sched.num_carriers; ++i)
+    {
+        fiber = fiber_pop(&fiber_sched.carriers[(carrier->index + i) % fiber_sched.num_carriers]);
+    }
+
+    return fiber;
+}
+
+static u64 fiber_has_work(void)
+{
+    for (u64 i = 0; i < fiber_sched.num_carriers; ++i)
+    {
+        if (fiber_sched.carriers[i].head != NULL)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Parking and waking the carriers.
+
+    A carrier announces itself in 'sleepers', then checks the run queues once
+    more before waiting for 'wake_seq' to change. Whoever makes work available
+    publishes it first, then bumps 'wake_seq' if it sees a sleeper.
+*/
+
+static void fiber_wake(i32 count)
+{
+    /* The work is published before the sleepers are read, as they do the opposite */
+    atomic_fence(ATOMIC_SEQ_CST);
+
+    if (fiber_sched.sleepers != 0)
+    {
+        atomic_fetch_add(&fiber_sched.wake_seq, 1, ATOMIC_RELAXED);
+        sys_futex(&fiber_sched.wake_seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, count, NULL, NULL, 0);
+    }
+}
+
+static void fiber_park(void)
+{
+    atomic_fetch_add(&fiber_sched.sleepers, 1, ATOMIC_RELAXED);
+    atomic_fence(ATOMIC_SEQ_CST);
+
+    i32 seq = fiber_sched.wake_seq;
+
+    if (!fiber_has_work() && !(fiber_sched.stopping && fiber_sched.live == 0))
+    {
+        i64 s = sys_futex(&fiber_sched.wake_seq, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, seq, NULL, NULL, 0);
+
+        if (s != 0 && s != -EAGAIN && s != -EINTR)
+        {
+            fatal("fiber_park", s);
+        }
+    }
+
+    atomic_fetch_sub(&fiber_sched.sleepers, 1, ATOMIC_RELAXED);
+}
+
+/*
+    Fiber memory
+*/
+
+static void fiber_layout_init(void)
+{
+    const u64 block_align = tls_layout.align > CACHE_LINE_SIZE ? tls_layout.align : CACHE_LINE_SIZE;
+    const u64 fiber_size = align_up(sizeof(fiber_t), CACHE_LINE_SIZE);
+
+    fiber_sched.slot_align   = block_align > 4096 ? block_align : 4096;
+    fiber_sched.slot_size    = align_up(FIBER_GUARD_SIZE + FIBER_STACK_SIZE + tls_layout.block_size + fiber_size + block_align,
+                                        fiber_sched.slot_align);
+    fiber_sched.fiber_offset = fiber_sched.slot_size - fiber_size;
+    fiber_sched.tls_offset   = (fiber_sched.fiber_offset - tls_layout.block_size) & ~(block_align - 1);
+}
+
+static fiber_t* fiber_alloc(void)
+{
+    fiber_lock(&fiber_sched.free_lock);
+
+    fiber_t* fiber = fiber_sched.free_list;
+
+    if (fiber != NULL)
+    {
+        fiber_sched.free_list = fiber->next;
+    }
+
+    fiber_unlock(&fiber_sched.free_lock);
+
+    if (fiber != NULL)
+    {
+        return fiber;
+    }
+
+    const u64 chunk_size = FIBER_CHUNK*fiber_sched.slot_size + fiber_sched.slot_align - 4096;
+    u64 chunk = sys_mmap(0, chunk_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+
+    if ((i64)chunk < 0 && (i64)chunk >= -4095)
+    {
+        return NULL;
+    }
+
+    u8* slots = (u8*)align_up(chunk, fiber_sched.slot_align);
+
+    /* The guard at the bottom of each slot */
+    for (u64 i = 0; FIBER_GUARD_SIZE != 0 && i < FIBER_CHUNK; ++i)
+    {
+        if (sys_mprotect(slots + i*fiber_sched.slot_size, FIBER_GUARD_SIZE, PROT_NONE) != 0)
+        {
+            sys_munmap((void*)chunk, chunk_size);
+
+            return NULL;
+        }
+    }
+
+    fiber_t* first = NULL;
+    fiber_t* last = NULL;
+
+    /* Keep the first one, the others go to the free list */
+    for (u64 i = 0; i < FIBER_CHUNK; ++i)
+    {
+        u8* memory = slots + i*fiber_sched.slot_size;
+        fiber_t* f = (fiber_t*)(memory + fiber_sched.fiber_offset);
+
+        f->memory = memory;
+        f->next = NULL;
+
+        if (i == 0)
+        {
+            fiber = f;
+        }
+        else if (first == NULL)
+        {
+            first = last = f;
+        }
+        else
+        {
+            last->next = f;
+            last = f;
+        }
+    }
+
+    if (first != NULL)
+    {
+        fiber_lock(&fiber_sched.free_lock);
+
+        last->next = fiber_sched.free_list;
+        fiber_sched.free_list = first;
+
+        fiber_unlock(&fiber_sched.free_lock);
+    }
+
+    return fiber;
+}
+
+static void fiber_free(fiber_t* fiber)
+{
+    fiber_lock(&fiber_sched.free_lock);
+
+    fiber->next = fiber_sched.free_list;
+    fiber_sched.free_list = fiber;
+
+    fiber_unlock(&fiber_sched.free_lock);
+
+    if (atomic_fetch_sub(&fiber_sched.live, 1, ATOMIC_ACQ_REL) == 1 && fiber_sched.stopping)
+    {
+        fiber_wake(FIBER_CARRIERS_MAX);
+    }
+}
+
+/*
+    Switching
+*/
+
+/*
+    Runs first thing after every switch, in whatever context was switched to:
+    the fiber switched away from has its registers saved by now, and can be
+    put back to a run queue or released.
+*/
+static void fiber_after_switch(void)
+{
+    fiber_carrier_t* carrier = (fiber_carrier_t*)thread_self()->carrier;
+    fiber_t* prev = carrier->prev;
+
+    if (prev == NULL)
+    {
+        return;
+    }
+
+    carrier->prev = NULL;
+
+    if (carrier->prev_action == FIBER_REQUEUE)
+    {
+        fiber_push(carrier, prev);
+    }
+    else
+    {
+        fiber_free(prev);
+    }
+}
+
+/*
+    Switch from the current context, a fiber or the scheduler loop, to 'next',
+    or to the scheduler loop if 'next' is NULL. Returns when something
+    switches back, possibly on another carrier.
+*/
+static void fiber_switch_to(fiber_carrier_t* carrier, u64* save_sp, fiber_t* next)
+{
+    void* tp;
+    u64 sp;
+
+    if (next != NULL)
+    {
+        thread_tcb_t* tcb = next->tcb;
+
+        tcb->tid     = carrier->tcb->tid;
+        tcb->thread  = carrier->tcb->thread;
+        tcb->index   = carrier->tcb->index;
+        tcb->carrier = carrier;
+
+        tp = next->tp;
+        sp = next->sp;
+    }
+    else
+    {
+        tp = carrier->tp;
+        sp = carrier->sp;
+    }
+
+    /* Nothing may touch the TLS from here on until the switch */
+    tls_set_thread_pointer(tp);
+    fiber_context_switch(save_sp, sp);
+
+    fiber_after_switch();
+}
+
+/*
+    The first C code of a fiber.
+*/
+__attribute__((noreturn, used))
+static void fiber_main(fiber_t* fiber)
+{
+    fiber_after_switch();
+
+    fiber->start(fiber->param);
+
+    /* The fiber may run the destructors of its keys still on its stack */
+    thread_tcb_t* tcb = thread_self();
+
+    tls_key_run_destructors(tcb);
+    tls_arena_release(tcb);
+    print_flush();
+
+    fiber_carrier_t* carrier = (fiber_carrier_t*)tcb->carrier;
+
+    carrier->prev = fiber;
+    carrier->prev_action = FIBER_RELEASE;
+
+    fiber_switch_to(carrier, &fiber->sp, fiber_pick(carrier));
+
+    fatal("Released fiber resumed", (u64)fiber);
+
+    for (;;) {}
+}
+
+fiber_t* fiber_self(void)
+{
+    return (fiber_t*)thread_self()->fiber;
+}
+
+void fiber_yield(void)
+{
+    thread_tcb_t* tcb = thread_self();
+    fiber_t* fiber = (fiber_t*)tcb->fiber;
+
+    if (fiber == NULL)
+    {
+        return;
+    }
+
+    fiber_carrier_t* carrier = (fiber_carrier_t*)tcb->carrier;
+    fiber_t* next = fiber_pick(carrier);
+
+    if (next == NULL)
+    {
+        return;
+    }
+
+    carrier->prev = fiber;
+    carrier->prev_action = FIBER_REQUEUE;
+
+    fiber_switch_to(carrier, &fiber->sp, next);
+}
+
+fiber_t* fiber_spawn(fiber_start_t start, void* param)
+{
+    /* No carrier to run it, and the layout of the fiber memory is not set */
+    if (thread_self()->carrier == NULL && fiber_sched.num_carriers == 0)
+    {
+        return NULL;
+    }
+
+    fiber_t* fiber = fiber_alloc();
+
+    if (fiber == NULL)
+    {
+        return NULL;
+    }
+
+    u8* memory = fiber->memory;
+
+    fiber->start = start;
+    fiber->param = param;
+    fiber->tp    = tls_block_build(memory + fiber_sched.tls_offset, 0);
+    fiber->tcb   = thread_tcb(fiber->tp);
+
+    fiber->tcb->fiber       = fiber;
+    fiber->tcb->stack_base  = memory + fiber_sched.tls_offset;
+    fiber->tcb->stack_limit = memory + FIBER_GUARD_SIZE;
+
+    /* The frame fiber_context_switch pops on the first switch to the fiber */
+    u64* frame = (u64*)(memory + fiber_sched.tls_offset - FIBER_FRAME_SIZE);
+
+    memset(frame, 0, FIBER_FRAME_SIZE);
+    frame[FIBER_FRAME_FIBER]  = (u64)fiber;
+    frame[FIBER_FRAME_RETURN] = (u64)fiber_trampoline;
+
+    fiber->sp = (u64)frame;
+
+    atomic_fetch_add(&fiber_sched.live, 1, ATOMIC_RELAXED);
+
+    fiber_carrier_t* carrier = (fiber_carrier_t*)thread_self()->carrier;
+
+    if (carrier == NULL)
+    {
+        carrier = &fiber_sched.carriers[atomic_fetch_add(&fiber_sched.next_carrier, 1, ATOMIC_RELAXED) % fiber_sched.num_carriers];
+    }
+
+    fiber_push(carrier, fiber);
+    fiber_wake(1);
+
+    return fiber;
+}
+
+/*
+    Carriers
+*/
+
+static u64 fiber_carrier_main(void* param)
+{
+    fiber_carrier_t* carrier = (fiber_carrier_t*)param;
+    thread_tcb_t* tcb = thread_self();
+
+    carrier->tcb = tcb;
+    carrier->tp  = tls_get_thread_pointer();
+    tcb->carrier = carrier;
+
+    for (;;)
+    {
+        fiber_t* next = fiber_pick(carrier);
+
+        if (next != NULL)
+        {
+            fiber_switch_to(carrier, &carrier->sp, next);
+
+            continue;
+        }
+
+        if (fiber_sched.stopping && fiber_sched.live == 0)
+        {
+            break;
+        }
+
+        fiber_park();
+    }
+
+    return 0;
+}
+
+i64 fiber_scheduler_start(u64 num_carriers)
+{
+    if (num_carriers == 0 || num_carriers > FIBER_CARRIERS_MAX)
+    {
+        return -EINVAL;
+    }
+
+    fiber_layout_init();
+
+    fiber_sched.num_carriers = num_carriers;
+    fiber_sched.stopping = 0;
+
+    /* The carriers may steal from each other as soon as they start */
+    for (u64 i = 0; i < num_carriers; ++i)
+    {
+        fiber_carrier_t* carrier = &fiber_sched.carriers[i];
+
+        carrier->index = i;
+        carrier->head = carrier->tail = NULL;
+        carrier->prev = NULL;
+    }
+
+    for (u64 i = 0; i < num_carriers; ++i)
+    {
+        fiber_carrier_t* carrier = &fiber_sched.carriers[i];
+
+        carrier->thread = create_thread(fiber_carrier_main, carrier, NULL);
+
+        if (carrier->thread == NULL)
+        {
+            /* Stop the carriers that did start, they only steal among themselves */
+            fiber_sched.num_carriers = i;
+            fiber_scheduler_stop();
+
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+void fiber_scheduler_stop(void)
+{
+    fiber_sched.stopping = 1;
+
+    fiber_wake(FIBER_CARRIERS_MAX);
+
+    for (u64 i = 0; i < fiber_sched.num_carriers; ++i)
+    {
+        thread_join(fiber_sched.carriers[i].thread);
+    }
+
+    fiber_sched.num_carriers = 0;
+}
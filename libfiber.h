@@ -0,0 +1,102 @@
+#ifndef __LIBFIBER_H__
+#define __LIBFIBER_H__
+
+#include "lib.h"
+
+/*
+    Fibers.
+
+    A fiber is a task with its own small stack and its own TLS block, run by
+    one of a fixed set of kernel threads, the carriers. Switching fibers saves
+    the callee-saved registers on the stack of the current fiber, points
+    FS.base or tpidr_el0 to the TLS block of the next one, and loads its stack
+    pointer, no kernel entry when the FSGSBASE instructions are available on x64.
+
+    Each carrier has a run queue, and steals from the others when its own is
+    empty. Carriers with nothing to run park on a futex.
+
+    A fiber's TCB is its own: TLS keys and dynamic TLS are per fiber. The tid,
+    the thread slot and the index are those of the carrier currently running it.
+
+    Fiber memory, from the lowest address:
+
+        | guard | stack | TLS block | fiber_t |
+                        ^ top of the stack
+
+    The top of the stack, the TLS block and the fiber_t usually share a page,
+    so a fiber that uses little stack costs a single page of memory.
+    The guard is mapped PROT_NONE, so a stack overflow faults instead of
+    running into the fiber below. It splits the mapping: each fiber takes
+    two of the vm.max_map_count mappings (65530 by default), about 32000
+    fibers at most. A program that needs more defines FIBER_GUARD_SIZE 0
+    before including lib.c, and goes without the guards.
+*/
+
+#ifndef FIBER_STACK_SIZE
+#define FIBER_STACK_SIZE    (16*1024)
+#endif
+
+#ifndef FIBER_GUARD_SIZE
+#define FIBER_GUARD_SIZE    4096    /* A multiple of the page size */
+#endif
+
+#define FIBER_CHUNK         64      /* Fibers mapped at once */
+#define FIBER_CARRIERS_MAX  64
+
+typedef void (*fiber_start_t)(void*);
+
+typedef struct _fiber_t
+{
+    u64                 sp;         /* Saved stack pointer while not running */
+    void*               tp;         /* Thread pointer for the TLS block of the fiber */
+    thread_tcb_t*       tcb;
+    fiber_start_t       start;
+    void*               param;
+    struct _fiber_t*    next;       /* Link in a run queue or in the free list */
+    u8*                 memory;     /* Start of the fiber memory */
+} fiber_t;
+
+typedef struct _fiber_carrier_t
+{
+    u64                 sp;         /* Saved stack pointer of the scheduler loop */
+    void*               tp;         /* Thread pointer of the carrier thread */
+    thread_tcb_t*       tcb;
+    fiber_t*            prev;       /* The fiber switched away from, to requeue or release */
+    u32                 prev_action;
+    volatile u32        lock;       /* Run queue */
+    fiber_t*            head;
+    fiber_t*            tail;
+    thread_t*           thread;
+    u64                 index;
+} __attribute__((aligned(CACHE_LINE_SIZE))) fiber_carrier_t;
+
+/*
+    Start the carrier threads. Returns 0, -EINVAL or -ENOMEM; on -ENOMEM the
+    carriers that did start are stopped again.
+*/
+i64 fiber_scheduler_start(u64 num_carriers);
+
+/*
+    Wait for all the fibers to finish, then stop and join the carriers.
+*/
+void fiber_scheduler_stop(void);
+
+/*
+    Start a fiber. Called from a fiber, the new fiber goes to the run queue
+    of the same carrier, otherwise the carriers take turns.
+    Returns NULL if the memory for the fiber could not be mapped, or if the
+    scheduler is not started.
+*/
+fiber_t* fiber_spawn(fiber_start_t start, void* param);
+
+/*
+    Let the other fibers of the carrier run. Does nothing on a plain thread.
+*/
+void fiber_yield(void);
+
+/*
+    The running fiber, NULL on a plain thread.
+*/
+fiber_t* fiber_self(void);
+
+#endif
@@ -0,0 +1,621 @@
+#include "libfmt.h"
+
+typedef u8  fmt_u8x16_t  __attribute__((vector_size(16)));
+typedef i8  fmt_i8x16_t  __attribute__((vector_size(16)));
+typedef u64 fmt_u64x2_t  __attribute__((vector_size(16)));
+
+/* Stores to any address */
+typedef fmt_u8x16_t fmt_u8x16_any_t __attribute__((aligned(1), may_alias));
+typedef u16         fmt_u16_any_t   __attribute__((aligned(1), may_alias));
+typedef u32         fmt_u32_any_t   __attribute__((aligned(1), may_alias));
+
+static const char fmt_pairs[200] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/*
+    Integers
+*/
+
+void fmt_hex64(char* out, u64 value)
+{
+    /* The most significant byte first */
+    const fmt_u8x16_t bytes = (fmt_u8x16_t)(fmt_u64x2_t){ __builtin_bswap64(value), 0 };
+
+    /* The high and the low nibble of each byte next to each other */
+    const fmt_u8x16_t nibbles = __builtin_shuffle(bytes >> 4, bytes & 15,
+        (fmt_u8x16_t){ 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23 });
+
+    /* 'a' for 10 is 39 characters after '0' + 10 */
+    const fmt_u8x16_t letters = (fmt_u8x16_t)((fmt_i8x16_t)nibbles > 9) & ('a' - '0' - 10);
+
+    *(fmt_u8x16_any_t*)out = nibbles + '0' + letters;
+}
+
+static u64 fmt_hex_digits(u64 value)
+{
+    return value != 0 ? 16 - (__builtin_clzll(value) >> 2) : 1;
+}
+
+u64 fmt_hex(char* out, u64 value)
+{
+    char digits[16];
+    const u64 count = fmt_hex_digits(value);
+
+    fmt_hex64(digits, value);
+    memcpy(out, digits + 16 - count, count);
+
+    return count;
+}
+
+void fmt_h64(char* out, u64 value)
+{
+    char digits[16];
+
+    fmt_hex64(digits, value);
+
+    out[0] = '0';
+    out[1] = 'x';
+
+    for (u64 i = 0; i < 4; ++i)
+    {
+        *(fmt_u32_any_t*)(out + 2 + 5*i) = *(const fmt_u32_any_t*)(digits + 4*i);
+
+        if (i != 3)
+        {
+            out[6 + 5*i] = '_';
+        }
+    }
+}
+
+u64 fmt_dec_digits(u64 value)
+{
+    u64 digits = 1;
+
+    for (;;)
+    {
+        if (value < 10)     return digits;
+        if (value < 100)    return digits + 1;
+        if (value < 1000)   return digits + 2;
+        if (value < 10000)  return digits + 3;
+
+        value /= 10000;
+        digits += 4;
+    }
+}
+
+u64 fmt_u64(char* out, u64 value)
+{
+    const u64 count = fmt_dec_digits(value);
+    char* p = out + count;
+
+    /* Two digits per division, from the right */
+    while (value >= 100)
+    {
+        const u64 pair = value % 100;
+
+        value /= 100;
+        p -= 2;
+        *(fmt_u16_any_t*)p = *(const fmt_u16_any_t*)(fmt_pairs + 2*pair);
+    }
+
+    if (value >= 10)
+    {
+        *(fmt_u16_any_t*)(p - 2) = *(const fmt_u16_any_t*)(fmt_pairs + 2*value);
+    }
+    else
+    {
+        p[-1] = '0' + value;
+    }
+
+    return count;
+}
+
+u64 fmt_i64(char* out, i64 value)
+{
+    if (value < 0)
+    {
+        out[0] = '-';
+
+        return 1 + fmt_u64(out + 1, 0 - (u64)value);
+    }
+
+    return fmt_u64(out, value);
+}
+
+/*
+    Where the formatted output goes: a buffer of the caller, cut short when
+    it is full, or the output buffer of a thread, written out when it is full.
+*/
+
+typedef struct _fmt_sink_t
+{
+    char*   buf;
+    u64     size;
+    u64     used;
+    u64     total;      /* Length of the whole output */
+    u32     flush;      /* Write the buffer out when full instead of cutting short */
+} fmt_sink_t;
+
+static void fmt_sink_flush(fmt_sink_t* sink)
+{
+    if (sink->used != 0)
+    {
+        sys_write(STDOUT_FD, sink->buf, sink->used);
+        sink->used = 0;
+    }
+}
+
+/*
+    Room for 'len' characters in the buffer, NULL if there is none
+*/
+static char* fmt_reserve(fmt_sink_t* sink, u64 len)
+{
+    if (sink->used + len > sink->size)
+    {
+        if (!sink->flush || len > sink->size)
+        {
+            return NULL;
+        }
+
+        fmt_sink_flush(sink);
+    }
+
+    char* p = sink->buf + sink->used;
+
+    sink->used += len;
+    sink->total += len;
+
+    return p;
+}
+
+static void fmt_put(fmt_sink_t* sink, const char* data, u64 len)
+{
+    char* p = fmt_reserve(sink, len);
+
+    if (p != NULL)
+    {
+        memcpy(p, data, len);
+
+        return;
+    }
+
+    sink->total += len;
+
+    if (sink->flush)
+    {
+        const struct iovec iov[2] = {
+            { .iov_base = sink->buf, .iov_len = sink->used },
+            { .iov_base = data,      .iov_len = len },
+        };
+
+        sys_writev(STDOUT_FD, iov, 2);
+        sink->used = 0;
+    }
+    else
+    {
+        memcpy(sink->buf + sink->used, data, sink->size - sink->used);
+        sink->used = sink->size;
+    }
+}
+
+static void fmt_pad(fmt_sink_t* sink, char c, u64 count)
+{
+    static const char spaces[16] = "                ";
+    static const char zeros[16]  = "0000000000000000";
+
+    while (count != 0)
+    {
+        const u64 chunk = count < 16 ? count : 16;
+
+        fmt_put(sink, c == '0' ? zeros : spaces, chunk);
+        count -= chunk;
+    }
+}
+
+/*
+    Conversions
+*/
+
+typedef struct _fmt_spec_t
+{
+    u32     left;       /* '-' */
+    u32     zero;       /* '0' */
+    u64     width;
+    i64     precision;  /* -1 if not given */
+} fmt_spec_t;
+
+/*
+    Pads 'prefix' and 'body' to the width: the zeros go between the two
+*/
+static void fmt_put_padded(fmt_sink_t* sink, const fmt_spec_t* spec, const char* prefix, u64 prefix_len, const char* body, u64 body_len)
+{
+    const u64 len = prefix_len + body_len;
+    const u64 pad = spec->width > len ? spec->width - len : 0;
+
+    if (!spec->left && !spec->zero)
+    {
+        fmt_pad(sink, ' ', pad);
+    }
+
+    fmt_put(sink, prefix, prefix_len);
+
+    if (!spec->left && spec->zero)
+    {
+        fmt_pad(sink, '0', pad);
+    }
+
+    fmt_put(sink, body, body_len);
+
+    if (spec->left)
+    {
+        fmt_pad(sink, ' ', pad);
+    }
+}
+
+static void fmt_to_upper(char* p, u64 len)
+{
+    for (u64 i = 0; i < len; ++i)
+    {
+        if (p[i] >= 'a')
+        {
+            p[i] -= 'a' - 'A';
+        }
+    }
+}
+
+static void fmt_put_integer(fmt_sink_t* sink, const fmt_spec_t* spec, const char* prefix, u64 prefix_len, u64 value, char conversion)
+{
+    const u32 hex = conversion == 'x' || conversion == 'X' || conversion == 'p';
+    const u64 count = hex ? fmt_hex_digits(value) : fmt_dec_digits(value);
+
+    /* Without a width, the digits go straight into the buffer */
+    if (spec->width <= prefix_len + count)
+    {
+        fmt_put(sink, prefix, prefix_len);
+
+        char* p = fmt_reserve(sink, count);
+
+        if (p != NULL)
+        {
+            hex ? fmt_hex(p, value) : fmt_u64(p, value);
+
+            if (conversion == 'X')
+            {
+                fmt_to_upper(p, count);
+            }
+
+            return;
+        }
+
+        prefix_len = 0;
+    }
+
+    char digits[FMT_U64_MAX_CHARS];
+
+    hex ? fmt_hex(digits, value) : fmt_u64(digits, value);
+
+    if (conversion == 'X')
+    {
+        fmt_to_upper(digits, count);
+    }
+
+    fmt_put_padded(sink, spec, prefix, prefix_len, digits, count);
+}
+
+static const u64 fmt_pow10[10] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+/* 10^(2^i), to make any power of 10 a double holds in a few products */
+static const double fmt_pow10_binary[9] = {
+    1e1, 1e2, 1e4, 1e8, 1e16, 1e32, 1e64, 1e128, 1e256
+};
+
+static void fmt_put_double(fmt_sink_t* sink, const fmt_spec_t* spec, double x)
+{
+    const u64 precision = spec->precision < 0 ? 6 : spec->precision > 9 ? 9 : spec->precision;
+    const char* sign = "";
+    char body[64];
+    u64 len = 0;
+
+    if (x != x)
+    {
+        fmt_put_padded(sink, spec, "", 0, "nan", 3);
+
+        return;
+    }
+
+    if (x < 0)
+    {
+        sign = "-";
+        x = -x;
+    }
+
+    if (x > 1.7976931348623157e308)
+    {
+        fmt_put_padded(sink, spec, sign, *sign != 0, "inf", 3);
+
+        return;
+    }
+
+    /* Too large for the integer part in a u64 after scaling: d.ddde+NN */
+    const u64 scale = fmt_pow10[precision];
+    u64 exponent = 0;
+    u32 scientific = 0;
+
+    if (x >= 1.8e19 / scale)
+    {
+        double power = 1.0;
+
+        scientific = 1;
+
+        /* The largest power of 10 not above x, then one division by it */
+        for (i64 i = 8; i >= 0; --i)
+        {
+            if (x >= power * fmt_pow10_binary[i])
+            {
+                power *= fmt_pow10_binary[i];
+                exponent += 1ULL << i;
+            }
+        }
+
+        x /= power;
+
+        /* The power may have been rounded above x */
+        if (x < 1.0)
+        {
+            x *= 10.0;
+            --exponent;
+        }
+    }
+
+    u64 scaled = (u64)(x * scale + 0.5);
+
+    if (scientific && scaled >= 10*scale)
+    {
+        scaled /= 10;
+        ++exponent;
+    }
+
+    len += fmt_u64(body, scaled / scale);
+
+    if (precision != 0)
+    {
+        const u64 fraction = scaled % scale;
+        const u64 digits = fmt_dec_digits(fraction);
+
+        body[len++] = '.';
+        memset(body + len, '0', precision - digits);
+        len += precision - digits;
+        len += fmt_u64(body + len, fraction);
+    }
+
+    if (scientific)
+    {
+        body[len++] = 'e';
+        body[len++] = '+';
+
+        if (exponent < 10)
+        {
+            body[len++] = '0';
+        }
+
+        len += fmt_u64(body + len, exponent);
+    }
+
+    fmt_put_padded(sink, spec, sign, *sign != 0, body, len);
+}
+
+static void fmt_run(fmt_sink_t* sink, const char* format, fmt_args_t args)
+{
+    const char* literal = format;
+
+    while (*format != 0)
+    {
+        if (*format != '%')
+        {
+            ++format;
+
+            continue;
+        }
+
+        fmt_put(sink, literal, format - literal);
+
+        const char* start = format++;
+        fmt_spec_t spec = { .left = 0, .zero = 0, .width = 0, .precision = -1 };
+
+        for (;; ++format)
+        {
+            if (*format == '-')
+            {
+                spec.left = 1;
+            }
+            else if (*format == '0')
+            {
+                spec.zero = 1;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        while (*format >= '0' && *format <= '9')
+        {
+            spec.width = spec.width*10 + (*format++ - '0');
+        }
+
+        if (*format == '.')
+        {
+            spec.precision = 0;
+
+            while (*++format >= '0' && *format <= '9')
+            {
+                spec.precision = spec.precision*10 + (*format - '0');
+            }
+        }
+
+        /* An int without a length, 64 bits with one: va_arg must read what was passed */
+        u32 wide = 0;
+
+        while (*format == 'l' || *format == 'z')
+        {
+            wide = 1;
+            ++format;
+        }
+
+        switch (*format)
+        {
+        case 'u':
+        case 'x':
+        case 'X':
+        {
+            const u64 value = wide ? __builtin_va_arg(args, u64) : __builtin_va_arg(args, u32);
+
+            fmt_put_integer(sink, &spec, "", 0, value, *format);
+            break;
+        }
+
+        case 'p':
+            fmt_put_integer(sink, &spec, "0x", 2, (u64)__builtin_va_arg(args, void*), 'p');
+            break;
+
+        case 'd':
+        {
+            const i64 value = wide ? __builtin_va_arg(args, i64) : __builtin_va_arg(args, i32);
+
+            if (value < 0)
+            {
+                fmt_put_integer(sink, &spec, "-", 1, 0 - (u64)value, 'd');
+            }
+            else
+            {
+                fmt_put_integer(sink, &spec, "", 0, value, 'd');
+            }
+            break;
+        }
+
+        case 'h':
+        {
+            char h64[FMT_H64_CHARS];
+
+            fmt_h64(h64, __builtin_va_arg(args, u64));
+            fmt_put_padded(sink, &spec, "", 0, h64, sizeof(h64));
+            break;
+        }
+
+        case 's':
+        {
+            const char* str = __builtin_va_arg(args, const char*);
+
+            if (str == NULL)
+            {
+                str = "(null)";
+            }
+
+            spec.zero = 0;
+            fmt_put_padded(sink, &spec, "", 0, str, strlen(str));
+            break;
+        }
+
+        case 'c':
+        {
+            const char c = (char)__builtin_va_arg(args, int);
+
+            spec.zero = 0;
+            fmt_put_padded(sink, &spec, "", 0, &c, 1);
+            break;
+        }
+
+        case 'f':
+            fmt_put_double(sink, &spec, __builtin_va_arg(args, double));
+            break;
+
+        case '%':
+            fmt_put(sink, "%", 1);
+            break;
+
+        default:
+            /* Not a conversion, goes out as is */
+            if (*format == 0)
+            {
+                fmt_put(sink, start, format - start);
+                literal = format;
+
+                continue;
+            }
+
+            fmt_put(sink, start, format + 1 - start);
+            break;
+        }
+
+        literal = ++format;
+    }
+
+    fmt_put(sink, literal, format - literal);
+}
+
+u64 fmt_args(char* buf, u64 size, const char* format, fmt_args_t args)
+{
+    /* Room for the terminating zero */
+    fmt_sink_t sink = { .buf = buf, .size = size != 0 ? size - 1 : 0, .used = 0, .total = 0, .flush = 0 };
+
+    fmt_run(&sink, format, args);
+
+    if (size != 0)
+    {
+        buf[sink.used] = 0;
+    }
+
+    return sink.total;
+}
+
+u64 fmt(char* buf, u64 size, const char* format, ...)
+{
+    fmt_args_t args;
+
+    __builtin_va_start(args, format);
+
+    const u64 len = fmt_args(buf, size, format, args);
+
+    __builtin_va_end(args);
+
+    return len;
+}
+
+void print_fmt(const char* format, ...)
+{
+    thread_tcb_t* tcb = runtime_tcb();
+    char local[THREAD_OUT_SIZE];
+    fmt_sink_t sink = { .buf = local, .size = sizeof(local), .used = 0, .total = 0, .flush = 1 };
+    fmt_args_t args;
+
+    if (tcb != NULL)
+    {
+        sink.buf  = tcb->out;
+        sink.size = tcb->out_capacity;
+        sink.used = tcb->out_used;
+    }
+
+    __builtin_va_start(args, format);
+    fmt_run(&sink, format, args);
+    __builtin_va_end(args);
+
+    if (tcb == NULL)
+    {
+        fmt_sink_flush(&sink);
+
+        return;
+    }
+
+    tcb->out_used = sink.used;
+
+    if (sink.used != 0 && sink.buf[sink.used - 1] == '\n')
+    {
+        print_flush();
+    }
+}
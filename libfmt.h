@@ -0,0 +1,75 @@
+#ifndef __LIBFMT_H__
+#define __LIBFMT_H__
+
+#include "lib.h"
+
+/*
+    Formatting numbers and strings.
+
+    Hex digits come from the nibbles spread over a 16-byte vector: one
+    compare and one add per digit, no branches, SSE2 on x64 and NEON on
+    ARM64 through the GCC vector extensions. Decimal digits come two at a
+    time from a table of the pairs "00" to "99".
+
+    The converters write into the caller's memory and return the number of
+    characters, nothing is terminated with a zero.
+*/
+
+#define FMT_U64_MAX_CHARS   20      /* 18446744073709551615 */
+#define FMT_I64_MAX_CHARS   20      /* -9223372036854775808 */
+#define FMT_H64_CHARS       21      /* 0x0000_0000_0000_0000, as print_h64 */
+
+/*
+    16 hex digits, leading zeros kept
+*/
+void fmt_hex64(char* out, u64 value);
+
+/*
+    Hex digits without the leading zeros, at least one
+*/
+u64 fmt_hex(char* out, u64 value);
+
+/*
+    The grouped form print_h64 prints
+*/
+void fmt_h64(char* out, u64 value);
+
+/*
+    Decimal
+*/
+u64 fmt_dec_digits(u64 value);
+u64 fmt_u64(char* out, u64 value);
+u64 fmt_i64(char* out, i64 value);
+
+/*
+    printf-style formatting.
+
+    Conversions: %u %d %x %X %p %h %s %c %f %%, with the flags '-' (left
+    justify) and '0' (pad with zeros), a width, and a precision for %f
+    (6 by default, at most 9). %h is the print_h64 form.
+
+    Unlike printf, %f goes to the d.ddde+NN form when the value scaled by
+    10^precision does not fit in a u64, from about 1.8e19 / 10^precision:
+    1e14 with the default precision. The digits come from a single division
+    by a power of 10, so the last ones may be off by a unit for the largest
+    exponents.
+
+    As with printf, %u %d %x %X take an int, or with the length modifier
+    'l', 'll' or 'z' a 64-bit value: %llu for a u64, %lld for an i64. %h
+    takes a u64.
+
+    fmt writes at most 'size' characters and a terminating zero if there is
+    room for it, and returns the length the whole output would have.
+*/
+typedef __builtin_va_list fmt_args_t;
+
+u64 fmt(char* buf, u64 size, const char* format, ...);
+u64 fmt_args(char* buf, u64 size, const char* format, fmt_args_t args);
+
+/*
+    Format straight into the output buffer of the calling thread,
+    see print(). Output longer than the buffer goes out in pieces.
+*/
+void print_fmt(const char* format, ...);
+
+#endif
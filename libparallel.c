@@ -0,0 +1,211 @@
+#include "libparallel.h"
+
+/* A partial result per thread, on a cache line of its own */
+typedef struct _parallel_slot_t
+{
+    u64 value;
+} __attribute__((aligned(CACHE_LINE_SIZE))) parallel_slot_t;
+
+typedef struct _parallel_job_t parallel_job_t;
+
+typedef struct _parallel_part_t
+{
+    pool_task_t         task;
+    parallel_job_t*     job;
+    u64                 index;
+} parallel_part_t;
+
+struct _parallel_job_t
+{
+    u64                     begin;
+    u64                     end;
+    u64                     grain;
+    u32                     schedule;
+    u64                     parts;
+    parallel_for_fn_t       for_fn;
+    parallel_reduce_fn_t    reduce_fn;
+    void*                   ctx;
+    u64                     identity;
+    barrier_t               done;
+    volatile u64            next __attribute__((aligned(CACHE_LINE_SIZE)));  /* PARALLEL_DYNAMIC: the next chunk */
+    parallel_slot_t         slots[POOL_WORKERS_MAX + 1];
+    parallel_part_t         workers[POOL_WORKERS_MAX];  /* The parts but the caller's */
+};
+
+/*
+    Loops from several threads at once take turns: the workers of one
+    could wait at its barrier while the parts of the other are queued.
+*/
+static mutex_t parallel_lock = MUTEX_INIT;
+
+static u64 parallel_run(parallel_job_t* job, u64 begin, u64 end, u64 partial)
+{
+    if (job->reduce_fn != NULL)
+    {
+        return job->reduce_fn(begin, end, partial, job->ctx);
+    }
+
+    job->for_fn(begin, end, job->ctx);
+
+    return partial;
+}
+
+/* The first of the blocks of the parts, the remainder spread over the first ones */
+static u64 parallel_block_begin(parallel_job_t* job, u64 index)
+{
+    const u64 count = job->end - job->begin;
+    const u64 remainder = count % job->parts;
+
+    return job->begin + count / job->parts * index + (index < remainder ? index : remainder);
+}
+
+/*
+    Take the next chunk, 'next' never goes past the end: adding the grain
+    blindly would wrap around for a range ending close to UINT64_MAX.
+*/
+static u64 parallel_chunk(parallel_job_t* job, u64* begin)
+{
+    for (;;)
+    {
+        const u64 next = atomic_load(&job->next, ATOMIC_RELAXED);
+
+        if (next == job->end)
+        {
+            return 0;
+        }
+
+        const u64 end = job->end - next > job->grain ? next + job->grain : job->end;
+
+        if (atomic_cas(&job->next, next, end, ATOMIC_RELAXED))
+        {
+            *begin = next;
+
+            return end;
+        }
+    }
+}
+
+static void parallel_part(parallel_job_t* job, u64 index)
+{
+    u64 partial = job->identity;
+
+    if (job->schedule == PARALLEL_STATIC)
+    {
+        partial = parallel_run(job,
+                               parallel_block_begin(job, index),
+                               parallel_block_begin(job, index + 1),
+                               partial);
+    }
+    else
+    {
+        u64 begin, end;
+
+        while ((end = parallel_chunk(job, &begin)) != 0)
+        {
+            partial = parallel_run(job, begin, end, partial);
+        }
+    }
+
+    job->slots[index].value = partial;
+
+    barrier_wait(&job->done);
+}
+
+static void parallel_worker_part(void* param)
+{
+    parallel_part_t* part = (parallel_part_t*)param;
+
+    parallel_part(part->job, part->index);
+}
+
+static u64 parallel_job_run(parallel_job_t* job, parallel_combine_fn_t combine)
+{
+    const u64 count = job->end > job->begin ? job->end - job->begin : 0;
+    const u64 chunks = count / job->grain + (count % job->grain != 0);
+    const u64 threads = pool_self() == NULL ? pool_num_workers() + 1 : 1;
+
+    if (count == 0)
+    {
+        return job->identity;
+    }
+
+    if (threads == 1 || chunks == 1)
+    {
+        return parallel_run(job, job->begin, job->end, job->identity);
+    }
+
+    mutex_lock(&parallel_lock);
+
+    job->parts = chunks < threads ? chunks : threads;
+    job->next = job->begin;
+
+    barrier_init(&job->done, job->parts);
+
+    for (u64 i = 1; i < job->parts; ++i)
+    {
+        parallel_part_t* part = &job->workers[i - 1];
+
+        part->job = job;
+        part->index = i;
+
+        pool_task_init(&part->task, parallel_worker_part, part);
+        pool_spawn(&part->task);
+    }
+
+    parallel_part(job, 0);
+
+    /*
+        Past the barrier, the workers only mark their tasks done: the job
+        is on this stack, wait for that before returning.
+    */
+    for (u64 i = 1; i < job->parts; ++i)
+    {
+        pool_wait(&job->workers[i - 1].task);
+    }
+
+    mutex_unlock(&parallel_lock);
+
+    u64 result = job->slots[0].value;
+
+    for (u64 i = 1; i < job->parts && combine != NULL; ++i)
+    {
+        result = combine(result, job->slots[i].value, job->ctx);
+    }
+
+    return result;
+}
+
+/* The slots and the parts are set as needed, the job is not zeroed as a whole */
+static void parallel_job_init(parallel_job_t* job, u64 begin, u64 end, u64 grain, u32 schedule, void* ctx)
+{
+    job->begin = begin;
+    job->end = end;
+    job->grain = grain != 0 ? grain : 1;
+    job->schedule = schedule;
+    job->for_fn = NULL;
+    job->reduce_fn = NULL;
+    job->ctx = ctx;
+    job->identity = 0;
+}
+
+void parallel_for(u64 begin, u64 end, u64 grain, u32 schedule, parallel_for_fn_t fn, void* ctx)
+{
+    parallel_job_t job;
+
+    parallel_job_init(&job, begin, end, grain, schedule, ctx);
+    job.for_fn = fn;
+
+    parallel_job_run(&job, NULL);
+}
+
+u64 parallel_reduce(u64 begin, u64 end, u64 grain, u32 schedule, u64 identity,
+                    parallel_reduce_fn_t fn, parallel_combine_fn_t combine, void* ctx)
+{
+    parallel_job_t job;
+
+    parallel_job_init(&job, begin, end, grain, schedule, ctx);
+    job.reduce_fn = fn;
+    job.identity = identity;
+
+    return parallel_job_run(&job, combine);
+}
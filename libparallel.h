@@ -0,0 +1,55 @@
+#ifndef __LIBPARALLEL_H__
+#define __LIBPARALLEL_H__
+
+#include "lib.h"
+#include "libpool.h"
+#include "libsync.h"
+
+/*
+    Parallel loops over the workers of the pool.
+
+    The range [begin, end) is split among the calling thread and the workers
+    of the pool, at most one part per 'grain' iterations:
+        PARALLEL_STATIC  -- each takes one contiguous block of equal size: no
+                            shared state while running, for even work;
+        PARALLEL_DYNAMIC -- each takes chunks of 'grain' iterations off an
+                            atomic counter until none are left, for uneven work.
+
+    The partial results of a reduction are kept in slots a cache line each,
+    one per thread taking part, and combined in the order of the threads
+    once all are done. The threads meet at a barrier at the end: the caller
+    sleeps at most once however many threads took part.
+
+    Called from a worker of the pool, or with the pool not started, the loop
+    runs on the calling thread alone: a worker waiting at a barrier could
+    not run the parts of the others. Loops started by several threads at
+    once run one after another.
+*/
+
+#define PARALLEL_STATIC     0
+#define PARALLEL_DYNAMIC    1
+
+/*
+    Run the iterations [begin, end)
+*/
+typedef void (*parallel_for_fn_t)(u64 begin, u64 end, void* ctx);
+
+/*
+    Fold the iterations [begin, end) into the partial result, and return it
+*/
+typedef u64 (*parallel_reduce_fn_t)(u64 begin, u64 end, u64 partial, void* ctx);
+
+/*
+    Combine two partial results, 'left' from the earlier thread
+*/
+typedef u64 (*parallel_combine_fn_t)(u64 left, u64 right, void* ctx);
+
+void parallel_for(u64 begin, u64 end, u64 grain, u32 schedule, parallel_for_fn_t fn, void* ctx);
+
+/*
+    Each thread starts from 'identity'. Returns the combined result.
+*/
+u64 parallel_reduce(u64 begin, u64 end, u64 grain, u32 schedule, u64 identity,
+                    parallel_reduce_fn_t fn, parallel_combine_fn_t combine, void* ctx);
+
+#endif
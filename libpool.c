@@ -0,0 +1,476 @@
+#include "libpool.h"
+
+#define POOL_TASK_PENDING   0
+#define POOL_TASK_DONE      1
+#define POOL_TASK_WAITED    2   /* Pending, a thread other than a worker sleeps until it is done */
+
+#define POOL_DEQUE_MASK     (POOL_DEQUE_SIZE - 1)
+
+static struct
+{
+    pool_worker_t       workers[POOL_WORKERS_MAX];
+    u64                 num_workers;
+    volatile u32        stopping;
+    volatile u32        sleepers;       /* Workers parked or about to */
+    volatile i32        wake_seq __attribute__((aligned(4)));
+    volatile i32        done_seq __attribute__((aligned(4)));  /* Bumped when a waited task is done */
+
+    mutex_t             shared_lock;    /* Tasks spawned by the other threads */
+    pool_task_t*        shared_head;
+    pool_task_t*        shared_tail;
+    volatile u64        shared_count;
+} pool;
+
+/*
+    The deque of a worker.
+
+    The owner moves 'bottom', the thieves move 'top' with a compare-and-swap.
+    Taking the last task, the owner races the thieves for it the same way.
+*/
+
+static u32 pool_deque_push(pool_worker_t* worker, pool_task_t* task)
+{
+    const i64 bottom = atomic_load(&worker->bottom, ATOMIC_RELAXED);
+    const i64 top = atomic_load(&worker->top, ATOMIC_ACQUIRE);
+
+    if (bottom - top >= POOL_DEQUE_SIZE)
+    {
+        return 0;
+    }
+
+    atomic_store(&worker->tasks[bottom & POOL_DEQUE_MASK], task, ATOMIC_RELAXED);
+
+    /* A thief that sees the new bottom sees the task */
+    atomic_store(&worker->bottom, bottom + 1, ATOMIC_RELEASE);
+
+    return 1;
+}
+
+static pool_task_t* pool_deque_take(pool_worker_t* worker)
+{
+    const i64 bottom = atomic_load(&worker->bottom, ATOMIC_RELAXED) - 1;
+
+    atomic_store(&worker->bottom, bottom, ATOMIC_RELAXED);
+
+    /* The thieves see the bottom moved before the owner reads the top */
+    atomic_fence(ATOMIC_SEQ_CST);
+
+    const i64 top = atomic_load(&worker->top, ATOMIC_RELAXED);
+
+    if (top > bottom)
+    {
+        atomic_store(&worker->bottom, bottom + 1, ATOMIC_RELAXED);
+
+        return NULL;
+    }
+
+    pool_task_t* task = atomic_load(&worker->tasks[bottom & POOL_DEQUE_MASK], ATOMIC_RELAXED);
+
+    if (top == bottom)
+    {
+        if (!atomic_cas(&worker->top, top, top + 1, ATOMIC_SEQ_CST))
+        {
+            task = NULL;
+        }
+
+        atomic_store(&worker->bottom, bottom + 1, ATOMIC_RELAXED);
+    }
+
+    return task;
+}
+
+static pool_task_t* pool_deque_steal(pool_worker_t* worker)
+{
+    const i64 top = atomic_load(&worker->top, ATOMIC_ACQUIRE);
+
+    atomic_fence(ATOMIC_SEQ_CST);
+
+    const i64 bottom = atomic_load(&worker->bottom, ATOMIC_ACQUIRE);
+
+    if (top >= bottom)
+    {
+        return NULL;
+    }
+
+    pool_task_t* task = atomic_load(&worker->tasks[top & POOL_DEQUE_MASK], ATOMIC_RELAXED);
+
+    /* Lost to the owner or another thief */
+    if (!atomic_cas(&worker->top, top, top + 1, ATOMIC_SEQ_CST))
+    {
+        return NULL;
+    }
+
+    return task;
+}
+
+/*
+    The shared queue
+*/
+
+static void pool_shared_push(pool_task_t* task)
+{
+    task->next = NULL;
+
+    mutex_lock(&pool.shared_lock);
+
+    if (pool.shared_tail != NULL)
+    {
+        pool.shared_tail->next = task;
+    }
+    else
+    {
+        pool.shared_head = task;
+    }
+
+    pool.shared_tail = task;
+    pool.shared_count = pool.shared_count + 1;
+
+    mutex_unlock(&pool.shared_lock);
+}
+
+static pool_task_t* pool_shared_pop(void)
+{
+    if (pool.shared_count == 0)
+    {
+        return NULL;
+    }
+
+    mutex_lock(&pool.shared_lock);
+
+    pool_task_t* task = pool.shared_head;
+
+    if (task != NULL)
+    {
+        pool.shared_head = task->next;
+
+        if (pool.shared_head == NULL)
+        {
+            pool.shared_tail = NULL;
+        }
+
+        pool.shared_count = pool.shared_count - 1;
+    }
+
+    mutex_unlock(&pool.shared_lock);
+
+    return task;
+}
+
+/*
+    Finding and running tasks
+*/
+
+static u64 pool_random(pool_worker_t* worker)
+{
+    /* xorshift64 */
+    u64 x = worker->random;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    worker->random = x;
+
+    return x;
+}
+
+static pool_task_t* pool_steal(pool_worker_t* self)
+{
+    pool_task_t* task = pool_shared_pop();
+
+    if (task != NULL)
+    {
+        return task;
+    }
+
+    const u64 num_workers = pool.num_workers;
+    const u64 first = pool_random(self) % num_workers;
+
+    for (u64 i = 0; i < num_workers; ++i)
+    {
+        pool_worker_t* victim = &pool.workers[(first + i) % num_workers];
+
+        if (victim != self && (task = pool_deque_steal(victim)) != NULL)
+        {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+static pool_task_t* pool_find(pool_worker_t* self)
+{
+    pool_task_t* task = pool_deque_take(self);
+
+    return task != NULL ? task : pool_steal(self);
+}
+
+static void pool_run(pool_task_t* task)
+{
+    task->fn(task->param);
+
+    /* The waiter may return as soon as it sees the task done, the task is not touched after */
+    if (atomic_exchange(&task->state, POOL_TASK_DONE, ATOMIC_ACQ_REL) == POOL_TASK_WAITED)
+    {
+        atomic_fetch_add(&pool.done_seq, 1, ATOMIC_SEQ_CST);
+        sys_futex(&pool.done_seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 0x7fffffff, NULL, NULL, 0);
+    }
+}
+
+/*
+    Parking, the same protocol as the fiber carriers: a worker announces
+    itself in 'sleepers', then checks for work once more before waiting
+    for 'wake_seq' to change. A spawn publishes the task first, then bumps
+    'wake_seq' if it sees a sleeper.
+*/
+
+static u64 pool_has_work(void)
+{
+    if (pool.shared_count != 0)
+    {
+        return 1;
+    }
+
+    for (u64 i = 0; i < pool.num_workers; ++i)
+    {
+        pool_worker_t* worker = &pool.workers[i];
+
+        if (atomic_load(&worker->bottom, ATOMIC_ACQUIRE) > atomic_load(&worker->top, ATOMIC_ACQUIRE))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void pool_wake(i32 count)
+{
+    atomic_fence(ATOMIC_SEQ_CST);
+
+    if (pool.sleepers != 0)
+    {
+        atomic_fetch_add(&pool.wake_seq, 1, ATOMIC_RELAXED);
+        sys_futex(&pool.wake_seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, count, NULL, NULL, 0);
+    }
+}
+
+static void pool_park(void)
+{
+    atomic_fetch_add(&pool.sleepers, 1, ATOMIC_RELAXED);
+    atomic_fence(ATOMIC_SEQ_CST);
+
+    const i32 seq = pool.wake_seq;
+
+    if (!pool_has_work() && !pool.stopping)
+    {
+        i64 s = sys_futex(&pool.wake_seq, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, seq, NULL, NULL, 0);
+
+        if (s != 0 && s != -EAGAIN && s != -EINTR)
+        {
+            fatal("pool_park", s);
+        }
+    }
+
+    atomic_fetch_sub(&pool.sleepers, 1, ATOMIC_RELAXED);
+}
+
+static u64 pool_worker_main(void* param)
+{
+    pool_worker_t* self = (pool_worker_t*)param;
+    u64 idle = 0;
+
+    thread_self()->worker = self;
+
+    for (;;)
+    {
+        pool_task_t* task = pool_find(self);
+
+        if (task != NULL)
+        {
+            pool_run(task);
+            idle = 0;
+
+            continue;
+        }
+
+        if (pool.stopping)
+        {
+            break;
+        }
+
+        if (++idle < POOL_SPIN)
+        {
+            cpu_relax();
+
+            continue;
+        }
+
+        pool_park();
+        idle = 0;
+    }
+
+    thread_self()->worker = NULL;
+
+    return 0;
+}
+
+/*
+    The API
+*/
+
+pool_worker_t* pool_self(void)
+{
+    thread_tcb_t* tcb = runtime_tcb();
+
+    return tcb != NULL ? (pool_worker_t*)tcb->worker : NULL;
+}
+
+u64 pool_num_workers(void)
+{
+    return pool.num_workers;
+}
+
+void pool_task_init(pool_task_t* task, pool_task_fn_t fn, void* param)
+{
+    task->fn = fn;
+    task->param = param;
+    task->next = NULL;
+    task->state = POOL_TASK_PENDING;
+}
+
+void pool_spawn(pool_task_t* task)
+{
+    pool_worker_t* self = pool_self();
+
+    task->state = POOL_TASK_PENDING;
+
+    if (self == NULL)
+    {
+        pool_shared_push(task);
+    }
+    else if (!pool_deque_push(self, task))
+    {
+        pool_run(task);
+
+        return;
+    }
+
+    pool_wake(1);
+}
+
+void pool_wait(pool_task_t* task)
+{
+    pool_worker_t* self = pool_self();
+
+    if (self != NULL)
+    {
+        while (atomic_load(&task->state, ATOMIC_ACQUIRE) != POOL_TASK_DONE)
+        {
+            pool_task_t* other = pool_find(self);
+
+            if (other != NULL)
+            {
+                pool_run(other);
+            }
+            else
+            {
+                cpu_relax();
+            }
+        }
+
+        return;
+    }
+
+    for (u64 i = 0; i < POOL_SPIN; ++i)
+    {
+        if (atomic_load(&task->state, ATOMIC_ACQUIRE) == POOL_TASK_DONE)
+        {
+            return;
+        }
+
+        cpu_relax();
+    }
+
+    if (!atomic_cas(&task->state, POOL_TASK_PENDING, POOL_TASK_WAITED, ATOMIC_RELAXED) &&
+        atomic_load(&task->state, ATOMIC_ACQUIRE) == POOL_TASK_DONE)
+    {
+        return;
+    }
+
+    for (;;)
+    {
+        /* Read before the state: the worker sets the state before it bumps the sequence */
+        const i32 seq = atomic_load(&pool.done_seq, ATOMIC_SEQ_CST);
+
+        if (atomic_load(&task->state, ATOMIC_ACQUIRE) == POOL_TASK_DONE)
+        {
+            return;
+        }
+
+        i64 s = sys_futex(&pool.done_seq, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, seq, NULL, NULL, 0);
+
+        if (s != 0 && s != -EAGAIN && s != -EINTR)
+        {
+            fatal("pool_wait", s);
+        }
+    }
+}
+
+i64 pool_start(u64 num_workers)
+{
+    if (num_workers == 0 || num_workers > POOL_WORKERS_MAX)
+    {
+        return -EINVAL;
+    }
+
+    pool.num_workers = num_workers;
+    pool.stopping = 0;
+    pool.shared_head = pool.shared_tail = NULL;
+    pool.shared_count = 0;
+
+    mutex_init(&pool.shared_lock);
+
+    /* The workers may steal from each other as soon as they start */
+    for (u64 i = 0; i < num_workers; ++i)
+    {
+        pool_worker_t* worker = &pool.workers[i];
+
+        worker->top = worker->bottom = 0;
+        worker->index = i;
+        worker->random = 0x9e3779b97f4a7c15ULL * (i + 1);
+    }
+
+    for (u64 i = 0; i < num_workers; ++i)
+    {
+        pool_worker_t* worker = &pool.workers[i];
+
+        worker->thread = create_thread(pool_worker_main, worker, NULL);
+
+        if (worker->thread == NULL)
+        {
+            /* Stop the workers that did start, they only steal among themselves */
+            pool.num_workers = i;
+            pool_stop();
+
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+void pool_stop(void)
+{
+    pool.stopping = 1;
+
+    pool_wake(POOL_WORKERS_MAX);
+
+    for (u64 i = 0; i < pool.num_workers; ++i)
+    {
+        thread_join(pool.workers[i].thread);
+    }
+
+    pool.num_workers = 0;
+}
@@ -0,0 +1,88 @@
+#ifndef __LIBPOOL_H__
+#define __LIBPOOL_H__
+
+#include "lib.h"
+
+/*
+    Work-stealing thread pool.
+
+    A fixed set of worker threads run the tasks, so a unit of work costs a
+    push to a deque instead of a stack mapping and a clone. Each worker has
+    a Chase-Lev deque: the worker pushes and takes tasks at the bottom with
+    no atomic read-modify-write, unless it races for the last task; the
+    others steal from the top with a compare-and-swap. A task spawned on a
+    worker goes to the deque of that worker, so nested tasks run depth first
+    where they were spawned, and spread only as idle workers steal them. A
+    task spawned on any other thread goes to a shared queue.
+
+    An idle worker steals from the workers in an order picked at random,
+    POOL_SPIN rounds, then sleeps on a futex. A spawn wakes one sleeper if
+    there is one.
+
+    Waiting for a task, a worker runs other tasks meanwhile, its own first.
+    Any other thread spins a little, then sleeps on a futex of the pool.
+
+    The deques are rings of POOL_DEQUE_SIZE tasks: a worker that has that
+    many spawned and not taken runs the next one it spawns right away.
+*/
+
+#define POOL_WORKERS_MAX    64
+#define POOL_DEQUE_SIZE     4096    /* A power of 2 */
+#define POOL_SPIN           64
+
+typedef void (*pool_task_fn_t)(void*);
+
+typedef struct _pool_task_t
+{
+    pool_task_fn_t          fn;
+    void*                   param;
+    struct _pool_task_t*    next;       /* In the shared queue */
+    volatile i32            state;
+} pool_task_t;
+
+typedef struct _pool_worker_t
+{
+    volatile i64        top;        /* Where the thieves steal */
+    volatile i64        bottom __attribute__((aligned(CACHE_LINE_SIZE)));  /* Where the worker pushes and takes */
+    u64                 random;     /* State of the generator that picks the victims */
+    thread_t*           thread;
+    u64                 index;
+    pool_task_t*        tasks[POOL_DEQUE_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE))) pool_worker_t;
+
+/*
+    Start the workers. Returns 0, -EINVAL or -ENOMEM; on -ENOMEM the workers
+    that did start have been stopped again.
+*/
+i64 pool_start(u64 num_workers);
+
+/*
+    Stop and join the workers. The tasks must have been waited for.
+*/
+void pool_stop(void);
+
+void pool_task_init(pool_task_t* task, pool_task_fn_t fn, void* param);
+
+/*
+    Queue the task to run fn(param) on a worker. The pool does not touch
+    the task once it is done: it may live on the stack of the thread that
+    waits for it.
+*/
+void pool_spawn(pool_task_t* task);
+
+/*
+    Return once the task is done.
+*/
+void pool_wait(pool_task_t* task);
+
+/*
+    The worker the calling thread is, NULL for the other threads.
+*/
+pool_worker_t* pool_self(void);
+
+/*
+    Workers started, 0 when the pool is stopped.
+*/
+u64 pool_num_workers(void);
+
+#endif
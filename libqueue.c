@@ -0,0 +1,213 @@
+#include "libqueue.h"
+
+i64 mpmc_queue_init(mpmc_queue_t* queue, u64 capacity)
+{
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+    {
+        return -EINVAL;
+    }
+
+    u64 cells = sys_mmap(0, capacity*sizeof(mpmc_cell_t), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+
+    if ((i64)cells < 0 && (i64)cells >= -4095)
+    {
+        return -ENOMEM;
+    }
+
+    queue->cells = (mpmc_cell_t*)cells;
+    queue->mask = capacity - 1;
+
+    /* Each cell waits for the producer of the first lap */
+    for (u64 i = 0; i < capacity; ++i)
+    {
+        queue->cells[i].seq = i;
+    }
+
+    queue->head = 0;
+    queue->tail = 0;
+    queue->push_waiters = 0;
+    queue->push_seq = 0;
+    queue->pop_waiters = 0;
+    queue->pop_seq = 0;
+
+    return 0;
+}
+
+void mpmc_queue_free(mpmc_queue_t* queue)
+{
+    sys_munmap(queue->cells, (queue->mask + 1)*sizeof(mpmc_cell_t));
+    queue->cells = NULL;
+}
+
+u32 mpmc_try_push(mpmc_queue_t* queue, u64 value)
+{
+    u64 pos = atomic_load(&queue->head, ATOMIC_RELAXED);
+    mpmc_cell_t* cell;
+
+    for (;;)
+    {
+        cell = &queue->cells[pos & queue->mask];
+
+        const i64 diff = (i64)(atomic_load(&cell->seq, ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0)
+        {
+            if (atomic_cas(&queue->head, pos, pos + 1, ATOMIC_RELAXED))
+            {
+                break;
+            }
+
+            pos = atomic_load(&queue->head, ATOMIC_RELAXED);
+        }
+        else if (diff < 0)
+        {
+            /* Not emptied since the previous lap */
+            return 0;
+        }
+        else
+        {
+            /* Another producer took it */
+            pos = atomic_load(&queue->head, ATOMIC_RELAXED);
+        }
+    }
+
+    cell->value = value;
+    atomic_store(&cell->seq, pos + 1, ATOMIC_RELEASE);
+
+    return 1;
+}
+
+u32 mpmc_try_pop(mpmc_queue_t* queue, u64* value)
+{
+    u64 pos = atomic_load(&queue->tail, ATOMIC_RELAXED);
+    mpmc_cell_t* cell;
+
+    for (;;)
+    {
+        cell = &queue->cells[pos & queue->mask];
+
+        const i64 diff = (i64)(atomic_load(&cell->seq, ATOMIC_ACQUIRE) - (pos + 1));
+
+        if (diff == 0)
+        {
+            if (atomic_cas(&queue->tail, pos, pos + 1, ATOMIC_RELAXED))
+            {
+                break;
+            }
+
+            pos = atomic_load(&queue->tail, ATOMIC_RELAXED);
+        }
+        else if (diff < 0)
+        {
+            /* Not filled yet */
+            return 0;
+        }
+        else
+        {
+            pos = atomic_load(&queue->tail, ATOMIC_RELAXED);
+        }
+    }
+
+    *value = cell->value;
+    atomic_store(&cell->seq, pos + queue->mask + 1, ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/*
+    Sleeping on a full or an empty queue, the protocol of the fiber carriers:
+    the waiter counts itself, then tries once more before sleeping on the
+    sequence number; the other side makes its change, then bumps the number
+    if it sees a waiter.
+*/
+
+static void mpmc_wake(volatile u32* waiters, volatile i32* seq)
+{
+    atomic_fence(ATOMIC_SEQ_CST);
+
+    if (*waiters != 0)
+    {
+        atomic_fetch_add(seq, 1, ATOMIC_RELAXED);
+        sys_futex(seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
+    }
+}
+
+static void mpmc_sleep(volatile i32* seq, i32 value)
+{
+    i64 s = sys_futex(seq, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, value, NULL, NULL, 0);
+
+    if (s != 0 && s != -EAGAIN && s != -EINTR)
+    {
+        fatal("mpmc_sleep", s);
+    }
+}
+
+void mpmc_push_wait(mpmc_queue_t* queue, u64 value)
+{
+    for (u32 i = 0; !mpmc_try_push(queue, value); ++i)
+    {
+        if (i < QUEUE_SPIN)
+        {
+            cpu_relax();
+
+            continue;
+        }
+
+        atomic_fetch_add(&queue->push_waiters, 1, ATOMIC_RELAXED);
+        atomic_fence(ATOMIC_SEQ_CST);
+
+        const i32 seq = queue->push_seq;
+        const u32 pushed = mpmc_try_push(queue, value);
+
+        if (!pushed)
+        {
+            mpmc_sleep(&queue->push_seq, seq);
+        }
+
+        atomic_fetch_sub(&queue->push_waiters, 1, ATOMIC_RELAXED);
+
+        if (pushed)
+        {
+            break;
+        }
+    }
+
+    mpmc_wake(&queue->pop_waiters, &queue->pop_seq);
+}
+
+u64 mpmc_pop_wait(mpmc_queue_t* queue)
+{
+    u64 value;
+
+    for (u32 i = 0; !mpmc_try_pop(queue, &value); ++i)
+    {
+        if (i < QUEUE_SPIN)
+        {
+            cpu_relax();
+
+            continue;
+        }
+
+        atomic_fetch_add(&queue->pop_waiters, 1, ATOMIC_RELAXED);
+        atomic_fence(ATOMIC_SEQ_CST);
+
+        const i32 seq = queue->pop_seq;
+        const u32 popped = mpmc_try_pop(queue, &value);
+
+        if (!popped)
+        {
+            mpmc_sleep(&queue->pop_seq, seq);
+        }
+
+        atomic_fetch_sub(&queue->pop_waiters, 1, ATOMIC_RELAXED);
+
+        if (popped)
+        {
+            break;
+        }
+    }
+
+    mpmc_wake(&queue->push_waiters, &queue->push_seq);
+
+    return value;
+}
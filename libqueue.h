@@ -0,0 +1,69 @@
+#ifndef __LIBQUEUE_H__
+#define __LIBQUEUE_H__
+
+#include "lib.h"
+
+/*
+    Bounded multi-producer multi-consumer queue of 64-bit values.
+
+    A ring of cells, each with a sequence number that tells whose turn it
+    is (D. Vyukov): a producer claims the cell at 'head' when its number is
+    the position, fills it, and sets the number to the position + 1; a
+    consumer claims the cell at 'tail' when its number is the position + 1,
+    empties it, and sets the number to the position + capacity, the turn
+    of the producer one lap later. Claiming is a compare-and-swap on 'head'
+    or 'tail', which are on cache lines of their own; the producers and
+    the consumers only meet on the cells.
+
+    mpmc_try_push and mpmc_try_pop never wait and never make a system call.
+    mpmc_push_wait and mpmc_pop_wait spin a little while the queue is full
+    or empty, then sleep on a futex; once done, they wake a waiter of the
+    other side if there is one. A queue that is waited on must be pushed to
+    and popped from with the waiting calls only: the try calls wake nobody.
+*/
+
+#define QUEUE_SPIN          100
+
+typedef struct _mpmc_cell_t
+{
+    volatile u64    seq;
+    u64             value;
+} mpmc_cell_t;
+
+typedef struct _mpmc_queue_t
+{
+    mpmc_cell_t*    cells;
+    u64             mask;           /* Capacity - 1 */
+    volatile u64    head __attribute__((aligned(CACHE_LINE_SIZE)));    /* Next position to push to */
+    volatile u64    tail __attribute__((aligned(CACHE_LINE_SIZE)));    /* Next position to pop from */
+    volatile u32    push_waiters __attribute__((aligned(CACHE_LINE_SIZE)));
+    volatile i32    push_seq;       /* Bumped by a pop that sees push waiters */
+    volatile u32    pop_waiters __attribute__((aligned(CACHE_LINE_SIZE)));
+    volatile i32    pop_seq;        /* Bumped by a push that sees pop waiters */
+} __attribute__((aligned(CACHE_LINE_SIZE))) mpmc_queue_t;
+
+/*
+    Map the cells for 'capacity' values, a power of 2.
+    Returns 0, -EINVAL or -ENOMEM.
+*/
+i64 mpmc_queue_init(mpmc_queue_t* queue, u64 capacity);
+
+/*
+    Unmap the cells. Nobody may use the queue any more.
+*/
+void mpmc_queue_free(mpmc_queue_t* queue);
+
+/*
+    Returns 1 if pushed, 0 if the queue is full.
+*/
+u32 mpmc_try_push(mpmc_queue_t* queue, u64 value);
+
+/*
+    Returns 1 and stores the value if popped, 0 if the queue is empty.
+*/
+u32 mpmc_try_pop(mpmc_queue_t* queue, u64* value);
+
+void mpmc_push_wait(mpmc_queue_t* queue, u64 value);
+u64  mpmc_pop_wait(mpmc_queue_t* queue);
+
+#endif
@@ -0,0 +1,540 @@
+#include "libreclaim.h"
+#include "libfiber.h"
+
+#define RECLAIM_SETUP_NONE  0
+#define RECLAIM_SETUP_BUSY  1
+#define RECLAIM_SETUP_DONE  2
+
+/* Holds twice the slots of all the threads */
+#define RECLAIM_HASH_SIZE   16384
+
+typedef struct _reclaim_record_t
+{
+    /* Read by the other threads */
+    void* volatile      hazards[HAZARD_SLOTS];
+    volatile u64        epoch;          /* (epoch << 1) | 1 in a critical section, 0 outside */
+    volatile u32        in_use;
+
+    /* The owner's */
+    u32                 nest __attribute__((aligned(CACHE_LINE_SIZE)));
+    reclaim_node_t*     hazard_retired;
+    u64                 hazard_count;
+    reclaim_node_t*     limbo[3];       /* Retired in limbo_epoch[i], i == limbo_epoch[i] % 3 */
+    u64                 limbo_epoch[3];
+    u64                 epoch_count;    /* Retired since the last attempt to move the epoch on */
+    void**              hash;           /* The slots seen by the last scan, mapped on the first one */
+} __attribute__((aligned(CACHE_LINE_SIZE))) reclaim_record_t;
+
+static struct
+{
+    volatile u32        setup;
+    tls_key_t           key;            /* The record of the thread */
+    volatile u64        records_end;    /* Past the last record ever used */
+    volatile u64        epoch __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    /* Left by the threads that exited */
+    mutex_t             orphans_lock __attribute__((aligned(CACHE_LINE_SIZE)));
+    volatile u32        has_orphans;
+    reclaim_node_t*     hazard_orphans;
+    reclaim_node_t*     epoch_orphans;
+
+    reclaim_record_t    records[RECLAIM_THREADS_MAX];
+} reclaim;
+
+static void reclaim_thread_exit(void* value);
+
+static void reclaim_setup(void)
+{
+    if (atomic_cas(&reclaim.setup, RECLAIM_SETUP_NONE, RECLAIM_SETUP_BUSY, ATOMIC_ACQUIRE))
+    {
+        i64 s = tls_key_create(&reclaim.key, reclaim_thread_exit);
+
+        if (s != 0)
+        {
+            fatal("reclaim_setup", s);
+        }
+
+        mutex_init(&reclaim.orphans_lock);
+
+        atomic_store(&reclaim.setup, RECLAIM_SETUP_DONE, ATOMIC_RELEASE);
+
+        return;
+    }
+
+    while (atomic_load(&reclaim.setup, ATOMIC_ACQUIRE) != RECLAIM_SETUP_DONE)
+    {
+        cpu_relax();
+    }
+}
+
+static reclaim_record_t* reclaim_claim(void** key_slot)
+{
+    for (u64 i = 0; i < RECLAIM_THREADS_MAX; ++i)
+    {
+        reclaim_record_t* record = &reclaim.records[i];
+
+        if (record->in_use || !atomic_cas(&record->in_use, 0, 1, ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+
+        u64 end = reclaim.records_end;
+
+        while (end < i + 1 && !atomic_cas(&reclaim.records_end, end, i + 1, ATOMIC_RELEASE))
+        {
+            end = reclaim.records_end;
+        }
+
+        /* The hash is kept for the next thread */
+        record->nest = 0;
+        record->hazard_retired = NULL;
+        record->hazard_count = 0;
+        record->epoch_count = 0;
+
+        for (u64 b = 0; b < 3; ++b)
+        {
+            record->limbo[b] = NULL;
+            record->limbo_epoch[b] = 0;
+        }
+
+        *key_slot = record;
+
+        return record;
+    }
+
+    fatal("Too many threads for reclaim", RECLAIM_THREADS_MAX);
+
+    return NULL;
+}
+
+static reclaim_record_t* reclaim_self(void)
+{
+    if (atomic_load(&reclaim.setup, ATOMIC_ACQUIRE) != RECLAIM_SETUP_DONE)
+    {
+        reclaim_setup();
+    }
+
+    /* A fiber has a TCB and keys of its own, it takes the record of its carrier */
+    thread_tcb_t* tcb = thread_self();
+
+    if (tcb->carrier != NULL)
+    {
+        tcb = ((fiber_carrier_t*)tcb->carrier)->tcb;
+    }
+
+    void** key_slot = tls_key_slot(tcb, reclaim.key, 1);
+
+    if (key_slot == NULL)
+    {
+        fatal("reclaim_self", -ENOMEM);
+    }
+
+    reclaim_record_t* record = (reclaim_record_t*)*key_slot;
+
+    return record != NULL ? record : reclaim_claim(key_slot);
+}
+
+/*
+    Passing at least this many retired nodes over makes each pass
+    free at least half of them.
+*/
+static u64 reclaim_threshold(void)
+{
+    const u64 slots = 2*HAZARD_SLOTS*atomic_load(&reclaim.records_end, ATOMIC_RELAXED);
+
+    return slots > RECLAIM_BATCH ? slots : RECLAIM_BATCH;
+}
+
+static void reclaim_free_list(reclaim_node_t* node)
+{
+    while (node != NULL)
+    {
+        reclaim_node_t* next = node->next;
+
+        node->free(node);
+        node = next;
+    }
+}
+
+/*
+    Epochs
+*/
+
+static void epoch_push(reclaim_record_t* self, reclaim_node_t* node, u64 epoch)
+{
+    const u64 b = epoch % 3;
+
+    if (self->limbo_epoch[b] != epoch)
+    {
+        /* Retired three epochs ago or more */
+        reclaim_node_t* old = self->limbo[b];
+
+        self->limbo[b] = NULL;
+        self->limbo_epoch[b] = epoch;
+
+        reclaim_free_list(old);
+    }
+
+    node->next = self->limbo[b];
+    self->limbo[b] = node;
+}
+
+/*
+    Move the epoch on if every thread in a critical section has seen it.
+    Returns the epoch.
+*/
+static u64 epoch_try_advance(void)
+{
+    const u64 epoch = atomic_load(&reclaim.epoch, ATOMIC_ACQUIRE);
+    const u64 end = atomic_load(&reclaim.records_end, ATOMIC_ACQUIRE);
+
+    atomic_fence(ATOMIC_SEQ_CST);
+
+    for (u64 i = 0; i < end; ++i)
+    {
+        const u64 announced = atomic_load(&reclaim.records[i].epoch, ATOMIC_ACQUIRE);
+
+        if ((announced & 1) != 0 && (announced >> 1) != epoch)
+        {
+            return epoch;
+        }
+    }
+
+    if (atomic_cas(&reclaim.epoch, epoch, epoch + 1, ATOMIC_ACQ_REL))
+    {
+        return epoch + 1;
+    }
+
+    return atomic_load(&reclaim.epoch, ATOMIC_ACQUIRE);
+}
+
+static void epoch_free_old(reclaim_record_t* self, u64 epoch)
+{
+    for (u64 b = 0; b < 3; ++b)
+    {
+        if (self->limbo[b] != NULL && self->limbo_epoch[b] + 2 <= epoch)
+        {
+            reclaim_node_t* old = self->limbo[b];
+
+            self->limbo[b] = NULL;
+
+            reclaim_free_list(old);
+        }
+    }
+}
+
+/*
+    Hazard pointers
+*/
+
+static u64 hazard_hash(void* ptr, u64 mask)
+{
+    const u64 x = (u64)ptr;
+
+    return ((x ^ (x >> 17)) * 0x9e3779b97f4a7c15ULL >> 32) & mask;
+}
+
+static void hazard_scan(reclaim_record_t* self)
+{
+    const u64 end = atomic_load(&reclaim.records_end, ATOMIC_ACQUIRE);
+    u64 size = 2;
+
+    while (size < 2*HAZARD_SLOTS*end)
+    {
+        size *= 2;
+    }
+
+    if (self->hash == NULL)
+    {
+        u64 hash = sys_mmap(0, RECLAIM_HASH_SIZE*sizeof(void*), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+
+        if ((i64)hash < 0 && (i64)hash >= -4095)
+        {
+            fatal("Cannot map the hazard hash", hash);
+        }
+
+        self->hash = (void**)hash;
+    }
+
+    void** hash = self->hash;
+    const u64 mask = size - 1;
+
+    memset(hash, 0, size*sizeof(void*));
+
+    /* The retired nodes were unlinked before: a slot set after this does not hold them */
+    atomic_fence(ATOMIC_SEQ_CST);
+
+    for (u64 i = 0; i < end; ++i)
+    {
+        for (u64 slot = 0; slot < HAZARD_SLOTS; ++slot)
+        {
+            void* ptr = atomic_load(&reclaim.records[i].hazards[slot], ATOMIC_ACQUIRE);
+
+            if (ptr == NULL)
+            {
+                continue;
+            }
+
+            u64 h = hazard_hash(ptr, mask);
+
+            while (hash[h] != NULL && hash[h] != ptr)
+            {
+                h = (h + 1) & mask;
+            }
+
+            hash[h] = ptr;
+        }
+    }
+
+    reclaim_node_t* node = self->hazard_retired;
+
+    self->hazard_retired = NULL;
+    self->hazard_count = 0;
+
+    while (node != NULL)
+    {
+        reclaim_node_t* next = node->next;
+        u64 h = hazard_hash(node, mask);
+
+        while (hash[h] != NULL && hash[h] != node)
+        {
+            h = (h + 1) & mask;
+        }
+
+        if (hash[h] == node)
+        {
+            node->next = self->hazard_retired;
+            self->hazard_retired = node;
+            ++self->hazard_count;
+        }
+        else
+        {
+            node->free(node);
+        }
+
+        node = next;
+    }
+}
+
+/*
+    Take the nodes the exited threads left
+*/
+static void reclaim_adopt(reclaim_record_t* self)
+{
+    if (!reclaim.has_orphans)
+    {
+        return;
+    }
+
+    mutex_lock(&reclaim.orphans_lock);
+
+    reclaim_node_t* hazard_orphans = reclaim.hazard_orphans;
+    reclaim_node_t* epoch_orphans = reclaim.epoch_orphans;
+
+    reclaim.hazard_orphans = reclaim.epoch_orphans = NULL;
+    reclaim.has_orphans = 0;
+
+    mutex_unlock(&reclaim.orphans_lock);
+
+    while (hazard_orphans != NULL)
+    {
+        reclaim_node_t* next = hazard_orphans->next;
+
+        hazard_orphans->next = self->hazard_retired;
+        self->hazard_retired = hazard_orphans;
+        ++self->hazard_count;
+
+        hazard_orphans = next;
+    }
+
+    /* Retired in an earlier epoch or the current one, freeing later is safe */
+    const u64 epoch = atomic_load(&reclaim.epoch, ATOMIC_ACQUIRE);
+
+    while (epoch_orphans != NULL)
+    {
+        reclaim_node_t* next = epoch_orphans->next;
+
+        epoch_push(self, epoch_orphans, epoch);
+        ++self->epoch_count;
+
+        epoch_orphans = next;
+    }
+}
+
+static reclaim_node_t* reclaim_append(reclaim_node_t* list, reclaim_node_t* other)
+{
+    if (other == NULL)
+    {
+        return list;
+    }
+
+    reclaim_node_t* last = other;
+
+    while (last->next != NULL)
+    {
+        last = last->next;
+    }
+
+    last->next = list;
+
+    return other;
+}
+
+/*
+    The destructor of the key: thread_exit calls it with the record
+*/
+static void reclaim_thread_exit(void* value)
+{
+    reclaim_record_t* self = (reclaim_record_t*)value;
+
+    for (u64 slot = 0; slot < HAZARD_SLOTS; ++slot)
+    {
+        atomic_store(&self->hazards[slot], NULL, ATOMIC_RELEASE);
+    }
+
+    self->nest = 0;
+    atomic_store(&self->epoch, 0, ATOMIC_RELEASE);
+
+    if (self->hazard_retired != NULL)
+    {
+        hazard_scan(self);
+    }
+
+    epoch_free_old(self, epoch_try_advance());
+
+    reclaim_node_t* epoch_retired = NULL;
+
+    for (u64 b = 0; b < 3; ++b)
+    {
+        epoch_retired = reclaim_append(epoch_retired, self->limbo[b]);
+        self->limbo[b] = NULL;
+    }
+
+    if (self->hazard_retired != NULL || epoch_retired != NULL)
+    {
+        mutex_lock(&reclaim.orphans_lock);
+
+        reclaim.hazard_orphans = reclaim_append(reclaim.hazard_orphans, self->hazard_retired);
+        reclaim.epoch_orphans = reclaim_append(reclaim.epoch_orphans, epoch_retired);
+        reclaim.has_orphans = 1;
+
+        mutex_unlock(&reclaim.orphans_lock);
+
+        self->hazard_retired = NULL;
+        self->hazard_count = 0;
+    }
+
+    atomic_store(&self->in_use, 0, ATOMIC_RELEASE);
+}
+
+/*
+    The API
+*/
+
+void* hazard_protect(u32 slot, void* volatile* src)
+{
+    reclaim_record_t* self = reclaim_self();
+    void* ptr = atomic_load(src, ATOMIC_ACQUIRE);
+
+    for (;;)
+    {
+        atomic_store(&self->hazards[slot], ptr, ATOMIC_RELAXED);
+
+        /* A scan that starts after this sees the slot */
+        atomic_fence(ATOMIC_SEQ_CST);
+
+        void* again = atomic_load(src, ATOMIC_ACQUIRE);
+
+        if (again == ptr)
+        {
+            return ptr;
+        }
+
+        ptr = again;
+    }
+}
+
+void hazard_clear(u32 slot)
+{
+    reclaim_record_t* self = reclaim_self();
+
+    atomic_store(&self->hazards[slot], NULL, ATOMIC_RELEASE);
+}
+
+void hazard_retire(reclaim_node_t* node, reclaim_free_fn_t free)
+{
+    reclaim_record_t* self = reclaim_self();
+
+    node->free = free;
+    node->next = self->hazard_retired;
+    self->hazard_retired = node;
+
+    if (++self->hazard_count >= reclaim_threshold())
+    {
+        reclaim_adopt(self);
+        hazard_scan(self);
+    }
+}
+
+void epoch_enter(void)
+{
+    reclaim_record_t* self = reclaim_self();
+
+    if (self->nest++ == 0)
+    {
+        const u64 epoch = atomic_load(&reclaim.epoch, ATOMIC_RELAXED);
+
+        atomic_store(&self->epoch, (epoch << 1) | 1, ATOMIC_RELAXED);
+
+        /* Seen before anything read inside */
+        atomic_fence(ATOMIC_SEQ_CST);
+    }
+}
+
+void epoch_exit(void)
+{
+    reclaim_record_t* self = reclaim_self();
+
+    if (--self->nest == 0)
+    {
+        atomic_store(&self->epoch, 0, ATOMIC_RELEASE);
+    }
+}
+
+void epoch_retire(reclaim_node_t* node, reclaim_free_fn_t free)
+{
+    reclaim_record_t* self = reclaim_self();
+
+    node->free = free;
+
+    /*
+        The store that unlinked the node is seen before the epoch is read:
+        otherwise a reader could find the node in an epoch after the one
+        it is tagged with, and it would be freed under the reader
+    */
+    atomic_fence(ATOMIC_SEQ_CST);
+
+    epoch_push(self, node, atomic_load(&reclaim.epoch, ATOMIC_ACQUIRE));
+
+    if (++self->epoch_count >= reclaim_threshold())
+    {
+        self->epoch_count = 0;
+
+        reclaim_adopt(self);
+        epoch_free_old(self, epoch_try_advance());
+    }
+}
+
+void reclaim_collect(void)
+{
+    reclaim_record_t* self = reclaim_self();
+
+    reclaim_adopt(self);
+    hazard_scan(self);
+
+    /* Freeing takes two moves of the epoch */
+    for (u64 i = 0; i < 3; ++i)
+    {
+        epoch_free_old(self, epoch_try_advance());
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef __LIBRECLAIM_H__
+#define __LIBRECLAIM_H__
+
+#include "lib.h"
+
+/*
+    Reclaiming the nodes of lock-free structures.
+
+    A node taken out of a structure may still be read by the threads that
+    found it before; it is retired rather than freed, and freed once no
+    thread can hold it any more. Two schemes:
+
+        hazard pointers -- a reader publishes the node it is about to read in
+                           one of its HAZARD_SLOTS slots and checks it is still
+                           reachable; a retired node is freed once no slot holds
+                           it. Bounded garbage, a fence per node read.
+        epochs          -- a reader announces the global epoch when it enters a
+                           critical section; the epoch moves on once every thread
+                           in one has seen it, and a node retired in epoch e is
+                           freed in epoch e + 2. A fence per critical section,
+                           however many nodes are read; a reader that stays
+                           inside holds back all the garbage.
+
+    The slots and the announced epoch of a thread are in a record of its own,
+    found through a thread-specific key of the thread. A fiber uses the
+    record of the carrier running it, not one of its own: there are at most
+    as many records in use as threads, RECLAIM_THREADS_MAX.
+
+    A thread retires into lists of its own and goes over them once they are
+    longer than twice the number of the slots of all the threads, so that
+    each pass frees at least half of what it looks at: the cost per retired
+    node stays constant.
+
+    When a thread exits through thread_exit, its remaining retired nodes are
+    left to the next thread to go over its lists. The main thread and the
+    threads running without a TCB of the runtime do not exit that way.
+
+    The node is retired with a reclaim_node_t at its start: that is the
+    address published in the hazard slots. The fibers a carrier runs share
+    its slots and its critical section: a fiber must not hold a slot or stay
+    in a critical section across a switch, as another fiber could clear the
+    slot or end the section, and the fiber may resume on another carrier.
+*/
+
+#define HAZARD_SLOTS        4
+#define RECLAIM_BATCH       64
+#define RECLAIM_THREADS_MAX (THREAD_POOL_SIZE + 1)
+
+typedef struct _reclaim_node_t reclaim_node_t;
+typedef void (*reclaim_free_fn_t)(reclaim_node_t* node);
+
+struct _reclaim_node_t
+{
+    reclaim_node_t*     next;
+    reclaim_free_fn_t   free;
+};
+
+/*
+    Hazard pointers.
+
+    hazard_protect reads '*src' into the slot until it stays the same, and
+    returns it: as long as the slot holds it, the node is not freed.
+*/
+void* hazard_protect(u32 slot, void* volatile* src);
+void  hazard_clear(u32 slot);
+
+/*
+    'node' is out of the structure; free it with 'free' once no slot holds it.
+*/
+void  hazard_retire(reclaim_node_t* node, reclaim_free_fn_t free);
+
+/*
+    Epochs. Critical sections nest.
+*/
+void epoch_enter(void);
+void epoch_exit(void);
+
+/*
+    'node' is out of the structure; free it with 'free' once every critical
+    section that might have found it is over.
+*/
+void epoch_retire(reclaim_node_t* node, reclaim_free_fn_t free);
+
+/*
+    Go over the retired nodes of the calling thread and free what can be,
+    however few there are.
+*/
+void reclaim_collect(void);
+
+#endif
@@ -0,0 +1,127 @@
+#include "libring.h"
+
+i64 spsc_ring_init(spsc_ring_t* ring, u64 size)
+{
+    const u64 page_size = auxv_get(AT_PAGESZ);
+
+    if (size == 0 || (size & (size - 1)) != 0 || (size & (page_size - 1)) != 0)
+    {
+        return -EINVAL;
+    }
+
+    i64 fd = sys_memfd_create("spsc_ring", MFD_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return fd;
+    }
+
+    i64 s = sys_ftruncate(fd, size);
+
+    if (s < 0)
+    {
+        sys_close(fd);
+
+        return s;
+    }
+
+    /* Reserve room for both views, then map the file over each half */
+    u64 data = sys_mmap(0, 2*size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+
+    if ((i64)data < 0 && (i64)data >= -4095)
+    {
+        sys_close(fd);
+
+        return (i64)data;
+    }
+
+    for (u64 view = 0; view < 2; ++view)
+    {
+        u64 mapped = sys_mmap((void*)(data + view*size), size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+
+        if ((i64)mapped < 0 && (i64)mapped >= -4095)
+        {
+            sys_munmap((void*)data, 2*size);
+            sys_close(fd);
+
+            return (i64)mapped;
+        }
+    }
+
+    /* The mappings keep the file */
+    sys_close(fd);
+
+    ring->data = (u8*)data;
+    ring->size = size;
+    ring->mask = size - 1;
+    ring->head = ring->tail = 0;
+    ring->write = ring->tail_cache = 0;
+    ring->read = ring->head_cache = 0;
+
+    return 0;
+}
+
+void spsc_ring_free(spsc_ring_t* ring)
+{
+    sys_munmap(ring->data, 2*ring->size);
+    ring->data = NULL;
+}
+
+void* spsc_ring_reserve(spsc_ring_t* ring, u64 bytes)
+{
+    const u64 write = ring->write;
+
+    if (write + bytes - ring->tail_cache > ring->size)
+    {
+        /* The released space is seen with whatever the consumer read from it */
+        ring->tail_cache = atomic_load(&ring->tail, ATOMIC_ACQUIRE);
+
+        if (write + bytes - ring->tail_cache > ring->size)
+        {
+            return NULL;
+        }
+    }
+
+    return ring->data + (write & ring->mask);
+}
+
+void spsc_ring_commit(spsc_ring_t* ring, u64 bytes)
+{
+    ring->write += bytes;
+}
+
+void spsc_ring_publish(spsc_ring_t* ring)
+{
+    atomic_store(&ring->head, ring->write, ATOMIC_RELEASE);
+}
+
+void* spsc_ring_peek(spsc_ring_t* ring, u64* bytes)
+{
+    const u64 read = ring->read;
+
+    if (read == ring->head_cache)
+    {
+        ring->head_cache = atomic_load(&ring->head, ATOMIC_ACQUIRE);
+
+        if (read == ring->head_cache)
+        {
+            *bytes = 0;
+
+            return NULL;
+        }
+    }
+
+    *bytes = ring->head_cache - read;
+
+    return ring->data + (read & ring->mask);
+}
+
+void spsc_ring_consume(spsc_ring_t* ring, u64 bytes)
+{
+    ring->read += bytes;
+}
+
+void spsc_ring_release(spsc_ring_t* ring)
+{
+    atomic_store(&ring->tail, ring->read, ATOMIC_RELEASE);
+}
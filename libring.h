@@ -0,0 +1,76 @@
+#ifndef __LIBRING_H__
+#define __LIBRING_H__
+
+#include "lib.h"
+
+/*
+    Single-producer single-consumer byte ring, mapped twice.
+
+    The pages of a memfd are mapped at two adjacent addresses: the byte at
+    'data + size + i' is the byte at 'data + i'. Any 'size' bytes starting
+    in the first view are contiguous, so a record that crosses the end of
+    the ring is still written and read in place, with no copy and no split.
+
+    The producer reserves space, writes records there, and commits them;
+    nothing is seen by the consumer until the producer publishes, which
+    makes all the commits since the previous publish visible at once with
+    one release store of 'head'. The consumer peeks at what was published,
+    reads records in place, consumes them, and releases the space back to
+    the producer the same way with one store of 'tail'. Each side keeps its
+    own position and a copy of the other side's index, and only reads the
+    other side's cache line when its copy says the ring is full or empty.
+
+    One thread produces and one thread consumes; nothing waits, a side that
+    finds the ring full or empty gets NULL and tries again later.
+*/
+
+typedef struct _spsc_ring_t
+{
+    u8*             data;           /* Two views of 'size' bytes */
+    u64             size;           /* A power of 2, a multiple of the page size */
+    u64             mask;
+
+    volatile u64    head __attribute__((aligned(CACHE_LINE_SIZE)));    /* Published by the producer */
+    volatile u64    tail __attribute__((aligned(CACHE_LINE_SIZE)));    /* Released by the consumer */
+
+    /* The producer's line */
+    u64             write __attribute__((aligned(CACHE_LINE_SIZE)));   /* Committed, maybe not published */
+    u64             tail_cache;
+
+    /* The consumer's line */
+    u64             read __attribute__((aligned(CACHE_LINE_SIZE)));    /* Consumed, maybe not released */
+    u64             head_cache;
+} __attribute__((aligned(CACHE_LINE_SIZE))) spsc_ring_t;
+
+/*
+    Create the memfd of 'size' bytes and map it twice.
+    Returns 0, -EINVAL, or the error of the system call that failed.
+*/
+i64 spsc_ring_init(spsc_ring_t* ring, u64 size);
+
+/*
+    Unmap both views. Neither side may use the ring any more.
+*/
+void spsc_ring_free(spsc_ring_t* ring);
+
+/*
+    The producer.
+
+    spsc_ring_reserve returns 'bytes' of contiguous free space after the
+    committed records, or NULL if the ring has less free.
+*/
+void* spsc_ring_reserve(spsc_ring_t* ring, u64 bytes);
+void  spsc_ring_commit(spsc_ring_t* ring, u64 bytes);
+void  spsc_ring_publish(spsc_ring_t* ring);
+
+/*
+    The consumer.
+
+    spsc_ring_peek returns the published bytes not consumed yet, contiguous,
+    and stores their count; NULL if there are none.
+*/
+void* spsc_ring_peek(spsc_ring_t* ring, u64* bytes);
+void  spsc_ring_consume(spsc_ring_t* ring, u64 bytes);
+void  spsc_ring_release(spsc_ring_t* ring);
+
+#endif
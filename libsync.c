@@ -0,0 +1,852 @@
+#include "libsync.h"
+
+#define SYNC_WAKE_ALL       0x7fffffff
+
+static void sync_futex_wait(volatile i32* futex, i32 value)
+{
+    i64 s = sys_futex(futex, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, value, NULL, NULL, 0);
+
+    if (s != 0 && s != -EAGAIN && s != -EINTR)
+    {
+        fatal("sync_futex_wait", s);
+    }
+}
+
+static void sync_futex_wake(volatile i32* futex, i32 count)
+{
+    i64 s = sys_futex(futex, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, count, NULL, NULL, 0);
+
+    if (s < 0)
+    {
+        fatal("sync_futex_wake", s);
+    }
+}
+
+/*
+    Condition variables
+*/
+
+void condvar_init(condvar_t* cv)
+{
+    cv->seq = 0;
+    cv->waiters = 0;
+    cv->mutex = NULL;
+}
+
+void condvar_wait(condvar_t* cv, mutex_t* mutex)
+{
+    /* A broadcast that sees the waiter sees the mutex to requeue to */
+    atomic_store(&cv->mutex, mutex, ATOMIC_RELEASE);
+
+    /*
+        A signal after this point bumps the sequence number, or sees the waiter:
+        the waiter counts itself first, the signal bumps first
+    */
+    atomic_fetch_add(&cv->waiters, 1, ATOMIC_SEQ_CST);
+
+    const i32 seq = atomic_load(&cv->seq, ATOMIC_SEQ_CST);
+
+    mutex_unlock(mutex);
+    sync_futex_wait(&cv->seq, seq);
+
+    atomic_fetch_sub(&cv->waiters, 1, ATOMIC_RELAXED);
+
+    /* Possibly requeued to the mutex, with others behind */
+    mutex_lock_contended(mutex);
+}
+
+void condvar_signal(condvar_t* cv)
+{
+    atomic_fetch_add(&cv->seq, 1, ATOMIC_SEQ_CST);
+
+    if (atomic_load(&cv->waiters, ATOMIC_SEQ_CST) != 0)
+    {
+        sync_futex_wake(&cv->seq, 1);
+    }
+}
+
+void condvar_broadcast(condvar_t* cv)
+{
+    i32 seq = atomic_fetch_add(&cv->seq, 1, ATOMIC_SEQ_CST) + 1;
+
+    if (atomic_load(&cv->waiters, ATOMIC_SEQ_CST) == 0)
+    {
+        return;
+    }
+
+    mutex_t* mutex = atomic_load(&cv->mutex, ATOMIC_ACQUIRE);
+
+    if (mutex == NULL)
+    {
+        sync_futex_wake(&cv->seq, SYNC_WAKE_ALL);
+
+        return;
+    }
+
+    for (;;)
+    {
+        /* The waiter woken locks the mutex as contended, and the others follow */
+        i64 s = sys_futex(&cv->seq, FUTEX_CMP_REQUEUE | FUTEX_PRIVATE_FLAG, 1,
+                          (const struct timespec*)(u64)SYNC_WAKE_ALL, (i32*)&mutex->state, seq);
+
+        if (s >= 0)
+        {
+            break;
+        }
+
+        if (s != -EAGAIN)
+        {
+            fatal("condvar_broadcast", s);
+        }
+
+        /* Another signal or broadcast came in between */
+        seq = cv->seq;
+    }
+}
+
+/*
+    Barriers
+*/
+
+void barrier_init(barrier_t* barrier, u32 count)
+{
+    barrier->count = count;
+    barrier->remaining = count;
+    barrier->sense = 0;
+    barrier->sleepers = 0;
+}
+
+u32 barrier_wait(barrier_t* barrier)
+{
+    /* Flipped when the previous phase ended, before anyone could arrive at this one */
+    const i32 sense = atomic_load(&barrier->sense, ATOMIC_ACQUIRE);
+
+    if (atomic_fetch_sub(&barrier->remaining, 1, ATOMIC_ACQ_REL) == 1)
+    {
+        barrier->remaining = barrier->count;
+
+        /* A sleeper counts itself before it looks at the sense, the last thread flips it first */
+        atomic_store(&barrier->sense, sense ^ 1, ATOMIC_SEQ_CST);
+
+        if (atomic_load(&barrier->sleepers, ATOMIC_SEQ_CST) != 0)
+        {
+            sync_futex_wake(&barrier->sense, SYNC_WAKE_ALL);
+        }
+
+        return 1;
+    }
+
+    for (u32 i = 0; i < BARRIER_SPIN; ++i)
+    {
+        if (atomic_load(&barrier->sense, ATOMIC_ACQUIRE) != sense)
+        {
+            return 0;
+        }
+
+        cpu_relax();
+    }
+
+    atomic_fetch_add(&barrier->sleepers, 1, ATOMIC_SEQ_CST);
+
+    while (atomic_load(&barrier->sense, ATOMIC_SEQ_CST) == sense)
+    {
+        sync_futex_wait(&barrier->sense, sense);
+    }
+
+    atomic_fetch_sub(&barrier->sleepers, 1, ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+    Reader-writer locks
+*/
+
+void rwlock_init(rwlock_t* lock)
+{
+    lock->state = 0;
+    lock->read_seq = 0;
+    lock->write_seq = 0;
+    lock->readers_waiting = 0;
+}
+
+void rwlock_read_lock(rwlock_t* lock)
+{
+    for (;;)
+    {
+        i32 state = lock->state;
+
+        if ((state & (RWLOCK_WRITER | RWLOCK_WAITING_MASK)) == 0)
+        {
+            if (atomic_cas(&lock->state, state, state + 1, ATOMIC_ACQUIRE))
+            {
+                return;
+            }
+
+            continue;
+        }
+
+        /* The writer bumps the sequence number after it changes the state */
+        atomic_fetch_add(&lock->readers_waiting, 1, ATOMIC_SEQ_CST);
+
+        const i32 seq = atomic_load(&lock->read_seq, ATOMIC_SEQ_CST);
+
+        if ((atomic_load(&lock->state, ATOMIC_SEQ_CST) & (RWLOCK_WRITER | RWLOCK_WAITING_MASK)) != 0)
+        {
+            sync_futex_wait(&lock->read_seq, seq);
+        }
+
+        atomic_fetch_sub(&lock->readers_waiting, 1, ATOMIC_RELAXED);
+    }
+}
+
+static void rwlock_wake_writer(rwlock_t* lock)
+{
+    atomic_fetch_add(&lock->write_seq, 1, ATOMIC_SEQ_CST);
+    sync_futex_wake(&lock->write_seq, 1);
+}
+
+void rwlock_read_unlock(rwlock_t* lock)
+{
+    const i32 state = atomic_fetch_sub(&lock->state, 1, ATOMIC_RELEASE) - 1;
+
+    /* The last reader out lets a waiting writer in */
+    if ((state & RWLOCK_READERS_MASK) == 0 && (state & RWLOCK_WAITING_MASK) != 0)
+    {
+        rwlock_wake_writer(lock);
+    }
+}
+
+void rwlock_write_lock(rwlock_t* lock)
+{
+    if (atomic_cas(&lock->state, 0, RWLOCK_WRITER, ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    u32 waiting = 0;
+
+    for (;;)
+    {
+        const i32 seq = atomic_load(&lock->write_seq, ATOMIC_SEQ_CST);
+        const i32 state = lock->state;
+
+        if ((state & (RWLOCK_WRITER | RWLOCK_READERS_MASK)) == 0)
+        {
+            const i32 locked = (state | RWLOCK_WRITER) - (waiting ? RWLOCK_WAITING_ONE : 0);
+
+            if (atomic_cas(&lock->state, state, locked, ATOMIC_ACQUIRE))
+            {
+                return;
+            }
+
+            continue;
+        }
+
+        /* Counted as waiting, new readers stay out */
+        if (!waiting)
+        {
+            waiting = atomic_cas(&lock->state, state, state + RWLOCK_WAITING_ONE, ATOMIC_RELAXED);
+
+            continue;
+        }
+
+        sync_futex_wait(&lock->write_seq, seq);
+    }
+}
+
+void rwlock_write_unlock(rwlock_t* lock)
+{
+    const i32 state = atomic_fetch_sub(&lock->state, RWLOCK_WRITER, ATOMIC_RELEASE) - RWLOCK_WRITER;
+
+    if ((state & RWLOCK_WAITING_MASK) != 0)
+    {
+        rwlock_wake_writer(lock);
+
+        return;
+    }
+
+    atomic_fetch_add(&lock->read_seq, 1, ATOMIC_SEQ_CST);
+
+    if (atomic_load(&lock->readers_waiting, ATOMIC_SEQ_CST) != 0)
+    {
+        sync_futex_wake(&lock->read_seq, SYNC_WAKE_ALL);
+    }
+}
+
+/*
+    Queue locks
+*/
+
+/*
+    Take a free node of the calling thread
+*/
+static qlock_node_t* qlock_node_take(void)
+{
+    thread_tcb_t* tcb = runtime_tcb();
+
+    if (tcb == NULL)
+    {
+        fatal("Queue lock without a TCB", 0);
+    }
+
+    const u32 free = ~tcb->qlock_busy & ((1U << QLOCK_NODES) - 1);
+
+    if (free == 0)
+    {
+        fatal("Too many queue locks held", QLOCK_NODES);
+    }
+
+    const u32 slot = __builtin_ctz(free);
+    qlock_node_t* node = tcb->qlock_owned[slot];
+
+    if (node == NULL)
+    {
+        node = &tcb->qlock_storage[slot];
+        tcb->qlock_owned[slot] = node;
+    }
+
+    tcb->qlock_busy |= 1U << slot;
+    node->slot = slot;
+
+    return node;
+}
+
+/*
+    Give the node back, with 'owned' as the node of its slot from now on
+*/
+static void qlock_node_release(qlock_node_t* node, qlock_node_t* owned)
+{
+    thread_tcb_t* tcb = runtime_tcb();
+    const u32 slot = node->slot;
+
+    tcb->qlock_owned[slot] = owned;
+    owned->slot = slot;
+    tcb->qlock_busy &= ~(1U << slot);
+}
+
+/*
+    Wait for '*locked' to become 0: spin, then park if allowed
+*/
+static void qlock_wait(volatile i32* locked, u32 park)
+{
+    for (u32 i = 0; !park || i < QLOCK_SPIN; ++i)
+    {
+        if (atomic_load(locked, ATOMIC_ACQUIRE) == 0)
+        {
+            return;
+        }
+
+        cpu_relax();
+    }
+
+    /* 2 tells the unlock there is a waiter to wake */
+    if (atomic_cas(locked, 1, 2, ATOMIC_RELAXED))
+    {
+        while (atomic_load(locked, ATOMIC_ACQUIRE) != 0)
+        {
+            sync_futex_wait(locked, 2);
+        }
+    }
+    else
+    {
+        /* Handed over in between, the failed exchange read 0 */
+        atomic_fence(ATOMIC_ACQUIRE);
+    }
+}
+
+static void qlock_hand_over(volatile i32* locked)
+{
+    if (atomic_exchange(locked, 0, ATOMIC_RELEASE) == 2)
+    {
+        sync_futex_wake(locked, 1);
+    }
+}
+
+void ticket_lock_init(ticket_lock_t* lock, u32 park)
+{
+    lock->next = 0;
+    lock->serving = 0;
+    lock->parked = 0;
+    lock->park = park;
+}
+
+void ticket_lock(ticket_lock_t* lock)
+{
+    const u32 ticket = atomic_fetch_add(&lock->next, 1, ATOMIC_RELAXED);
+    u32 spins = 0;
+
+    for (;;)
+    {
+        const u32 serving = atomic_load(&lock->serving, ATOMIC_ACQUIRE);
+
+        if (serving == ticket)
+        {
+            return;
+        }
+
+        if (lock->park && spins >= QLOCK_SPIN)
+        {
+            atomic_fetch_add(&lock->parked, 1, ATOMIC_SEQ_CST);
+
+            /* The unlock bumps 'serving' before it looks at 'parked' */
+            if (atomic_load(&lock->serving, ATOMIC_SEQ_CST) == (i32)serving)
+            {
+                sync_futex_wait(&lock->serving, serving);
+            }
+
+            atomic_fetch_sub(&lock->parked, 1, ATOMIC_RELAXED);
+
+            continue;
+        }
+
+        /* The further back in the queue, the longer the wait */
+        for (u32 i = 0; i < ticket - serving; ++i)
+        {
+            cpu_relax();
+        }
+
+        spins += ticket - serving;
+    }
+}
+
+void ticket_unlock(ticket_lock_t* lock)
+{
+    atomic_store(&lock->serving, lock->serving + 1, ATOMIC_SEQ_CST);
+
+    /* Everyone parked wakes up, but only the next one gets in */
+    if (atomic_load(&lock->parked, ATOMIC_SEQ_CST) != 0)
+    {
+        sync_futex_wake(&lock->serving, SYNC_WAKE_ALL);
+    }
+}
+
+void mcs_lock_init(mcs_lock_t* lock, u32 park)
+{
+    lock->tail = NULL;
+    lock->holder = NULL;
+    lock->park = park;
+}
+
+void mcs_lock(mcs_lock_t* lock)
+{
+    qlock_node_t* node = qlock_node_take();
+
+    node->next = NULL;
+    node->locked = 1;
+
+    qlock_node_t* pred = atomic_exchange(&lock->tail, node, ATOMIC_ACQ_REL);
+
+    if (pred != NULL)
+    {
+        atomic_store(&pred->next, node, ATOMIC_RELEASE);
+        qlock_wait(&node->locked, lock->park);
+    }
+
+    lock->holder = node;
+}
+
+void mcs_unlock(mcs_lock_t* lock)
+{
+    qlock_node_t* node = lock->holder;
+    qlock_node_t* next = atomic_load(&node->next, ATOMIC_ACQUIRE);
+
+    if (next == NULL)
+    {
+        if (atomic_cas(&lock->tail, node, NULL, ATOMIC_RELEASE))
+        {
+            qlock_node_release(node, node);
+
+            return;
+        }
+
+        /* A successor has swapped the tail, and is about to link itself */
+        while ((next = atomic_load(&node->next, ATOMIC_ACQUIRE)) == NULL)
+        {
+            cpu_relax();
+        }
+    }
+
+    qlock_hand_over(&next->locked);
+    qlock_node_release(node, node);
+}
+
+void clh_lock_init(clh_lock_t* lock, u32 park)
+{
+    lock->initial.locked = 0;
+    lock->tail = &lock->initial;
+    lock->holder = NULL;
+    lock->park = park;
+}
+
+void clh_lock(clh_lock_t* lock)
+{
+    qlock_node_t* node = qlock_node_take();
+
+    node->locked = 1;
+    node->pred = atomic_exchange(&lock->tail, node, ATOMIC_ACQ_REL);
+
+    qlock_wait(&node->pred->locked, lock->park);
+
+    lock->holder = node;
+}
+
+void clh_unlock(clh_lock_t* lock)
+{
+    qlock_node_t* node = lock->holder;
+    qlock_node_t* pred = node->pred;
+
+    /* The successor spins on 'node' now, the predecessor's node is free for us */
+    qlock_hand_over(&node->locked);
+    qlock_node_release(node, pred);
+}
+
+/*
+    Sequence locks
+*/
+
+void seqlock_init(seqlock_t* lock)
+{
+    lock->seq = 0;
+}
+
+u32 seqlock_read_begin(const seqlock_t* lock)
+{
+    u32 seq;
+
+    while (((seq = atomic_load(&lock->seq, ATOMIC_ACQUIRE)) & 1) != 0)
+    {
+        cpu_relax();
+    }
+
+    return seq;
+}
+
+u32 seqlock_read_retry(const seqlock_t* lock, u32 seq)
+{
+    /* The data is read before the number again */
+    atomic_fence(ATOMIC_ACQUIRE);
+
+    return atomic_load(&lock->seq, ATOMIC_RELAXED) != seq;
+}
+
+void seqlock_write_begin(seqlock_t* lock)
+{
+    for (;;)
+    {
+        const u32 seq = atomic_load(&lock->seq, ATOMIC_RELAXED);
+
+        if ((seq & 1) == 0 && atomic_cas(&lock->seq, seq, seq + 1, ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+
+        cpu_relax();
+    }
+
+    /* A reader that sees any of the data written sees the number odd */
+    atomic_fence(ATOMIC_RELEASE);
+}
+
+void seqlock_write_end(seqlock_t* lock)
+{
+    atomic_store(&lock->seq, lock->seq + 1, ATOMIC_RELEASE);
+}
+
+u32 seqlock_read(const seqlock_t* lock, void* dst, const void* src, u64 size)
+{
+    u32 retries = 0;
+    u32 seq;
+
+    for (;;)
+    {
+        seq = seqlock_read_begin(lock);
+        memcpy(dst, src, size);
+
+        if (!seqlock_read_retry(lock, seq))
+        {
+            return retries;
+        }
+
+        ++retries;
+    }
+}
+
+void seqlock_write(seqlock_t* lock, void* dst, const void* src, u64 size)
+{
+    seqlock_write_begin(lock);
+    memcpy(dst, src, size);
+    seqlock_write_end(lock);
+}
+
+/*
+    Multi-version sequence locks
+*/
+
+void mvseqlock_init(mvseqlock_t* lock, void* copies, u64 size)
+{
+    lock->version = 0;
+    lock->writing = 0;
+    lock->size = size;
+    lock->copies = (u8*)copies;
+
+    for (u64 i = 0; i < SEQLOCK_VERSIONS; ++i)
+    {
+        seqlock_init(&lock->locks[i]);
+    }
+}
+
+u32 mvseqlock_read(const mvseqlock_t* lock, void* dst)
+{
+    u32 retries = 0;
+
+    for (;;)
+    {
+        const u64 version = atomic_load(&lock->version, ATOMIC_ACQUIRE);
+        const u64 index = version % SEQLOCK_VERSIONS;
+        const seqlock_t* copy_lock = &lock->locks[index];
+        const u32 seq = atomic_load(&copy_lock->seq, ATOMIC_ACQUIRE);
+
+        /* Odd: the writer has come round to this copy already, take the newer one */
+        if ((seq & 1) == 0)
+        {
+            memcpy(dst, lock->copies + index*lock->size, lock->size);
+
+            if (!seqlock_read_retry(copy_lock, seq))
+            {
+                return retries;
+            }
+        }
+
+        ++retries;
+        cpu_relax();
+    }
+}
+
+void* mvseqlock_write_begin(mvseqlock_t* lock)
+{
+    while (lock->writing != 0 || !atomic_cas(&lock->writing, 0, 1, ATOMIC_ACQUIRE))
+    {
+        cpu_relax();
+    }
+
+    const u64 version = lock->version;
+    const u64 next = (version + 1) % SEQLOCK_VERSIONS;
+    u8* copy = lock->copies + next*lock->size;
+
+    seqlock_write_begin(&lock->locks[next]);
+    memcpy(copy, lock->copies + (version % SEQLOCK_VERSIONS)*lock->size, lock->size);
+
+    return copy;
+}
+
+void mvseqlock_write_end(mvseqlock_t* lock)
+{
+    const u64 version = lock->version + 1;
+
+    seqlock_write_end(&lock->locks[version % SEQLOCK_VERSIONS]);
+    atomic_store(&lock->version, version, ATOMIC_RELEASE);
+    atomic_store(&lock->writing, 0, ATOMIC_RELEASE);
+}
+
+/*
+    Biased locks
+*/
+
+/* The tid of the calling thread, that of its carrier on a fiber */
+static i64 biased_tid(void)
+{
+    thread_tcb_t* tcb = runtime_tcb();
+
+    return tcb != NULL ? tcb->tid : sys_gettid();
+}
+
+void biased_lock_init(biased_lock_t* lock)
+{
+    lock->owner_in = 0;
+    lock->owner_slow = 0;
+    lock->owner = biased_tid();
+    lock->others_in = 0;
+
+    mutex_init(&lock->mutex);
+}
+
+void biased_lock(biased_lock_t* lock)
+{
+    if (lock->owner == biased_tid())
+    {
+        lock->owner_in = 1;
+        atomic_fence_light();
+
+        if (atomic_load(&lock->others_in, ATOMIC_ACQUIRE) == 0)
+        {
+            return;
+        }
+
+        /* Let the other in, then queue behind it */
+        atomic_store(&lock->owner_in, 0, ATOMIC_RELEASE);
+        mutex_lock(&lock->mutex);
+
+        lock->owner_slow = 1;
+
+        return;
+    }
+
+    mutex_lock(&lock->mutex);
+
+    lock->others_in = 1;
+    atomic_fence_heavy();
+
+    while (atomic_load(&lock->owner_in, ATOMIC_ACQUIRE) != 0)
+    {
+        cpu_relax();
+    }
+}
+
+void biased_unlock(biased_lock_t* lock)
+{
+    if (lock->owner == biased_tid())
+    {
+        if (lock->owner_slow)
+        {
+            lock->owner_slow = 0;
+            mutex_unlock(&lock->mutex);
+        }
+        else
+        {
+            atomic_store(&lock->owner_in, 0, ATOMIC_RELEASE);
+        }
+
+        return;
+    }
+
+    atomic_store(&lock->others_in, 0, ATOMIC_RELEASE);
+    mutex_unlock(&lock->mutex);
+}
+
+/*
+    Big-reader locks
+*/
+
+void brlock_init(brlock_t* lock)
+{
+    lock->writer = 0;
+    lock->overflow = 0;
+
+    mutex_init(&lock->mutex);
+
+    for (u64 i = 0; i < BRLOCK_SLOTS; ++i)
+    {
+        lock->slots[i].in = 0;
+    }
+}
+
+/* The slot of the calling thread, NULL if it has none */
+static volatile u32* brlock_slot(brlock_t* lock)
+{
+    thread_tcb_t* tcb = runtime_tcb();
+
+    return tcb != NULL && tcb->index < BRLOCK_SLOTS ? &lock->slots[tcb->index].in : NULL;
+}
+
+static void brlock_wait_writer(brlock_t* lock)
+{
+    for (u32 i = 0; atomic_load(&lock->writer, ATOMIC_ACQUIRE) != 0; ++i)
+    {
+        if (i < BRLOCK_SPIN)
+        {
+            cpu_relax();
+        }
+        else
+        {
+            sync_futex_wait(&lock->writer, 1);
+        }
+    }
+}
+
+void brlock_read_lock(brlock_t* lock)
+{
+    volatile u32* slot = brlock_slot(lock);
+
+    /* Already in: a writer waits for this slot, it cannot be in */
+    if (slot != NULL && *slot != 0)
+    {
+        *slot = *slot + 1;
+
+        return;
+    }
+
+    for (;;)
+    {
+        if (slot != NULL)
+        {
+            *slot = 1;
+            atomic_fence_light();
+
+            if (atomic_load(&lock->writer, ATOMIC_ACQUIRE) == 0)
+            {
+                return;
+            }
+
+            atomic_store(slot, 0, ATOMIC_RELEASE);
+        }
+        else
+        {
+            atomic_fetch_add(&lock->overflow, 1, ATOMIC_SEQ_CST);
+
+            if (atomic_load(&lock->writer, ATOMIC_SEQ_CST) == 0)
+            {
+                return;
+            }
+
+            atomic_fetch_sub(&lock->overflow, 1, ATOMIC_RELEASE);
+        }
+
+        brlock_wait_writer(lock);
+    }
+}
+
+void brlock_read_unlock(brlock_t* lock)
+{
+    volatile u32* slot = brlock_slot(lock);
+
+    if (slot != NULL)
+    {
+        atomic_store(slot, *slot - 1, ATOMIC_RELEASE);
+    }
+    else
+    {
+        atomic_fetch_sub(&lock->overflow, 1, ATOMIC_RELEASE);
+    }
+}
+
+void brlock_write_lock(brlock_t* lock)
+{
+    mutex_lock(&lock->mutex);
+
+    atomic_store(&lock->writer, 1, ATOMIC_RELAXED);
+
+    /* Every reader either sees the writer, or has its flag seen below */
+    atomic_fence_heavy();
+
+    for (u64 i = 0; i < BRLOCK_SLOTS; ++i)
+    {
+        while (atomic_load(&lock->slots[i].in, ATOMIC_ACQUIRE) != 0)
+        {
+            cpu_relax();
+        }
+    }
+
+    while (atomic_load(&lock->overflow, ATOMIC_ACQUIRE) != 0)
+    {
+        cpu_relax();
+    }
+}
+
+void brlock_write_unlock(brlock_t* lock)
+{
+    atomic_store(&lock->writer, 0, ATOMIC_RELEASE);
+    sync_futex_wake(&lock->writer, SYNC_WAKE_ALL);
+
+    mutex_unlock(&lock->mutex);
+}
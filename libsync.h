@@ -0,0 +1,310 @@
+#ifndef __LIBSYNC_H__
+#define __LIBSYNC_H__
+
+#include "lib.h"
+
+/*
+    Condition variables, barriers and reader-writer locks on futexes.
+    The futex operations are private to the process.
+*/
+
+/*
+    Condition variable.
+
+    The waiters sleep on a sequence number that every signal and broadcast
+    bumps. A broadcast wakes one waiter and moves the others to the futex of
+    the mutex with FUTEX_CMP_REQUEUE: they are woken one by one as the mutex
+    is unlocked, instead of all at once only to fight over the mutex.
+    The waiters lock the mutex as contended, so that each unlock wakes the
+    next of them.
+
+    All the waiters of a condition variable use the same mutex.
+*/
+
+typedef struct _condvar_t
+{
+    volatile i32    seq;
+    volatile i32    waiters;    /* No system call in signal and broadcast without waiters */
+    mutex_t*        mutex;      /* Of the last waiter, where a broadcast requeues to */
+} condvar_t;
+
+#define CONDVAR_INIT        { .seq = 0, .waiters = 0, .mutex = NULL }
+
+void condvar_init(condvar_t* cv);
+
+/*
+    Unlock the mutex, wait for a signal or a broadcast, and lock the mutex again.
+    May return without either, the caller checks its condition in a loop.
+*/
+void condvar_wait(condvar_t* cv, mutex_t* mutex);
+
+void condvar_signal(condvar_t* cv);
+void condvar_broadcast(condvar_t* cv);
+
+/*
+    Sense-reversing barrier.
+
+    The last thread to arrive resets the count for the next phase, flips the
+    sense, and wakes all the others with a single FUTEX_WAKE, if any of them
+    sleeps. The others spin a little on the sense before sleeping on it.
+*/
+
+#define BARRIER_SPIN        100
+
+typedef struct _barrier_t
+{
+    u32             count;
+    volatile u32    remaining;
+    volatile i32    sense;
+    volatile i32    sleepers;   /* No system call in the last thread when nobody sleeps */
+} barrier_t;
+
+void barrier_init(barrier_t* barrier, u32 count);
+
+/*
+    Returns 1 in the last thread to arrive, 0 in the others.
+*/
+u32 barrier_wait(barrier_t* barrier);
+
+/*
+    Writer-preferring reader-writer lock.
+
+    The state holds the number of readers, the writer bit, and the number of
+    writers waiting. Readers get in with one compare-and-swap while there is
+    no writer and no writer waiting; a waiting writer keeps new readers out
+    until it is done. Readers and writers sleep on separate sequence numbers:
+    an unlock wakes one writer if any is waiting, all the readers otherwise,
+    and makes no system call if nobody waits.
+*/
+
+#define RWLOCK_READERS_MASK     0x0000ffff
+#define RWLOCK_WRITER           0x00010000
+#define RWLOCK_WAITING_ONE      0x00020000
+#define RWLOCK_WAITING_MASK     0x7ffe0000
+
+typedef struct _rwlock_t
+{
+    volatile i32    state;
+    volatile i32    read_seq;
+    volatile i32    write_seq;
+    volatile i32    readers_waiting;
+} rwlock_t;
+
+#define RWLOCK_INIT         { .state = 0, .read_seq = 0, .write_seq = 0, .readers_waiting = 0 }
+
+void rwlock_init(rwlock_t* lock);
+void rwlock_read_lock(rwlock_t* lock);
+void rwlock_read_unlock(rwlock_t* lock);
+void rwlock_write_lock(rwlock_t* lock);
+void rwlock_write_unlock(rwlock_t* lock);
+
+/*
+    Queue locks.
+
+    A compare-and-swap lock makes every waiter hammer the cache line of the
+    lock word. In these, each waiter spins on a line of its own, or at
+    least only reads the shared one, and the lock is handed over in FIFO
+    order:
+        ticket -- take a number, wait for it to be served: the waiters only
+                  read the shared counter, and back off in proportion to
+                  their distance from the head of the queue;
+        MCS    -- the waiters link their nodes into a queue and spin on
+                  their own node, which the predecessor flips on unlock;
+        CLH    -- the waiters spin on the node of their predecessor; on
+                  unlock, a thread leaves its node to the successor and
+                  takes the node of its predecessor instead.
+
+    The nodes of MCS and CLH are in the TCB of the thread or of the fiber,
+    so locking maps nothing. Since CLH nodes change hands, a CLH lock keeps
+    its initial node: it must outlive the threads that used it, and is not
+    initialized again once used, as some thread may own that node by then.
+
+    With 'park' set at init, a waiter that spins QLOCK_SPIN times without
+    getting the lock sleeps on a futex, and the unlock wakes it if it did.
+    Without it, the waiters never give up the CPU: with more threads than
+    CPUs, every handover waits for the scheduler to run the next in line.
+*/
+
+#define QLOCK_SPIN          200
+
+typedef struct _ticket_lock_t
+{
+    volatile u32    next;       /* Next number to take */
+    volatile i32    serving;
+    volatile i32    parked;     /* Waiters sleeping on 'serving' */
+    u32             park;
+} ticket_lock_t;
+
+void ticket_lock_init(ticket_lock_t* lock, u32 park);
+void ticket_lock(ticket_lock_t* lock);
+void ticket_unlock(ticket_lock_t* lock);
+
+typedef struct _mcs_lock_t
+{
+    qlock_node_t* volatile  tail;
+    qlock_node_t*           holder;
+    u32                     park;
+} mcs_lock_t;
+
+void mcs_lock_init(mcs_lock_t* lock, u32 park);
+void mcs_lock(mcs_lock_t* lock);
+void mcs_unlock(mcs_lock_t* lock);
+
+typedef struct _clh_lock_t
+{
+    qlock_node_t* volatile  tail;
+    qlock_node_t*           holder;
+    u32                     park;
+    qlock_node_t            initial;
+} clh_lock_t;
+
+void clh_lock_init(clh_lock_t* lock, u32 park);
+void clh_lock(clh_lock_t* lock);
+void clh_unlock(clh_lock_t* lock);
+
+/*
+    Sequence locks, for data read often and written seldom.
+
+    The writer makes the sequence number odd, writes, and makes it even
+    again with a release store. A reader notes an even number, copies the
+    data, and checks the number has not changed: if it has, the copy may be
+    torn and the reader starts again. Readers only read the lock and the
+    data, so they do not take the cache lines away from each other; writers
+    exclude each other with a compare-and-swap on the number.
+
+    The multi-version lock keeps SEQLOCK_VERSIONS copies of the data, each
+    under a sequence lock of its own. The writer writes the copy after the
+    current one and publishes its version, so a reader copying a large
+    payload starts again only if the writer went through all the copies
+    meanwhile, not on every update.
+
+    Waiting writers and readers facing a writer spin, never sleep.
+*/
+
+#define SEQLOCK_VERSIONS    4
+
+typedef struct _seqlock_t
+{
+    volatile u32    seq;    /* Odd while written */
+} seqlock_t;
+
+#define SEQLOCK_INIT        { .seq = 0 }
+
+void seqlock_init(seqlock_t* lock);
+
+/*
+    Reading:
+        do
+        {
+            seq = seqlock_read_begin(&lock);
+            ... copy the data ...
+        } while (seqlock_read_retry(&lock, seq));
+*/
+u32  seqlock_read_begin(const seqlock_t* lock);
+u32  seqlock_read_retry(const seqlock_t* lock, u32 seq);
+void seqlock_write_begin(seqlock_t* lock);
+void seqlock_write_end(seqlock_t* lock);
+
+/*
+    Copy 'size' bytes from 'src' into 'dst' under the lock.
+    seqlock_read returns how many times the copy was started again.
+*/
+u32  seqlock_read(const seqlock_t* lock, void* dst, const void* src, u64 size);
+void seqlock_write(seqlock_t* lock, void* dst, const void* src, u64 size);
+
+typedef struct _mvseqlock_t
+{
+    volatile u64    version;    /* Current, in the copy of version % SEQLOCK_VERSIONS */
+    volatile u32    writing;
+    u64             size;
+    u8*             copies;     /* SEQLOCK_VERSIONS copies of 'size' bytes, of the caller */
+    seqlock_t       locks[SEQLOCK_VERSIONS];
+} mvseqlock_t;
+
+/*
+    'copies' holds SEQLOCK_VERSIONS*size bytes; the data is the first copy.
+*/
+void mvseqlock_init(mvseqlock_t* lock, void* copies, u64 size);
+
+/*
+    Copy the current version into 'dst'. Returns how many times the copy was
+    started again.
+*/
+u32 mvseqlock_read(const mvseqlock_t* lock, void* dst);
+
+/*
+    Returns the copy to write, holding the current version; it becomes
+    current at mvseqlock_write_end.
+*/
+void* mvseqlock_write_begin(mvseqlock_t* lock);
+void  mvseqlock_write_end(mvseqlock_t* lock);
+
+/*
+    Locks biased to one side, on the asymmetric fences of libatomic.h.
+
+    A biased lock belongs to the thread that initialized it, known by its
+    tid: on a fiber, the carrier running it. The owner locks with a plain
+    store of its flag and a light fence, then a look at the flag of the
+    others; the others serialize on a mutex, raise their flag, run a heavy
+    fence, and wait for the owner's flag to drop. When the owner finds the
+    others' flag up, it lowers its own and queues on the mutex like them.
+    No locked instruction and no barrier for the owner as long as nobody
+    else comes. Once the owner has exited, a thread the kernel gives the
+    same tid owns the lock: initialize it again rather than handing it
+    over that way.
+
+    A big-reader lock (brlock) is the same for many readers and a rare
+    writer: each reader raises a flag of its own, in a slot picked by the
+    index of its TCB, and checks the writer's after a light fence; the
+    writer raises its flag, runs a heavy fence, and waits for all the
+    readers' flags to drop. A flag counts the read locks its thread holds:
+    a reader already in takes the lock again without looking at the writer,
+    who waits for it anyway. The readers past BRLOCK_SLOTS, or without a
+    TCB of the runtime, count themselves with an atomic addition instead,
+    and must not take the lock again while holding it: the writer would
+    wait for them while they wait for the writer. A reader finding the
+    writer in spins a little, then sleeps until the writer is out.
+
+    A fiber must not hold either lock across a switch. The non-owners of
+    a biased lock and the brlock writer spin while the other side holds it.
+*/
+
+#define BRLOCK_SLOTS        64
+#define BRLOCK_SPIN         100
+
+typedef struct _biased_lock_t
+{
+    volatile u32    owner_in __attribute__((aligned(CACHE_LINE_SIZE)));
+    u32             owner_slow;     /* The owner went through the mutex */
+    i64             owner;          /* The tid of the owner */
+    volatile u32    others_in __attribute__((aligned(CACHE_LINE_SIZE)));
+    mutex_t         mutex;
+} biased_lock_t;
+
+/*
+    The calling thread becomes the owner.
+*/
+void biased_lock_init(biased_lock_t* lock);
+void biased_lock(biased_lock_t* lock);
+void biased_unlock(biased_lock_t* lock);
+
+typedef struct _brlock_slot_t
+{
+    volatile u32    in;             /* Read locks held */
+} __attribute__((aligned(CACHE_LINE_SIZE))) brlock_slot_t;
+
+typedef struct _brlock_t
+{
+    volatile i32    writer;         /* 1 while a writer is in or on its way */
+    volatile u32    overflow;       /* Readers without a slot */
+    mutex_t         mutex;          /* Between the writers */
+    brlock_slot_t   slots[BRLOCK_SLOTS];
+} brlock_t;
+
+void brlock_init(brlock_t* lock);
+void brlock_read_lock(brlock_t* lock);
+void brlock_read_unlock(brlock_t* lock);
+void brlock_write_lock(brlock_t* lock);
+void brlock_write_unlock(brlock_t* lock);
+
+#endif
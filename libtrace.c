@@ -0,0 +1,297 @@
+#include "libtrace.h"
+
+static struct
+{
+    trace_ring_t* volatile  rings[THREAD_POOL_SIZE + 1];    /* By TLS block index, mapped on the first event */
+    volatile u64            rings_end;                      /* Highest index with a ring, plus one */
+    volatile u32            active;
+    volatile i32            stop __attribute__((aligned(4)));   /* The drain thread sleeps on it */
+    volatile u32            drain_sleeping;
+    i64                     fd;
+    thread_t*               drain;
+    u64                     batch_used;
+    u8                      batch[TRACE_BATCH_SIZE];
+} trace;
+
+/*
+    The thread of the index is the only one to map its ring, the drain
+    thread finds it through 'rings'.
+*/
+static trace_ring_t* trace_ring_map(u64 index)
+{
+    u64 ring = sys_mmap(0, sizeof(trace_ring_t), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+
+    if ((i64)ring < 0 && (i64)ring >= -4095)
+    {
+        return NULL;
+    }
+
+    atomic_store(&trace.rings[index], (trace_ring_t*)ring, ATOMIC_RELEASE);
+
+    u64 end = trace.rings_end;
+
+    while (end < index + 1 && !atomic_cas(&trace.rings_end, end, index + 1, ATOMIC_RELEASE))
+    {
+        end = trace.rings_end;
+    }
+
+    return (trace_ring_t*)ring;
+}
+
+void trace_emit(u16 event, u16 nargs, u64 a0, u64 a1, u64 a2, u64 a3)
+{
+    if (!trace.active)
+    {
+        return;
+    }
+
+    thread_tcb_t* tcb = runtime_tcb();
+
+    if (tcb == NULL)
+    {
+        return;
+    }
+
+    trace_ring_t* ring = trace.rings[tcb->index];
+
+    if (ring == NULL && (ring = trace_ring_map(tcb->index)) == NULL)
+    {
+        return;
+    }
+
+    const u64 head = ring->head;
+
+    if (head - atomic_load(&ring->tail, ATOMIC_ACQUIRE) >= TRACE_RING_SIZE)
+    {
+        ring->dropped = ring->dropped + 1;
+
+        return;
+    }
+
+    trace_record_t* record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+
+    record->timestamp = cycle_counter();
+    record->tid       = tcb->tid;
+    record->event     = event;
+    record->nargs     = nargs;
+    record->args[0]   = a0;
+    record->args[1]   = a1;
+    record->args[2]   = a2;
+    record->args[3]   = a3;
+
+    /* The drain thread reads the record after it sees the new head */
+    atomic_store(&ring->head, head + 1, ATOMIC_RELEASE);
+
+    /* Half full: better drained now than at the end of the interval, one thread wakes it */
+    if (head + 1 - ring->tail == TRACE_RING_SIZE/2 && trace.drain_sleeping &&
+        atomic_exchange(&trace.drain_sleeping, 0, ATOMIC_RELAXED))
+    {
+        sys_futex(&trace.stop, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
+    }
+}
+
+void trace_name(u16 event, const char* name)
+{
+    u64 chars[3] = { 0, 0, 0 };
+    u64 len = strlen(name);
+
+    memcpy(chars, name, len < sizeof(chars) ? len : sizeof(chars));
+    trace_emit(TRACE_EVENT_NAME, 4, event, chars[0], chars[1], chars[2]);
+}
+
+u64 trace_dropped(void)
+{
+    u64 dropped = 0;
+
+    for (u64 i = 0; i < trace.rings_end; ++i)
+    {
+        trace_ring_t* ring = atomic_load(&trace.rings[i], ATOMIC_ACQUIRE);
+
+        if (ring != NULL)
+        {
+            dropped += ring->dropped;
+        }
+    }
+
+    return dropped;
+}
+
+/*
+    The drain thread
+*/
+
+static void trace_batch_flush(void)
+{
+    u64 written = 0;
+
+    while (written < trace.batch_used)
+    {
+        i64 s = sys_write(trace.fd, trace.batch + written, trace.batch_used - written);
+
+        if (s <= 0)
+        {
+            break;
+        }
+
+        written += s;
+    }
+
+    trace.batch_used = 0;
+}
+
+static void trace_batch_add(const trace_record_t* record)
+{
+    if (trace.batch_used + sizeof(trace_record_t) > TRACE_BATCH_SIZE)
+    {
+        trace_batch_flush();
+    }
+
+    memcpy(trace.batch + trace.batch_used, record, sizeof(trace_record_t));
+    trace.batch_used += sizeof(trace_record_t);
+}
+
+static void trace_drain_ring(u64 index, trace_ring_t* ring)
+{
+    const u64 head = atomic_load(&ring->head, ATOMIC_ACQUIRE);
+    u64 tail = ring->tail;
+
+    for (; tail != head; ++tail)
+    {
+        trace_batch_add(&ring->records[tail & (TRACE_RING_SIZE - 1)]);
+    }
+
+    /* The thread may reuse the records from now on */
+    atomic_store(&ring->tail, tail, ATOMIC_RELEASE);
+
+    const u64 dropped = ring->dropped;
+
+    if (dropped != ring->reported)
+    {
+        const trace_record_t record = {
+            .timestamp = cycle_counter(),
+            .event = TRACE_EVENT_DROPPED,
+            .nargs = 2,
+            .args = { dropped - ring->reported, index, 0, 0 },
+        };
+
+        trace_batch_add(&record);
+        ring->reported = dropped;
+    }
+}
+
+static void trace_drain_all(void)
+{
+    for (u64 i = 0; i < trace.rings_end; ++i)
+    {
+        trace_ring_t* ring = atomic_load(&trace.rings[i], ATOMIC_ACQUIRE);
+
+        if (ring != NULL)
+        {
+            trace_drain_ring(i, ring);
+        }
+    }
+
+    trace_batch_flush();
+}
+
+static u64 trace_drain_thread(void* param)
+{
+    for (;;)
+    {
+        /* Read before the last pass, so that it sees everything emitted before trace_stop */
+        const i32 stop = trace.stop;
+
+        trace_drain_all();
+
+        if (stop)
+        {
+            break;
+        }
+
+        const struct timespec interval = { .tv_sec = 0, .tv_nsec = TRACE_DRAIN_INTERVAL_NS };
+
+        atomic_store(&trace.drain_sleeping, 1, ATOMIC_RELAXED);
+        sys_futex(&trace.stop, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, 0, &interval, NULL, 0);
+        atomic_store(&trace.drain_sleeping, 0, ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+i64 trace_start(const char* path)
+{
+    if (trace.active)
+    {
+        return -EBUSY;
+    }
+
+    i64 fd = sys_openat(AT_FDCWD, path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+    {
+        return fd;
+    }
+
+    const trace_header_t header = {
+        .magic = TRACE_MAGIC,
+        .record_size = sizeof(trace_record_t),
+        .counter_hz = cycle_counter_hz(),
+        .start = cycle_counter(),
+    };
+
+    if (sys_write(fd, &header, sizeof(header)) != sizeof(header))
+    {
+        sys_close(fd);
+
+        return -EIO;
+    }
+
+    /* What is left in the rings from an earlier trace is not wanted */
+    for (u64 i = 0; i < trace.rings_end; ++i)
+    {
+        trace_ring_t* ring = trace.rings[i];
+
+        if (ring != NULL)
+        {
+            ring->tail = ring->head;
+            ring->reported = ring->dropped;
+        }
+    }
+
+    trace.fd = fd;
+    trace.stop = 0;
+    trace.drain_sleeping = 0;
+    trace.batch_used = 0;
+    trace.drain = create_thread(trace_drain_thread, NULL, NULL);
+
+    if (trace.drain == NULL)
+    {
+        sys_close(fd);
+
+        return -ENOMEM;
+    }
+
+    trace.active = 1;
+
+    return 0;
+}
+
+void trace_stop(void)
+{
+    if (!trace.active)
+    {
+        return;
+    }
+
+    trace.active = 0;
+
+    atomic_store(&trace.stop, 1, ATOMIC_RELEASE);
+    sys_futex(&trace.stop, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
+
+    thread_join(trace.drain);
+
+    /* What the threads emitted while they still saw the trace active */
+    trace_drain_all();
+
+    sys_close(trace.fd);
+}
@@ -0,0 +1,100 @@
+#ifndef __LIBTRACE_H__
+#define __LIBTRACE_H__
+
+#include "lib.h"
+
+/*
+    Binary event trace.
+
+    trace_emit stores a fixed-size record in a ring of the calling thread and
+    returns: no lock, no waiting, and no system call but to wake the drain
+    thread when the ring gets half full. When the ring is full, the record is
+    dropped and counted. The drain thread moves the records from all the
+    rings to a file in batches, every TRACE_DRAIN_INTERVAL_NS or when woken;
+    trace-decode prints the file as text.
+
+    The rings belong to the TLS block indices, not to the threads: a thread
+    reusing a slot writes to the ring of the thread that had it before, and
+    the fibers write to the ring of their carrier. Each ring is written by
+    one thread and read by the drain thread only.
+
+    The file is a trace_header_t followed by the records.
+*/
+
+/*
+    Records per ring, a power of 2: 384 KiB, mapped on the first event and
+    touched as the ring fills. At a few tens of nanoseconds per event, a
+    thread emitting without a pause fills half of it well within the drain
+    interval, and wakes the drain thread.
+*/
+#define TRACE_RING_SIZE         8192
+#define TRACE_BATCH_SIZE        (64*1024)   /* Bytes the drain thread writes at once */
+#define TRACE_DRAIN_INTERVAL_NS 1000000
+
+#define TRACE_MAGIC             0x3130454341525455ULL   /* "UTRACE01" */
+
+/* Events the runtime emits itself */
+#define TRACE_EVENT_NAME        0xfffe      /* args: the event, then up to 24 characters of its name */
+#define TRACE_EVENT_DROPPED     0xffff      /* args: records dropped, index of the ring */
+
+typedef struct _trace_header_t
+{
+    u64 magic;
+    u64 record_size;
+    u64 counter_hz;         /* Ticks of the timestamps per second */
+    u64 start;              /* Timestamp of trace_start */
+} trace_header_t;
+
+typedef struct _trace_record_t
+{
+    u64 timestamp;          /* cycle_counter */
+    u32 tid;
+    u16 event;
+    u16 nargs;
+    u64 args[4];
+} trace_record_t;
+
+typedef struct _trace_ring_t
+{
+    volatile u64    head;   /* Written by the thread */
+    volatile u64    dropped;
+    u64             pad0[6];
+    volatile u64    tail;   /* Written by the drain thread */
+    u64             reported;
+    u64             pad1[6];
+    trace_record_t  records[TRACE_RING_SIZE];
+} trace_ring_t;
+
+/*
+    Create the file and start the drain thread. Returns 0 or -errno.
+*/
+i64 trace_start(const char* path);
+
+/*
+    Stop the drain thread, drain what is left and close the file.
+*/
+void trace_stop(void);
+
+/*
+    Record an event with 0 to 4 arguments. Does nothing if the trace has not
+    been started, or the thread has no TCB.
+*/
+void trace_emit(u16 event, u16 nargs, u64 a0, u64 a1, u64 a2, u64 a3);
+
+#define trace_event0(event)                 trace_emit((event), 0, 0, 0, 0, 0)
+#define trace_event1(event, a0)             trace_emit((event), 1, (a0), 0, 0, 0)
+#define trace_event2(event, a0, a1)         trace_emit((event), 2, (a0), (a1), 0, 0)
+#define trace_event3(event, a0, a1, a2)     trace_emit((event), 3, (a0), (a1), (a2), 0)
+#define trace_event4(event, a0, a1, a2, a3) trace_emit((event), 4, (a0), (a1), (a2), (a3))
+
+/*
+    Give the event a name for the decoder, up to 24 characters are kept.
+*/
+void trace_name(u16 event, const char* name);
+
+/*
+    Records dropped by all the rings so far.
+*/
+u64 trace_dropped(void);
+
+#endif
@@ -54,8 +54,11 @@ u64 buzz(void* param)
     return bar(param);
 }
 
+ENTRY_POINT
 u64 _start()
 {
+    runtime_init();
+
     void* param = 0;
 
     for (u64 i = 0; i < NUM_THREADS; ++i)
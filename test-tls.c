@@ -14,6 +14,11 @@ __attribute__((tls_model("local-exec")))
 __attribute__((used))
 static __thread u64 thread_local_2;
 
+/* Goes to .tdata, every thread starts with its own copy of the initializer */
+__attribute__((tls_model("local-exec")))
+__attribute__((used))
+static __thread u64 thread_local_init = 0x1122334455667788ULL;
+
 /* Four 4KiB pages to be the TLS backing store for this thread */
 /* Spares a mmap call. */
 u64 tls_pages[2048] __attribute__((aligned(4096))) = {};
@@ -246,11 +251,11 @@ void access_tls_x64_cool()
 
 typedef struct _thread_context_t
 {
-    volatile i32    exited_futex __attribute__((aligned(4)));
     u64             thread_num;
+    void*           tls;            /* NULL: the thread gets its own TLS block */
 } thread_context_t;
 
-void access_tls()
+void access_tls(thread_context_t* thread_context)
 {
     println();
 
@@ -263,8 +268,25 @@ void access_tls()
     print("thread_local_0: "); print_h64(thread_local_0); println();
     print("thread_local_1: "); print_h64(thread_local_1); println();
     print("thread_local_2: "); print_h64(thread_local_2); println();
+    print("&thread_local_0: "); print_h64((u64)&thread_local_0); println();
+    print("thread_local_init: "); print_h64(thread_local_init); println();
+
+    /* The next thread must not see this */
+    thread_local_init += thread_context->thread_num;
 
-    find_values_in_tls();
+    if (thread_context->tls != NULL)
+    {
+        find_values_in_tls();
+    }
+    else
+    {
+        thread_tcb_t* tcb = thread_self();
+
+        print("TCB: "); print_h64((u64)tcb); println();
+        print("tid: "); print_h64(tcb->tid); println();
+        print("index: "); print_h64(tcb->index); println();
+        print("stack: "); print_h64((u64)tcb->stack_limit); print(" - "); print_h64((u64)tcb->stack_base); println();
+    }
 }
 
 u64 thread_0(void* param)
@@ -273,36 +295,257 @@ u64 thread_0(void* param)
 
     print("Thread # "); print_h64(thread_context->thread_num); println();
 
-    access_tls();
+    access_tls(thread_context);
 
     print("Thread # "); print_h64(thread_context->thread_num); print(" exited "); println();
 
-    futex_release(&thread_context->exited_futex);
+    return 0;
+}
 
-    sys_exit(0);
+/*
+    Thread groups: the threads exit one at a time in the order given, each
+    when its turn comes, and thread_group_join_any must return them in that
+    order. Once all are joined, it returns -ECHILD. Without futex_waitv it
+    joins the first thread still running, so the exits go in spawn order.
+*/
+
+#define GROUP_THREADS   4
+
+static const u32 group_exit_order[GROUP_THREADS] = { 2, 0, 3, 1 };
+static const u32 group_spawn_order[GROUP_THREADS] = { 0, 1, 2, 3 };
+static volatile i32 group_turn = -1;
+
+u64 group_thread(void* param)
+{
+    const i32 index = (i32)(u64)param;
+
+    for (;;)
+    {
+        const i32 turn = group_turn;
+
+        if (turn == index)
+        {
+            break;
+        }
+
+        sys_futex(&group_turn, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, turn, NULL, NULL, 0);
+    }
+
+    return 100 + index;
+}
+
+void test_thread_group(const char* name, u32 flags, const u32* order)
+{
+    thread_group_t group;
+
+    thread_group_init(&group, flags);
+    group_turn = -1;
+
+    for (u64 i = 0; i < GROUP_THREADS; ++i)
+    {
+        i64 index = thread_group_spawn(&group, group_thread, (void*)i);
+
+        if (index != (i64)i)
+        {
+            fatal("thread_group_spawn", index);
+        }
+    }
+
+    for (u64 i = 0; i < GROUP_THREADS; ++i)
+    {
+        /* Let the next one exit, the others keep waiting */
+        atomic_store(&group_turn, (i32)order[i], ATOMIC_RELEASE);
+        sys_futex(&group_turn, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, GROUP_THREADS, NULL, NULL, 0);
+
+        i64 index = thread_group_join_any(&group);
+
+        if (index != order[i] || group.results[index] != 100 + order[i])
+        {
+            fatal("thread_group_join_any", index);
+        }
+    }
+
+    i64 s = thread_group_join_any(&group);
+
+    if (s != -ECHILD)
+    {
+        fatal("thread_group_join_any", s);
+    }
+
+    print(name); print(": the thread group joined in the order of the exits"); println();
+}
+
+/*
+    Condition variables: CONDVAR_WAITERS threads wait for a broadcast, then
+    each for a signal of its own. Every one of them must wake up from the
+    broadcast, and from exactly one of the signals, with the mutex held:
+    a waiter that finds another inside the mutex fails the test.
+*/
+
+#define CONDVAR_WAITERS 4
+
+static struct
+{
+    mutex_t     mutex;
+    condvar_t   cv;             /* The waiters wait on it */
+    condvar_t   done;           /* The test waits on it for the waiters */
+    u32         inside;         /* Waiters holding the mutex */
+    u32         waiting;        /* Waiters past their first lock */
+    u32         broadcast;      /* Set before the broadcast */
+    u32         woken;          /* Waiters back from the broadcast */
+    u32         tickets;        /* One per signal */
+    u32         signalled;      /* Waiters back from a signal */
+} cv_test;
+
+static void cv_enter(void)
+{
+    if (cv_test.inside++ != 0)
+    {
+        fatal("Two waiters hold the mutex", cv_test.inside);
+    }
+}
+
+static void cv_leave(void)
+{
+    --cv_test.inside;
+}
+
+u64 cv_waiter(void* param)
+{
+    (void)param;
+
+    mutex_lock(&cv_test.mutex);
+    cv_enter();
+
+    ++cv_test.waiting;
+    condvar_signal(&cv_test.done);
+
+    while (!cv_test.broadcast)
+    {
+        cv_leave();
+        condvar_wait(&cv_test.cv, &cv_test.mutex);
+        cv_enter();
+    }
+
+    ++cv_test.woken;
+    condvar_signal(&cv_test.done);
+
+    while (cv_test.tickets == 0)
+    {
+        cv_leave();
+        condvar_wait(&cv_test.cv, &cv_test.mutex);
+        cv_enter();
+    }
+
+    --cv_test.tickets;
+    ++cv_test.signalled;
+    condvar_signal(&cv_test.done);
+
+    cv_leave();
+    mutex_unlock(&cv_test.mutex);
 
     return 0;
 }
 
+/* With the mutex held */
+static void cv_wait_for(const u32* count, u32 value)
+{
+    while (*count != value)
+    {
+        condvar_wait(&cv_test.done, &cv_test.mutex);
+    }
+}
+
+void test_condvar(void)
+{
+    thread_t* threads[CONDVAR_WAITERS];
+
+    memset(&cv_test, 0, sizeof(cv_test));
+    mutex_init(&cv_test.mutex);
+    condvar_init(&cv_test.cv);
+    condvar_init(&cv_test.done);
+
+    for (u64 i = 0; i < CONDVAR_WAITERS; ++i)
+    {
+        threads[i] = create_thread(cv_waiter, NULL, NULL);
+
+        if (threads[i] == NULL)
+        {
+            fatal("create_thread", i);
+        }
+    }
+
+    /* All of them waiting on cv, or woken and back in the mutex */
+    mutex_lock(&cv_test.mutex);
+    cv_wait_for(&cv_test.waiting, CONDVAR_WAITERS);
+
+    cv_test.broadcast = 1;
+    condvar_broadcast(&cv_test.cv);
+
+    cv_wait_for(&cv_test.woken, CONDVAR_WAITERS);
+    mutex_unlock(&cv_test.mutex);
+
+    for (u64 i = 0; i < CONDVAR_WAITERS; ++i)
+    {
+        mutex_lock(&cv_test.mutex);
+        ++cv_test.tickets;
+        condvar_signal(&cv_test.cv);
+        mutex_unlock(&cv_test.mutex);
+    }
+
+    mutex_lock(&cv_test.mutex);
+    cv_wait_for(&cv_test.signalled, CONDVAR_WAITERS);
+    mutex_unlock(&cv_test.mutex);
+
+    for (u64 i = 0; i < CONDVAR_WAITERS; ++i)
+    {
+        thread_join(threads[i]);
+    }
+
+    if (cv_test.tickets != 0 || cv_test.inside != 0)
+    {
+        fatal("condvar", cv_test.tickets);
+    }
+
+    print("Condition variables: every waiter woke up from the broadcast and a signal"); println();
+}
+
 /***************************** ENTRY POINT ****************************************/
 
+ENTRY_POINT
 void _start()
 {
-    /* futex == 0: State: unavailable */
-    /* futex == 1: State: available */
+    runtime_init();
 
-    thread_context_t thread_context = {
-        .exited_futex = 0,
-        .thread_num = 1
+    /* 
+        The first thread uses the static backing store, where the TLS image
+        has not been copied to, the others get their blocks from the TLS slab.
+    */
+    thread_context_t thread_context[] = {
+        { .thread_num = 1, .tls = ((char*)tls_pages) + 4096 },
+        { .thread_num = 2, .tls = NULL },
+        { .thread_num = 3, .tls = NULL },
     };
 
-    void* tls = ((char*)tls_pages) + 4096;
-
     print("Process started\n");
 
-    create_thread(thread_0, &thread_context, tls);
+    for (u64 i = 0; i < sizeof(thread_context)/sizeof(thread_context[0]); ++i)
+    {
+        thread_t* thread = create_thread(thread_0, &thread_context[i], thread_context[i].tls);
+
+        if (thread == NULL)
+        {
+            fatal("create_thread", i);
+        }
+
+        /* Woken up by the kernel when it clears the tid of the exited thread */
+        thread_join(thread);
+    }
+
+    test_thread_group("futex_waitv", 0, group_exit_order);
+    test_thread_group("Without futex_waitv", THREAD_GROUP_NO_WAITV, group_spawn_order);
 
-    futex_acquire(&thread_context.exited_futex);
+    test_condvar();
 
     print("Process exited\n");
 
@@ -0,0 +1,156 @@
+#include "lib.c"
+
+/*
+    Print a trace written by libtrace as text:
+
+        trace-decode [file]     (trace.bin by default)
+
+    One line per record: nanoseconds since trace_start, thread id, event name
+    or number, arguments. The records come in the order the drain thread
+    wrote them: by time within a thread, by batch across threads.
+*/
+
+#define TRACE_NAMES_MAX     1024
+
+static char names[TRACE_NAMES_MAX][32];
+static u8 buffer[TRACE_BATCH_SIZE / sizeof(trace_record_t) * sizeof(trace_record_t)];
+static char cmdline[4096];
+
+/*
+    argv[1] from /proc/self/cmdline, the arguments separated by zeros
+*/
+static const char* first_argument(void)
+{
+    i64 fd = sys_openat(AT_FDCWD, "/proc/self/cmdline", O_RDONLY, 0);
+
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    i64 len = sys_read(fd, cmdline, sizeof(cmdline) - 1);
+
+    sys_close(fd);
+
+    if (len <= 0)
+    {
+        return NULL;
+    }
+
+    cmdline[len] = 0;
+
+    const u64 argv0_len = strlen(cmdline);
+
+    return (i64)argv0_len + 1 < len ? cmdline + argv0_len + 1 : NULL;
+}
+
+static u64 read_full(i64 fd, void* buf, u64 count)
+{
+    u64 total = 0;
+
+    while (total < count)
+    {
+        i64 s = sys_read(fd, (u8*)buf + total, count - total);
+
+        if (s <= 0)
+        {
+            break;
+        }
+
+        total += s;
+    }
+
+    return total;
+}
+
+static void decode(const trace_header_t* header, const trace_record_t* record)
+{
+    const u64 ticks = record->timestamp - header->start;
+    const u64 ns = ticks / header->counter_hz * 1000000000ULL + ticks % header->counter_hz * 1000000000ULL / header->counter_hz;
+
+    switch (record->event)
+    {
+    case TRACE_EVENT_NAME:
+        if (record->args[0] < TRACE_NAMES_MAX)
+        {
+            memcpy(names[record->args[0]], &record->args[1], 24);
+        }
+        return;
+
+    case TRACE_EVENT_DROPPED:
+        print_fmt("%12llu  dropped %llu records in ring %llu\r\n", ns, record->args[0], record->args[1]);
+        return;
+    }
+
+    print_fmt("%12llu  tid %-7u ", ns, record->tid);
+
+    if (record->event < TRACE_NAMES_MAX && names[record->event][0] != 0)
+    {
+        print_fmt("%-24s", names[record->event]);
+    }
+    else
+    {
+        print_fmt("event %-18u", record->event);
+    }
+
+    for (u64 i = 0; i < record->nargs && i < 4; ++i)
+    {
+        print_fmt(" %llx", record->args[i]);
+    }
+
+    println();
+}
+
+ENTRY_POINT
+void _start()
+{
+    runtime_init();
+
+    const char* path = first_argument();
+
+    if (path == NULL)
+    {
+        path = "trace.bin";
+    }
+
+    i64 fd = sys_openat(AT_FDCWD, path, O_RDONLY, 0);
+
+    if (fd < 0)
+    {
+        print_fmt("Cannot open %s: %lld\r\n", path, fd);
+        sys_exit(1);
+    }
+
+    trace_header_t header;
+
+    if (read_full(fd, &header, sizeof(header)) != sizeof(header) ||
+        header.magic != TRACE_MAGIC || header.record_size != sizeof(trace_record_t) || header.counter_hz == 0)
+    {
+        print_fmt("%s is not a trace\r\n", path);
+        sys_exit(1);
+    }
+
+    u64 records = 0;
+
+    for (;;)
+    {
+        const u64 len = read_full(fd, buffer, sizeof(buffer));
+
+        for (u64 offset = 0; offset + sizeof(trace_record_t) <= len; offset += sizeof(trace_record_t))
+        {
+            decode(&header, (const trace_record_t*)(buffer + offset));
+            ++records;
+        }
+
+        if (len < sizeof(buffer))
+        {
+            break;
+        }
+    }
+
+    sys_close(fd);
+
+    print_fmt("%llu records\r\n", records);
+
+    sys_exit(0);
+}